@@ -0,0 +1,29 @@
+#!/bin/sh
+# Compare two bench/suite.sh results (say, the last release and now). Prints
+# every measurement found in both with its change in percent, and marks a
+# change for the worse beyond the threshold as a regression: more time
+# (ms, us) or less throughput (MiB/s, files/s). Other rows are listed only.
+# Exits 1 when anything regressed.
+# Usage: bench/compare.sh old.csv new.csv [threshold_percent]   (default 10; prints CSV)
+set -e
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 old.csv new.csv [threshold_percent]" >&2
+    exit 2
+fi
+awk -F, -v th="${3:-10}" '
+    FNR == 1 { next }
+    $1 == "meta" { next }
+    NR == FNR { old[$1 "," $2 "," $3] = $4; next }
+    {
+        key = $1 "," $2 "," $3
+        if (!(key in old)) next
+        if (!header++) print "suite,case,metric,old,new,change_pct,verdict"
+        o = old[key] + 0; n = $4 + 0
+        pct = o != 0 ? (n - o) * 100 / o : 0
+        worse = ($5 == "ms" || $5 == "us") ? pct : ($5 == "MiB/s" || $5 == "files/s") ? -pct : 0
+        verdict = worse > th ? "REGRESSION" : worse < -th ? "improved" : ""
+        if (verdict == "REGRESSION") bad++
+        printf "%s,%s,%s,%.1f,%s\n", key, old[key], $4, pct, verdict
+    }
+    END { exit bad ? 1 : 0 }
+' "$1" "$2"
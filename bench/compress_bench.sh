@@ -0,0 +1,65 @@
+#!/bin/sh
+# Compression ratio and throughput of mkfs_adder --compress on text.
+# The corpus is COPIES copies of this tree's sources and README (each
+# copy with its number appended, so no two files are alike) plus LOGS
+# generated log files of KIB KiB. It is imported into a fresh image with
+# and without --compress, then extracted again with mkfs_reader; data
+# blocks in use come from mkfs_fsck, ratio is corpus bytes over the bytes
+# of those blocks, and both throughputs are corpus MiB per second.
+# Usage: bench/compress_bench.sh [builder] [adder] [reader] [fsck] [copies] [logs] [kib]   (prints CSV)
+set -e
+BUILDER=${1:-./mkfs_builder}
+ADDER=${2:-./mkfs_adder}
+READER=${3:-./mkfs_reader}
+FSCK=${4:-./mkfs_fsck}
+COPIES=${5:-20}
+LOGS=${6:-32}
+KIB=${7:-512}
+SRC=$(dirname "$0")/..
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ns() { date +%s%N; }
+
+c=0
+while [ $c -lt "$COPIES" ]; do
+    mkdir -p "$WORK/tree/c$c"
+    for f in "$SRC"/*.c "$SRC"/*.h "$SRC"/README.md; do
+        { cat "$f"; echo "// copy $c"; } > "$WORK/tree/c$c/$(basename "$f")"
+    done
+    c=$((c + 1))
+done
+mkdir -p "$WORK/tree/logs"
+l=0
+while [ $l -lt "$LOGS" ]; do
+    awk -v n=$((KIB * 1024 / 80)) -v s=$l 'BEGIN { srand(s); for (i = 0; i < n; i++)
+        printf "2025-09-%02d %02d:%02d:%02d host%d svc[%d]: request id=%d status=%d bytes=%d\n",
+               1 + i % 28, i % 24, i % 60, (i * 7) % 60, s % 8, 1000 + int(rand() * 50),
+               i, (rand() < 0.9) ? 200 : 500, int(rand() * 100000) }' > "$WORK/tree/logs/l$l.log"
+    l=$((l + 1))
+done
+BYTES=$(find "$WORK/tree" -type f -exec cat {} + | wc -c)
+FILES=$(find "$WORK/tree" -type f | wc -l)
+SIZE_KIB=$(( BYTES / 1024 * 2 + FILES * 8 + 8192 ))
+SIZE_KIB=$(( (SIZE_KIB + 3) / 4 * 4 ))
+INODES=$(( FILES + COPIES + 64 ))
+[ $INODES -ge 128 ] || INODES=128
+
+mibs() { awk -v b="$BYTES" -v ns="$1" 'BEGIN { printf "%.1f", (ns > 0 ? b / 1048576 / (ns / 1e9) : 0) }'; }
+
+echo "mode,bytes,data_blocks_used,ratio,ingest_ms,ingest_mib_s,extract_ms,extract_mib_s"
+for MODE in plain compress; do
+    flag=""
+    [ $MODE = compress ] && flag=--compress
+    "$BUILDER" --image "$WORK/img" --size-kib $SIZE_KIB --inodes $INODES 2>/dev/null
+    t0=$(now_ns)
+    "$ADDER" --input "$WORK/img" --in-place --dir "$WORK/tree" $flag 2>/dev/null
+    t1=$(now_ns)
+    rm -rf "$WORK/out"
+    "$READER" --image "$WORK/img" --extract "$WORK/out" 2>/dev/null
+    t2=$(now_ns)
+    diff -r "$WORK/tree" "$WORK/out" >/dev/null
+    used=$("$FSCK" --image "$WORK/img" 2>&1 | sed -n 's/.* \([0-9]*\) of [0-9]* data blocks in use/\1/p')
+    ratio=$(awk -v b="$BYTES" -v u="$used" 'BEGIN { printf "%.2f", b / (u * 4096) }')
+    echo "$MODE,$BYTES,$used,$ratio,$(( (t1 - t0) / 1000000 )),$(mibs $((t1 - t0))),$(( (t2 - t1) / 1000000 )),$(mibs $((t2 - t1)))"
+done
@@ -0,0 +1,48 @@
+// CRC32 microbenchmark: throughput per engine and buffer size. That the
+// engines agree is checked by tests/crc_check (make check).
+// Build: make bench/crc32_bench
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "vsfs_crc32.h"
+
+static const vsfs_crc_impl_t IMPLS[] = { VSFS_CRC_BYTEWISE, VSFS_CRC_SLICE8, VSFS_CRC_SLICE16, VSFS_CRC_PCLMUL };
+#define NIMPLS (sizeof(IMPLS) / sizeof(IMPLS[0]))
+
+static double now_s(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int main(void) {
+    vsfs_crc32_init();
+
+    const size_t max = 1u << 20;
+    uint8_t *buf = (uint8_t*)malloc(max + 64);
+    if (!buf) { fprintf(stderr, "Error: OOM\n"); return 1; }
+    srand(1);
+    for (size_t i = 0; i < max + 64; i++) buf[i] = (uint8_t)rand();
+
+    // Throughput: 120 B (inode), 4092 B (superblock), 4 KiB (block), 1 MiB.
+    const size_t sizes[] = { 120, 4092, 4096, 1u << 20 };
+    printf("impl,bytes,MiB_per_s\n");
+    for (size_t k = 0; k < NIMPLS; k++) {
+        if (vsfs_crc32_select(IMPLS[k]) != 0) continue;
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t n = sizes[s];
+            size_t iters = (256u << 20) / n / (IMPLS[k] == VSFS_CRC_BYTEWISE ? 4 : 1);
+            volatile uint32_t sink = 0;
+            double t0 = now_s();
+            for (size_t i = 0; i < iters; i++) sink ^= vsfs_crc32(buf, n);
+            double dt = now_s() - t0;
+            (void)sink;
+            printf("%s,%zu,%.1f\n", vsfs_crc32_impl_name(), n, (double)n * (double)iters / dt / (1024.0 * 1024.0));
+        }
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Space and write savings of mkfs_adder --dedup on a sample corpus.
+# The corpus mimics a tree of versioned files: BASES distinct files of KIB
+# KiB, each followed by VERSIONS copies with one 4 KiB block rewritten,
+# plus one zero-filled file per base (sparse-style padding). The tree is
+# imported into a fresh image with and without --dedup; data blocks in use
+# come from mkfs_fsck. Blocks written is the in-place write count, plus,
+# without --dedup, the file blocks copied straight into the image file
+# (those bypass the mapping and are not in that count).
+# Usage: bench/dedup_bench.sh [builder] [adder] [fsck] [bases] [versions] [kib]   (prints CSV)
+set -e
+BUILDER=${1:-./mkfs_builder}
+ADDER=${2:-./mkfs_adder}
+FSCK=${3:-./mkfs_fsck}
+BASES=${4:-64}
+VERSIONS=${5:-4}
+KIB=${6:-256}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ns() { date +%s%N; }
+
+b=0
+while [ $b -lt "$BASES" ]; do
+    d="$WORK/tree/p$b"
+    mkdir -p "$d"
+    head -c $((KIB * 1024)) /dev/urandom > "$d/v0"
+    v=1
+    while [ $v -le "$VERSIONS" ]; do
+        cp "$d/v0" "$d/v$v"
+        head -c 4096 /dev/urandom | dd of="$d/v$v" bs=4096 seek=$(( (v * 7) % (KIB / 4) )) conv=notrunc 2>/dev/null
+        v=$((v + 1))
+    done
+    head -c $((KIB * 1024)) /dev/zero > "$d/zero"
+    b=$((b + 1))
+done
+FILES=$(( BASES * (VERSIONS + 2) ))
+SIZE_KIB=$(( FILES * (KIB + KIB / 256 + 16) + 8192 ))
+INODES=$(( FILES + BASES + 64 ))
+[ $INODES -ge 128 ] || INODES=128
+
+echo "mode,ms,data_blocks_used,blocks_written,kib_saved"
+for MODE in plain dedup; do
+    flag=""
+    [ $MODE = dedup ] && flag=--dedup
+    "$BUILDER" --image "$WORK/img" --size-kib $SIZE_KIB --inodes $INODES $flag 2>/dev/null
+    t0=$(now_ns)
+    "$ADDER" --input "$WORK/img" --in-place --dir "$WORK/tree" $flag 2> "$WORK/log"
+    t1=$(now_ns)
+    written=$(sed -n 's/^OK: wrote \([0-9]*\) of.*/\1/p' "$WORK/log")
+    [ $MODE = dedup ] || written=$(( written + FILES * KIB / 4 ))
+    saved=$(sed -n 's/.*(\([0-9]*\) KiB not stored.*/\1/p' "$WORK/log")
+    used=$("$FSCK" --image "$WORK/img" 2>&1 | sed -n 's/.* \([0-9]*\) of [0-9]* data blocks in use/\1/p')
+    echo "$MODE,$(( (t1 - t0) / 1000000 )),$used,$written,${saved:-0}"
+done
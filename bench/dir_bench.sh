@@ -0,0 +1,29 @@
+#!/bin/sh
+# Directory add/lookup latency as the root directory grows.
+# For each N: add N tiny files in one batch (N inserts), then offer the same
+# N names again (N lookups that hit and are rejected as duplicates).
+# Usage: bench/dir_bench.sh [builder] [adder]   (prints CSV)
+set -e
+BUILDER=${1:-./mkfs_builder}
+ADDER=${2:-./mkfs_adder}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ns() { date +%s%N; }
+
+echo "entries,add_us_per_op,lookup_us_per_op"
+for N in 100 1000 4000 16000; do
+    mkdir -p "$WORK/f$N"
+    i=0
+    while [ $i -lt $N ]; do echo $i > "$WORK/f$N/e$i"; i=$((i + 1)); done
+    ls -d "$WORK/f$N"/* > "$WORK/list$N"
+    "$BUILDER" --image "$WORK/img" --size-kib $(( (N + 64) * 4 + 4096 )) --inodes $((N + 128)) 2>/dev/null
+
+    t0=$(now_ns)
+    "$ADDER" --input "$WORK/img" --in-place --manifest "$WORK/list$N" 2>/dev/null
+    t1=$(now_ns)
+    "$ADDER" --input "$WORK/img" --in-place --manifest "$WORK/list$N" 2>/dev/null || true
+    t2=$(now_ns)
+
+    echo "$N,$(( (t1 - t0) / 1000 / N )),$(( (t2 - t1) / 1000 / N ))"
+done
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Extraction throughput of mkfs_reader --extract against image size and
+# file count. Each case imports FILES files of KIB KiB with mkfs_adder
+# --dir, then times one full extraction (page cache dropped first when
+# /proc/sys/vm/drop_caches is writable).
+# Usage: bench/extract_bench.sh [builder] [adder] [reader]   (prints CSV)
+set -e
+BUILDER=${1:-./mkfs_builder}
+ADDER=${2:-./mkfs_adder}
+READER=${3:-./mkfs_reader}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ns() { date +%s%N; }
+
+echo "files,kib_per_file,image_mib,ms,mib_per_s,files_per_s,cold_cache"
+for CASE in 16:16384 256:1024 4096:64 16384:4 256:16384; do
+    FILES=${CASE%:*}
+    KIB=${CASE#*:}
+    rm -rf "$WORK/tree" "$WORK/out"
+    i=0
+    while [ $i -lt "$FILES" ]; do
+        d="$WORK/tree/d$((i % 32))"
+        mkdir -p "$d"
+        head -c $((KIB * 1024)) /dev/urandom > "$d/f$i"
+        i=$((i + 1))
+    done
+    SIZE_KIB=$(( FILES * (KIB + KIB / 256 + 16) + 8192 ))
+    INODES=$(( FILES + 64 ))
+    [ $INODES -ge 128 ] || INODES=128
+    "$BUILDER" --image "$WORK/img" --size-kib $SIZE_KIB --inodes $INODES 2>/dev/null
+    "$ADDER" --input "$WORK/img" --in-place --dir "$WORK/tree" 2>/dev/null
+    rm -rf "$WORK/tree"
+    cold=0
+    sync
+    if [ -w /proc/sys/vm/drop_caches ] && echo 3 > /proc/sys/vm/drop_caches 2>/dev/null; then cold=1; fi
+    t0=$(now_ns)
+    "$READER" --image "$WORK/img" --extract "$WORK/out" 2>/dev/null
+    t1=$(now_ns)
+    ms=$(( (t1 - t0) / 1000000 ))
+    [ $ms -gt 0 ] || ms=1
+    MIB=$(( FILES * KIB / 1024 ))
+    echo "$FILES,$KIB,$(( SIZE_KIB / 1024 )),$ms,$(( MIB * 1000 / ms )),$(( FILES * 1000 / ms )),$cold"
+done
@@ -0,0 +1,134 @@
+// Reproducible synthetic corpora for the benchmarks: the same --seed always
+// gives the same tree, byte for byte, so runs on different releases (or
+// machines) import exactly the same files.
+//
+// Files are spread over 16 subdirectories. Sizes follow one of these
+// distributions:
+//   tiny    0 .. 1 KiB, uniform
+//   small   1 KiB .. 64 KiB, log-uniform
+//   large   256 KiB .. 4 MiB, log-uniform
+//   mixed   70% small, 25% 64 KiB .. 256 KiB, 5% large (a typical source tree)
+// Contents are pseudo-random bytes, or with --text lines of words drawn
+// from a small vocabulary (compressible, like logs and configuration).
+// Build: make bench/gen_corpus
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// splitmix64: tiny, fast and the same everywhere.
+static uint64_t rng_state;
+static uint64_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [lo, hi].
+static uint64_t rng_range(uint64_t lo, uint64_t hi) {
+    return lo + rng_next() % (hi - lo + 1);
+}
+
+// Log-uniform in [lo, hi] (both powers of two): a doubling picked
+// uniformly, then a size uniformly within it.
+static uint64_t rng_log(uint64_t lo, uint64_t hi) {
+    int k = (int)rng_range((uint64_t)__builtin_ctzll(lo), (uint64_t)__builtin_ctzll(hi) - 1);
+    return rng_range(1ull << k, (2ull << k) - 1);
+}
+
+static uint64_t file_size(const char *dist) {
+    if (strcmp(dist, "tiny") == 0)  return rng_range(0, 1024);
+    if (strcmp(dist, "small") == 0) return rng_log(1024, 64 << 10);
+    if (strcmp(dist, "large") == 0) return rng_log(256 << 10, 4 << 20);
+    uint64_t r = rng_range(0, 99);
+    if (r < 70) return rng_log(1024, 64 << 10);
+    if (r < 95) return rng_log(64 << 10, 256 << 10);
+    return rng_log(256 << 10, 4 << 20);
+}
+
+static const char *WORDS[] = {
+    "request", "status", "200", "404", "host", "user", "session", "cache", "miss", "hit",
+    "GET", "POST", "/api/v1/items", "latency_ms", "=", "true", "false", "timeout", "retry", "ok",
+};
+#define NWORDS (sizeof(WORDS) / sizeof(WORDS[0]))
+
+static void fill(uint8_t *buf, uint64_t n, int text) {
+    uint64_t i = 0;
+    if (!text) {
+        for (; i + 8 <= n; i += 8) {
+            uint64_t v = rng_next();
+            memcpy(buf + i, &v, 8);
+        }
+        for (uint64_t v = rng_next(); i < n; i++, v >>= 8) buf[i] = (uint8_t)v;
+        return;
+    }
+    while (i < n) {
+        uint64_t r = rng_next();
+        const char *w = (r & 15) == 0 ? "\n" : WORDS[(r >> 4) % NWORDS];
+        for (size_t k = 0; w[k] && i < n; k++) buf[i++] = (uint8_t)w[k];
+        if (i < n && w[0] != '\n') buf[i++] = ' ';
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *out = NULL, *dist = "mixed";
+    uint64_t files = 1000, seed = 1;
+    int text = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)        out = argv[++i];
+        else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) files = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--dist") == 0 && i + 1 < argc)  dist = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)  seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--text") == 0)                  text = 1;
+        else {
+            fprintf(stderr, "Usage: %s --out <dir> [--files N] [--dist tiny|small|large|mixed] [--seed S] [--text]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (!out || (strcmp(dist, "tiny") && strcmp(dist, "small") && strcmp(dist, "large") && strcmp(dist, "mixed"))) {
+        fprintf(stderr, "Error: --out is required and --dist must be tiny, small, large or mixed\n");
+        return 2;
+    }
+    // The seed and distribution pick the stream; --text draws from it too.
+    rng_state = seed;
+    for (const char *p = dist; *p; p++) rng_state = rng_state * 31 + (uint8_t)*p;
+
+    uint8_t *buf = (uint8_t*)malloc(4u << 20);
+    char path[4096];
+    if (!buf) {
+        fprintf(stderr, "Error: OOM\n");
+        return 1;
+    }
+    if (mkdir(out, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: mkdir %s: %s\n", out, strerror(errno));
+        free(buf);
+        return 1;
+    }
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/d%02u", out, (unsigned)(i % 16));
+        if (i < 16 && mkdir(path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: mkdir %s: %s\n", path, strerror(errno));
+            free(buf);
+            return 1;
+        }
+        snprintf(path, sizeof(path), "%s/d%02u/f%06" PRIu64, out, (unsigned)(i % 16), i);
+        uint64_t n = file_size(dist);
+        fill(buf, n, text);
+        FILE *f = fopen(path, "wb");
+        if (!f || fwrite(buf, 1, (size_t)n, f) != n || fclose(f) != 0) {
+            fprintf(stderr, "Error: write %s: %s\n", path, strerror(errno));
+            free(buf);
+            return 1;
+        }
+        bytes += n;
+    }
+    free(buf);
+    fprintf(stderr, "OK: wrote %" PRIu64 " files (%" PRIu64 " bytes) to %s\n", files, bytes, out);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Ingest throughput of mkfs_adder --dir as the worker count grows.
+# Builds a host tree of FILES files of KIB KiB each, then imports it into a
+# fresh image once per thread count. When /proc/sys/vm/drop_caches is
+# writable the page cache is dropped before each run, so the host reads
+# really hit storage; otherwise the tree is read from cache.
+# Usage: bench/ingest_bench.sh [builder] [adder] [files] [kib]   (prints CSV)
+set -e
+BUILDER=${1:-./mkfs_builder}
+ADDER=${2:-./mkfs_adder}
+FILES=${3:-2000}
+KIB=${4:-64}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ns() { date +%s%N; }
+
+i=0
+while [ $i -lt "$FILES" ]; do
+    d="$WORK/tree/d$((i % 16))"
+    mkdir -p "$d"
+    head -c $((KIB * 1024)) /dev/urandom > "$d/f$i"
+    i=$((i + 1))
+done
+MIB=$(( FILES * KIB / 1024 ))
+SIZE_KIB=$(( FILES * (KIB + KIB / 256 + 16) + 8192 ))
+INODES=$(( FILES + 64 ))
+[ $INODES -ge 128 ] || INODES=128
+
+echo "threads,ms,mib_per_s,cold_cache"
+for T in 1 2 4 8 16; do
+    "$BUILDER" --image "$WORK/img" --size-kib $SIZE_KIB --inodes $INODES 2>/dev/null
+    cold=0
+    sync
+    if [ -w /proc/sys/vm/drop_caches ] && echo 3 > /proc/sys/vm/drop_caches 2>/dev/null; then cold=1; fi
+    t0=$(now_ns)
+    "$ADDER" --input "$WORK/img" --in-place --threads $T --dir "$WORK/tree" 2>/dev/null
+    t1=$(now_ns)
+    ms=$(( (t1 - t0) / 1000000 ))
+    [ $ms -gt 0 ] || ms=1
+    echo "$T,$ms,$(( MIB * 1000 / ms )),$cold"
+done
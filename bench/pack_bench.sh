@@ -0,0 +1,51 @@
+#!/bin/sh
+# Space and writes for small files with and without --pack.
+# Builds FILES host files of 1..MAXB bytes (sizes cycle through the range),
+# imports them in place into a fresh image of each kind and reports the
+# data blocks in use (from mkfs_fsck) and the blocks written. Whole blocks
+# are copied straight into the image file and are not in the in-place
+# write count, so they are added to it: every file's blocks without
+# --pack, only whole blocks and tails too long to pack with it.
+# Usage: bench/pack_bench.sh [builder] [adder] [fsck] [files] [max_bytes]   (prints CSV)
+set -e
+BUILDER=${1:-./mkfs_builder}
+ADDER=${2:-./mkfs_adder}
+FSCK=${3:-./mkfs_fsck}
+FILES=${4:-2000}
+MAXB=${5:-3000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ns() { date +%s%N; }
+
+mkdir -p "$WORK/tree"
+i=0
+DIRECT_plain=0
+DIRECT_pack=0
+while [ $i -lt "$FILES" ]; do
+    n=$(( (i * 97) % MAXB + 1 ))
+    head -c $n /dev/urandom > "$WORK/tree/f$i"
+    DIRECT_plain=$(( DIRECT_plain + (n + 4095) / 4096 ))
+    if [ $n -gt 48 ]; then
+        DIRECT_pack=$(( DIRECT_pack + n / 4096 ))
+        [ $(( n % 4096 )) -le 2048 ] || DIRECT_pack=$(( DIRECT_pack + 1 ))
+    fi
+    i=$((i + 1))
+done
+SIZE_KIB=$(( FILES * 4 + 8192 ))
+INODES=$(( FILES + 64 ))
+[ $INODES -ge 128 ] || INODES=128
+
+echo "mode,ms,data_blocks_used,blocks_written"
+for MODE in plain pack; do
+    flag=""
+    [ $MODE = pack ] && flag=--pack
+    "$BUILDER" --image "$WORK/img" --size-kib $SIZE_KIB --inodes $INODES $flag 2>/dev/null
+    t0=$(now_ns)
+    "$ADDER" --input "$WORK/img" --in-place --dir "$WORK/tree" 2> "$WORK/log"
+    t1=$(now_ns)
+    written=$(sed -n 's/^OK: wrote \([0-9]*\) of.*/\1/p' "$WORK/log")
+    eval "written=\$(( written + DIRECT_$MODE ))"
+    used=$("$FSCK" --image "$WORK/img" 2>&1 | sed -n 's/.* \([0-9]*\) of [0-9]* data blocks in use/\1/p')
+    echo "$MODE,$(( (t1 - t0) / 1000000 )),$used,$written"
+done
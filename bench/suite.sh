@@ -0,0 +1,101 @@
+#!/bin/sh
+# Benchmark suite behind `make bench`. Corpora come from bench/gen_corpus
+# with the given seed, so every run imports the same files. Measures:
+#   builder  mkfs_builder creation time per image size (best of 3)
+#   adder    mkfs_adder --dir import rate per file-size distribution, and
+#            the latency of adding one file with its own invocation
+#   crc      CRC32 throughput per engine and buffer size (bench/crc32_bench)
+#   io       random 4 KiB I/O per backend and queue depth (bench/io_bench;
+#            O_DIRECT rows only where the scratch directory allows it)
+# Output is CSV with one measurement per row, suite,case,metric,value,unit,
+# preceded by meta rows (seed, commit, CPUs); bench/compare.sh diffs two
+# such files. --quick uses a quarter of the files.
+# Usage: bench/suite.sh [--seed S] [--quick]   (run from the top directory; prints CSV)
+set -e
+SEED=1
+SCALE=4
+while [ $# -gt 0 ]; do
+    case "$1" in
+    --seed)  SEED=$2; shift 2 ;;
+    --quick) SCALE=1; shift ;;
+    *) echo "Usage: $0 [--seed S] [--quick]" >&2; exit 2 ;;
+    esac
+done
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ns() { date +%s%N; }
+row() { echo "$1,$2,$3,$4,$5"; }
+# rate COUNT NS [UNIT]: COUNT/UNIT per second.
+rate() { awk -v n="$1" -v ns="$2" -v u="${3:-1}" 'BEGIN { printf "%.1f", (ns > 0 ? n / u / (ns / 1e9) : 0) }'; }
+
+echo "suite,case,metric,value,unit"
+row meta run seed "$SEED" ""
+row meta run commit "$(git rev-parse --short HEAD 2>/dev/null || echo unknown)" ""
+row meta run cpus "$(nproc 2>/dev/null || echo 1)" ""
+
+# Image creation. The file is sparse, so this is metadata and bitmaps.
+for MIB in 1 64 1024 16384; do
+    best=""
+    for r in 1 2 3; do
+        rm -f "$WORK/img"
+        t0=$(now_ns)
+        ./mkfs_builder --image "$WORK/img" --size-kib $((MIB * 1024)) --inodes 4096 2>/dev/null
+        t1=$(now_ns)
+        us=$(( (t1 - t0) / 1000 ))
+        [ -z "$best" ] || [ $us -lt $best ] || continue
+        best=$us
+    done
+    row builder "size_mib=$MIB" create_us "$best" us
+done
+rm -f "$WORK/img"
+
+# Imports. FILES per distribution keeps each corpus at a few tens of MiB.
+for CASE in tiny:2000 small:500 large:16 mixed:250; do
+    DIST=${CASE%:*}
+    FILES=$(( ${CASE#*:} * SCALE ))
+    rm -rf "$WORK/tree"
+    bench/gen_corpus --out "$WORK/tree" --files $FILES --dist $DIST --seed "$SEED" 2>/dev/null
+    BYTES=$(find "$WORK/tree" -type f -exec cat {} + | wc -c)
+    SIZE_KIB=$(( (BYTES / 1024 + FILES * 8 + 8192) * 5 / 4 / 4 * 4 ))
+    INODES=$(( FILES + 64 ))
+    [ $INODES -ge 128 ] || INODES=128
+
+    ./mkfs_builder --image "$WORK/img" --size-kib $SIZE_KIB --inodes $INODES 2>/dev/null
+    t0=$(now_ns)
+    ./mkfs_adder --input "$WORK/img" --in-place --dir "$WORK/tree" 2>/dev/null
+    t1=$(now_ns)
+    ns=$((t1 - t0))
+    row adder "dist=$DIST" files "$FILES" ""
+    row adder "dist=$DIST" bytes "$BYTES" B
+    row adder "dist=$DIST" import_ms $((ns / 1000000)) ms
+    row adder "dist=$DIST" files_per_s "$(rate $FILES $ns)" files/s
+    row adder "dist=$DIST" mib_per_s "$(rate $BYTES $ns 1048576)" MiB/s
+    row adder "dist=$DIST" batch_us_per_file $((ns / 1000 / FILES)) us
+
+    # One invocation per file: open, add, write back, close.
+    ./mkfs_builder --image "$WORK/img" --size-kib $SIZE_KIB --inodes $INODES 2>/dev/null
+    n=0
+    t0=$(now_ns)
+    for f in $(find "$WORK/tree" -type f | sort | head -n 50); do
+        ./mkfs_adder --input "$WORK/img" --in-place --file "$f" 2>/dev/null
+        n=$((n + 1))
+    done
+    t1=$(now_ns)
+    row adder "dist=$DIST" add_latency_us $(( (t1 - t0) / 1000 / n )) us
+done
+
+# CRC engines (impl,bytes,MiB_per_s). Each bench writes to a file first:
+# the status of a pipeline is its last command's, so set -e would miss a
+# failing bench piped straight into the loop.
+bench/crc32_bench > "$WORK/crc.csv"
+tail -n +2 "$WORK/crc.csv" | while IFS=, read -r impl bytes mibs; do
+    row crc "impl=$impl;bytes=$bytes" throughput "$mibs" MiB/s
+done
+
+# I/O backends (backend,mode,op,depth,registered,iops,MiB_per_s).
+bench/io_bench --dir "$WORK" --ops $((5000 * SCALE)) > "$WORK/io.csv"
+tail -n +2 "$WORK/io.csv" | while IFS=, read -r backend mode op depth reg iops mibs; do
+    row io "backend=$backend;mode=$mode;op=$op;depth=$depth;registered=$reg" iops "$iops" ops/s
+    row io "backend=$backend;mode=$mode;op=$op;depth=$depth;registered=$reg" throughput "$mibs" MiB/s
+done
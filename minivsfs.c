@@ -0,0 +1,3862 @@
+// libminivsfs implementation. See minivsfs.h.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE             // copy_file_range, splice, sendfile
+#include "minivsfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "vsfs_bitmap.h"
+#include "vsfs_crc32.h"
+#include "vsfs_lz.h"
+
+#define BS VSFS_BS
+#define INODE_SIZE VSFS_INODE_SIZE
+#define ROOT_INO VSFS_ROOT_INO
+#define DIRECT_MAX VSFS_DIRECT_MAX
+#define PTRS_PER_BLOCK VSFS_PTRS_PER_BLOCK
+#define FILE_BLOCKS_MAX VSFS_FILE_BLOCKS_MAX
+#define BITS_PER_BLOCK ((uint64_t)BS * 8)
+
+#define BIT_SET(bm, bit)   ((bm)[(bit)>>3] |=  (uint8_t)(1u << ((bit)&7)))
+#define BIT_CLEAR(bm, bit) ((bm)[(bit)>>3] &= (uint8_t)~(1u << ((bit)&7)))
+#define BIT_TEST(bm, bit)  ((((bm)[(bit)>>3] >> ((bit)&7)) & 1u))
+
+// ----------------- Errors -----------------
+
+static _Thread_local char err_buf[512];
+
+const char *vsfs_errmsg(void) {
+    return err_buf;
+}
+
+// Record the reason for a failure; returns -1 so callers can
+// "return fail(...)".
+__attribute__((format(printf, 1, 2)))
+static int fail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(err_buf, sizeof(err_buf), fmt, ap);
+    va_end(ap);
+    return -1;
+}
+
+// ----------------- Checksums -----------------
+
+uint32_t vsfs_superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t s = vsfs_crc32((void *) sb, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+
+void vsfs_inode_crc_finalize(inode_t *ino) {
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    // zero crc area before computing
+    memset(&tmp[120], 0, 8);
+    uint32_t c = vsfs_crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+}
+
+int vsfs_inode_crc_ok(const inode_t *ino) {
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    memset(&tmp[120], 0, 8);
+    return (uint64_t)vsfs_crc32(tmp, 120) == ino->inode_crc;
+}
+
+void vsfs_dirent_checksum_finalize(dirent64_t *de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
+    de->checksum = x;
+}
+
+uint32_t vsfs_block_crc(const void *block) {
+    return vsfs_crc32c(block, BS) ^ 0x98F94189u;   // CRC32C of BS zero bytes
+}
+
+static const vsfs_sb_ext_t *sb_ext(const superblock_t *sb) {
+    return (const vsfs_sb_ext_t*)((const uint8_t*)sb + VSFS_SB_EXT_OFFSET);
+}
+
+// An optional region has to hold at least need blocks and lie between the
+// inode table and the data region.
+static int ext_region_ok(const superblock_t *sb, uint64_t s, uint64_t n, uint64_t need) {
+    return n >= need && s >= sb->inode_table_start + sb->inode_table_blocks &&
+           s <= sb->data_region_start && n <= sb->data_region_start - s;
+}
+
+int vsfs_crc_table(const superblock_t *sb, uint64_t *start, uint64_t *nblocks) {
+    if (!(sb->flags & VSFS_FLAG_BLOCK_CRC)) return 0;
+    const vsfs_sb_ext_t *ext = sb_ext(sb);
+    if (!ext_region_ok(sb, ext->crc_table_start, ext->crc_table_blocks,
+                       (sb->total_blocks + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK))
+        return -1;
+    *start = ext->crc_table_start;
+    *nblocks = ext->crc_table_blocks;
+    return 1;
+}
+
+int vsfs_refcount_table(const superblock_t *sb, uint64_t *start, uint64_t *nblocks) {
+    if (!(sb->flags & VSFS_FLAG_REFCOUNT)) return 0;
+    const vsfs_sb_ext_t *ext = sb_ext(sb);
+    uint64_t s = ext->refcount_start, n = ext->refcount_blocks;
+    if (!ext_region_ok(sb, s, n, (sb->data_region_blocks + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK))
+        return -1;
+    uint64_t cs, cn;
+    if (vsfs_crc_table(sb, &cs, &cn) > 0 && s < cs + cn && cs < s + n) return -1;
+    *start = s;
+    *nblocks = n;
+    return 1;
+}
+
+int vsfs_journal_region(const superblock_t *sb, uint64_t *start, uint64_t *nblocks) {
+    if (!(sb->flags & VSFS_FLAG_JOURNAL)) return 0;
+    const vsfs_sb_ext_t *ext = sb_ext(sb);
+    uint64_t s = ext->journal_start, n = ext->journal_blocks;
+    if (!ext_region_ok(sb, s, n, 4) || n % 2 != 0) return -1;
+    uint64_t os, on;
+    if (vsfs_crc_table(sb, &os, &on) > 0 && s < os + on && os < s + n) return -1;
+    if (vsfs_refcount_table(sb, &os, &on) > 0 && s < os + on && os < s + n) return -1;
+    *start = s;
+    *nblocks = n;
+    return 1;
+}
+
+// n blocks from s lie inside an image of total blocks (no overflow).
+static int region_in(uint64_t s, uint64_t n, uint64_t total) {
+    return s <= total && n <= total - s;
+}
+
+const char *vsfs_superblock_check(const superblock_t *sb, uint64_t len, int crc) {
+    if (len < BS || sb->magic != VSFS_MAGIC || sb->version != VSFS_VERSION || sb->block_size != BS)
+        return "not a MiniVSFS image";
+    if (crc) {
+        uint8_t blk0[BS];
+        memcpy(blk0, sb, BS);
+        if (vsfs_superblock_crc_finalize((superblock_t*)blk0) != sb->checksum)
+            return "superblock checksum mismatch";
+    }
+    const uint64_t total = sb->total_blocks;
+    if (len % BS != 0 || total != len / BS)
+        return "image length and superblock disagree";
+    // Every region must lie inside the image and each bitmap must have a
+    // bit for everything it tracks; after this the region pointers are safe.
+    if (!region_in(sb->inode_bitmap_start, sb->inode_bitmap_blocks, total) ||
+        !region_in(sb->data_bitmap_start,  sb->data_bitmap_blocks,  total) ||
+        !region_in(sb->inode_table_start,  sb->inode_table_blocks,  total) ||
+        !region_in(sb->data_region_start,  sb->data_region_blocks,  total) ||
+        sb->inode_bitmap_blocks * BS * 8ull < sb->inode_count ||
+        sb->data_bitmap_blocks  * BS * 8ull < sb->data_region_blocks ||
+        sb->inode_table_blocks  * (BS / INODE_SIZE) < sb->inode_count ||
+        sb->root_inode != ROOT_INO || sb->inode_count < ROOT_INO || sb->inode_count > UINT32_MAX)
+        return "superblock layout is inconsistent";
+    return NULL;
+}
+
+uint64_t vsfs_inode_blocks(const inode_t *ino) {
+    uint64_t n = (ino->size_bytes + BS - 1) / BS;
+    if ((ino->mode & VSFS_S_IFMT) != VSFS_S_IFREG) return n;
+    if (ino->reserved_2 & VSFS_INO_INLINE) return 0;
+    if (ino->reserved_2 & VSFS_INO_TAIL) return ino->size_bytes / BS;
+    if (ino->reserved_2 & VSFS_INO_COMPRESSED) return (ino->xattr_ptr + BS - 1) / BS;
+    return n ? n : 1;
+}
+
+// ----------------- Statistics -----------------
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Count one read (or write) system call that moved n bytes.
+static void count_read(vsfs_stats_t *st, ssize_t n) {
+    st->io_calls++;
+    if (n > 0) st->bytes_read += (uint64_t)n;
+}
+
+static void count_write(vsfs_stats_t *st, ssize_t n) {
+    st->io_calls++;
+    if (n > 0) st->bytes_written += (uint64_t)n;
+}
+
+// Fold the counters of an I/O queue (NULL: none) into st.
+static void io_count(const vsfs_io_t *io, vsfs_stats_t *st) {
+    uint64_t calls = 0, nr = 0, nw = 0;
+    if (io) vsfs_io_counters(io, &calls, &nr, &nw);
+    st->io_calls      += calls;
+    st->bytes_read    += nr;
+    st->bytes_written += nw;
+}
+
+int vsfs_stats_format(const vsfs_stats_t *st, const char *tool, int json, char *buf, size_t cap) {
+    if (json)
+        return snprintf(buf, cap,
+            "{\"tool\":\"%s\",\"load_ns\":%" PRIu64 ",\"scan_ns\":%" PRIu64 ",\"host_read_ns\":%" PRIu64
+            ",\"crc_ns\":%" PRIu64 ",\"write_ns\":%" PRIu64 ",\"total_ns\":%" PRIu64 ",\"bytes_read\":%" PRIu64
+            ",\"bytes_written\":%" PRIu64 ",\"io_calls\":%" PRIu64 ",\"bits_scanned\":%" PRIu64
+            ",\"crc_bytes\":%" PRIu64 ",\"inodes_free\":%" PRIu64 ",\"inodes_total\":%" PRIu64
+            ",\"blocks_free\":%" PRIu64 ",\"blocks_total\":%" PRIu64 "}",
+            tool, st->load_ns, st->scan_ns, st->host_read_ns, st->crc_ns, st->write_ns, st->total_ns,
+            st->bytes_read, st->bytes_written, st->io_calls, st->bits_scanned, st->crc_bytes,
+            st->inodes_free, st->inodes_total, st->blocks_free, st->blocks_total);
+    #define MS(ns) ((double)(ns) / 1e6)
+    int n = snprintf(buf, cap,
+        "Stats: load %.3f ms, bitmap scan %.3f ms, host read %.3f ms, crc %.3f ms, write %.3f ms, total %.3f ms; "
+        "read %" PRIu64 " B, wrote %" PRIu64 " B in %" PRIu64 " I/O calls; %" PRIu64 " bitmap bits scanned; "
+        "free inodes %" PRIu64 "/%" PRIu64 ", free blocks %" PRIu64 "/%" PRIu64,
+        MS(st->load_ns), MS(st->scan_ns), MS(st->host_read_ns), MS(st->crc_ns), MS(st->write_ns),
+        MS(st->total_ns), st->bytes_read, st->bytes_written, st->io_calls, st->bits_scanned,
+        st->inodes_free, st->inodes_total, st->blocks_free, st->blocks_total);
+    #undef MS
+    return n;
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t off, vsfs_stats_t *st) {
+    const uint8_t *src = (const uint8_t*)buf;
+    while (len > 0) {
+        ssize_t nw = pwrite(fd, src, len, off);
+        count_write(st, nw);
+        if (nw < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        src += nw; off += nw; len -= (size_t)nw;
+    }
+    return 0;
+}
+
+// ----------------- Journal -----------------
+
+// Blocks a slot needs for a transaction of n blocks: the header, the
+// blocks the home numbers spill into, the images.
+static uint64_t journal_slot_need(uint64_t n) {
+    uint64_t more = n > VSFS_JOURNAL_HDR_PTRS ? n - VSFS_JOURNAL_HDR_PTRS : 0;
+    return 1 + (more + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK + n;
+}
+
+// Home number of block i of the transaction in slot.
+static uint32_t *journal_home(uint8_t *slot, uint64_t i) {
+    if (i < VSFS_JOURNAL_HDR_PTRS) return &((vsfs_journal_hdr_t*)slot)->home[i];
+    i -= VSFS_JOURNAL_HDR_PTRS;
+    return (uint32_t*)(slot + (1 + i / PTRS_PER_BLOCK) * BS) + i % PTRS_PER_BLOCK;
+}
+
+// CRC of a slot whose transaction takes need blocks.
+static uint32_t journal_crc(uint8_t *slot, uint64_t need) {
+    vsfs_journal_hdr_t *h = (vsfs_journal_hdr_t*)slot;
+    uint32_t saved = h->crc;
+    h->crc = 0;
+    uint32_t c = vsfs_crc32(slot, (size_t)(need * BS));
+    h->crc = saved;
+    return c;
+}
+
+// Sequence number of the transaction in slot (of half blocks), or 0 when
+// it holds none: empty, torn, or naming blocks this image cannot have.
+static uint64_t journal_slot_seq(uint8_t *slot, uint64_t half, uint64_t total, uint64_t jstart, uint64_t jblocks) {
+    const vsfs_journal_hdr_t *h = (const vsfs_journal_hdr_t*)slot;
+    if (h->magic != VSFS_JOURNAL_MAGIC || h->seq == 0 || h->count == 0 || journal_slot_need(h->count) > half)
+        return 0;
+    for (uint64_t i = 0; i < h->count; i++) {
+        uint64_t b = *journal_home(slot, i);
+        if (b >= total || b - jstart < jblocks) return 0;
+    }
+    return journal_crc(slot, journal_slot_need(h->count)) == h->crc ? h->seq : 0;
+}
+
+// The journal region of image img, after the layout checks vsfs_open()
+// does (all but the superblock CRC, as block 0 may be journaled). 0 or
+// fail().
+static int journal_locate(const uint8_t *img, uint64_t len, uint64_t *start, uint64_t *nblocks) {
+    const superblock_t *sb = (const superblock_t*)img;
+    const char *bad = vsfs_superblock_check(sb, len, 0);
+    if (bad) return fail("%s", bad);
+    if (vsfs_journal_region(sb, start, nblocks) <= 0) return fail("the image has no usable journal");
+    return 0;
+}
+
+// vsfs_journal_replay(); *last receives the newest committed sequence
+// number (0 for none), which the next transaction follows.
+static int64_t journal_replay(uint8_t *img, uint64_t len, int fd, vsfs_stats_t *st, uint64_t *last) {
+    uint64_t js, jn;
+    *last = 0;
+    if (journal_locate(img, len, &js, &jn) != 0) return -1;
+    const uint64_t half = jn / 2, total = len / BS;
+    uint8_t *slot[2] = { img + js * BS, img + (js + half) * BS };
+    uint64_t seq[2] = { journal_slot_seq(slot[0], half, total, js, jn),
+                        journal_slot_seq(slot[1], half, total, js, jn) };
+    int newest = seq[1] > seq[0];
+    if (seq[newest] == 0) return 0;
+    *last = seq[newest];
+    // Newest first; a block the older transaction also holds has its
+    // newer image already.
+    uint8_t *seen = (uint8_t*)calloc(1, (size_t)((total + 7) / 8));
+    if (!seen) return fail("out of memory");
+    int64_t changed = 0;
+    int n = seq[!newest] && seq[!newest] + 1 == seq[newest] ? 2 : 1;
+    for (int k = 0; k < n; k++) {
+        uint8_t *s = slot[k == 0 ? newest : !newest];
+        uint64_t count = ((vsfs_journal_hdr_t*)s)->count;
+        const uint8_t *images = s + (journal_slot_need(count) - count) * BS;
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t b = *journal_home(s, i);
+            if (BIT_TEST(seen, b)) continue;
+            BIT_SET(seen, b);
+            if (memcmp(img + b * BS, images + i * BS, BS) == 0) continue;
+            memcpy(img + b * BS, images + i * BS, BS);
+            if (fd >= 0 && write_all(fd, img + b * BS, BS, (off_t)(b * BS), st) != 0) {
+                free(seen);
+                return fail("pwrite: %s", strerror(errno));
+            }
+            changed++;
+        }
+    }
+    free(seen);
+    if (fd >= 0 && changed && fdatasync(fd) != 0) return fail("fdatasync: %s", strerror(errno));
+    return changed;
+}
+
+int64_t vsfs_journal_replay(uint8_t *img, uint64_t len, int fd) {
+    vsfs_stats_t st = {0};
+    uint64_t last;
+    vsfs_crc32_init();
+    return journal_replay(img, len, fd, &st, &last);
+}
+
+int vsfs_journal_reset(uint8_t *img, uint64_t len, int fd) {
+    uint64_t js, jn;
+    vsfs_stats_t st = {0};
+    if (journal_locate(img, len, &js, &jn) != 0) return -1;
+    for (uint64_t b = js; b < js + jn; b += jn / 2) {
+        memset(img + b * BS, 0, BS);
+        if (fd >= 0 && write_all(fd, img + b * BS, BS, (off_t)(b * BS), &st) != 0)
+            return fail("pwrite: %s", strerror(errno));
+    }
+    if (fd >= 0 && fdatasync(fd) != 0) return fail("fdatasync: %s", strerror(errno));
+    return 0;
+}
+
+// ----------------- Populate -----------------
+// vsfs_format() with opts->populate (or to a stream) plans the whole image
+// before writing any of it: root directory, then each file's blocks in one
+// run, pointer blocks just ahead of the data they map as an add would
+// place them, then the fragment blocks of packed tails. Every block can
+// then be produced on demand from the plan and the host files, so the
+// image goes out in block order and memory grows with the file count, not
+// the image size. A CRC table, which precedes the data it covers, costs
+// one extra read of the files.
+
+// Pointer blocks needed to map n data blocks: one single indirect block
+// past direct[], then a double indirect block plus one leaf per
+// PTRS_PER_BLOCK data blocks past that.
+static uint64_t indirect_blocks_for(uint64_t n) {
+    if (n <= DIRECT_MAX) return 0;
+    if (n <= DIRECT_MAX + PTRS_PER_BLOCK) return 1;
+    uint64_t r = n - DIRECT_MAX - PTRS_PER_BLOCK;
+    return 1 + 1 + (r + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+}
+
+typedef struct {
+    char    *host;                    // host path
+    char     name[VSFS_NAME_MAX + 1]; // as stored
+    uint64_t size;
+    uint64_t start;                   // first block of its run, 0 for none
+    uint64_t nblocks;                 // data blocks it maps
+    uint64_t frag;                    // VSFS_FRAG of its tail, or 0
+    int      inl;                     // data in direct[]
+} pop_file_t;
+
+typedef struct {
+    superblock_t *sb;
+    pop_file_t *f;
+    size_t      n, cap;
+    uint64_t    root_blocks;          // root directory blocks, from data_region_start
+    uint64_t    frag_start, nfrag;    // fragment blocks, after every file
+    size_t     *frag_first;           // first file with a tail in each of them
+    uint64_t    used;                 // data blocks in use
+    uint64_t    crc_start, crc_blocks;
+    uint64_t    now;
+    int         fd;                   // open host file, or -1
+    size_t      fd_file;
+    vsfs_stats_t *st;
+} pop_plan_t;
+
+// Where logical block k of a run starting at start lies.
+static uint64_t pop_phys(uint64_t start, uint64_t k) {
+    if (k < DIRECT_MAX) return start + k;
+    if (k < DIRECT_MAX + PTRS_PER_BLOCK) return start + k + 1;
+    return start + k + 3 + (k - DIRECT_MAX - PTRS_PER_BLOCK) / PTRS_PER_BLOCK;
+}
+
+// Block o of a run mapping n data blocks: 0 with *k set when it is logical
+// block *k, or 1 with the pointer block it is written to ptr.
+static int pop_run_block(uint64_t start, uint64_t n, uint64_t o, uint32_t *ptr, uint64_t *k) {
+    const uint64_t ind = DIRECT_MAX, dind = DIRECT_MAX + 1 + PTRS_PER_BLOCK, leaves = dind + 1;
+    if (o < ind) {
+        *k = o;
+        return 0;
+    }
+    if (o == ind || o == dind || (o >= leaves && (o - leaves) % (PTRS_PER_BLOCK + 1) == 0)) {
+        memset(ptr, 0, BS);
+        if (o == ind) {
+            for (uint64_t i = 0; i < PTRS_PER_BLOCK && DIRECT_MAX + i < n; i++)
+                ptr[i] = (uint32_t)pop_phys(start, DIRECT_MAX + i);
+        } else if (o == dind) {
+            uint64_t nleaves = (n - DIRECT_MAX - PTRS_PER_BLOCK + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+            for (uint64_t g = 0; g < nleaves; g++) ptr[g] = (uint32_t)(start + leaves + g * (PTRS_PER_BLOCK + 1));
+        } else {
+            uint64_t first = DIRECT_MAX + PTRS_PER_BLOCK + (o - leaves) / (PTRS_PER_BLOCK + 1) * PTRS_PER_BLOCK;
+            for (uint64_t i = 0; i < PTRS_PER_BLOCK && first + i < n; i++) ptr[i] = (uint32_t)pop_phys(start, first + i);
+        }
+        return 1;
+    }
+    if (o < dind) *k = o - 1;
+    else *k = DIRECT_MAX + PTRS_PER_BLOCK + (o - leaves) / (PTRS_PER_BLOCK + 1) * PTRS_PER_BLOCK +
+              (o - leaves) % (PTRS_PER_BLOCK + 1) - 1;
+    return 0;
+}
+
+// Block pointers of an inode whose run of n data blocks starts at start.
+static void pop_map(inode_t *node, uint64_t start, uint64_t n) {
+    for (uint64_t k = 0; k < n && k < DIRECT_MAX; k++) node->direct[k] = (uint32_t)pop_phys(start, k);
+    if (n > DIRECT_MAX) node->reserved_0 = (uint32_t)(start + DIRECT_MAX);
+    if (n > DIRECT_MAX + PTRS_PER_BLOCK) node->reserved_1 = (uint32_t)(start + DIRECT_MAX + 1 + PTRS_PER_BLOCK);
+}
+
+// len bytes of file i from offset off. A file that came up short changed
+// since it was planned.
+static int pop_read(pop_plan_t *p, size_t i, uint64_t off, uint8_t *buf, size_t len) {
+    if (p->fd < 0 || p->fd_file != i) {
+        if (p->fd >= 0) close(p->fd);
+        p->fd = open(p->f[i].host, O_RDONLY);
+        p->fd_file = i;
+        if (p->fd < 0) return fail("%s: %s", p->f[i].host, strerror(errno));
+    }
+    uint64_t t0 = clock_ns();
+    for (size_t got = 0; got < len; ) {
+        ssize_t nr = pread(p->fd, buf + got, len - got, (off_t)(off + got));
+        count_read(p->st, nr);
+        if (nr < 0 && errno == EINTR) continue;
+        if (nr <= 0) return fail("%s: %s", p->f[i].host, nr < 0 ? strerror(errno) : "file changed while being written");
+        got += (size_t)nr;
+    }
+    p->st->host_read_ns += clock_ns() - t0;
+    return 0;
+}
+
+static int pop_file_at(const void *key, const void *elem) {
+    uint64_t b = *(const uint64_t*)key;
+    const pop_file_t *f = (const pop_file_t*)elem;
+    if (b < f->start) return -1;
+    return b < f->start + f->nblocks + indirect_blocks_for(f->nblocks) ? 0 : 1;
+}
+
+// Contents of data block b (which is in use): root directory, file or
+// fragment block.
+static int pop_data_block(pop_plan_t *p, uint64_t b, uint8_t *buf) {
+    const uint64_t start = p->sb->data_region_start;
+    uint64_t k;
+    if (b < start + p->root_blocks + indirect_blocks_for(p->root_blocks)) {
+        if (pop_run_block(start, p->root_blocks, b - start, (uint32_t*)buf, &k)) return 0;
+        dirent64_t *de = (dirent64_t*)buf;
+        memset(buf, 0, BS);
+        for (uint64_t s = k * VSFS_DIRENTS_PER_BLOCK, j = 0; j < VSFS_DIRENTS_PER_BLOCK && s < p->n + 2; s++, j++) {
+            de[j].inode_no = s < 2 ? ROOT_INO : (uint32_t)s;   // file i is inode i + 2
+            de[j].type = s < 2 ? VSFS_DT_DIR : VSFS_DT_FILE;
+            const char *name = s == 0 ? "." : s == 1 ? ".." : p->f[s - 2].name;
+            memcpy(de[j].name, name, strnlen(name, sizeof(de[j].name)));
+            vsfs_dirent_checksum_finalize(&de[j]);
+        }
+        return 0;
+    }
+    if (b >= p->frag_start && b < p->frag_start + p->nfrag) {
+        vsfs_frag_hdr_t *h = (vsfs_frag_hdr_t*)buf;
+        memset(buf, 0, BS);
+        h->magic = VSFS_FRAG_MAGIC;
+        h->end = sizeof(*h);
+        for (size_t i = p->frag_first[b - p->frag_start]; i < p->n; i++) {
+            uint64_t f = p->f[i].frag;
+            if (!f) continue;
+            if (VSFS_FRAG_BLOCK(f) != b) break;
+            if (pop_read(p, i, p->f[i].nblocks * BS, buf + VSFS_FRAG_OFF(f), VSFS_FRAG_LEN(f)) != 0) return -1;
+            h->live++;
+            h->end = (uint16_t)(VSFS_FRAG_OFF(f) + VSFS_FRAG_LEN(f));
+        }
+        return 0;
+    }
+    const pop_file_t *f = (const pop_file_t*)bsearch(&b, p->f, p->n, sizeof(*p->f), pop_file_at);
+    if (!f) return fail("block %" PRIu64 " is not in the plan", b);   // cannot happen
+    if (pop_run_block(f->start, f->nblocks, b - f->start, (uint32_t*)buf, &k)) return 0;
+    uint64_t want = f->size - k * BS < BS ? f->size - k * BS : BS;
+    memset(buf + want, 0, (size_t)(BS - want));
+    return pop_read(p, (size_t)(f - p->f), k * BS, buf, (size_t)want);
+}
+
+// Contents of block b of the image: 0 with buf filled, 1 when the block is
+// all zeros (buf untouched), -1 on error.
+static int pop_block(pop_plan_t *p, uint64_t b, uint8_t *buf, const uint8_t *block0) {
+    const superblock_t *sb = p->sb;
+    const uint64_t ninodes = p->n + 1;
+    if (b == 0) {
+        memcpy(buf, block0, BS);
+        return 0;
+    }
+    if (b >= sb->inode_bitmap_start && b < sb->inode_bitmap_start + sb->inode_bitmap_blocks) {
+        uint64_t first = (b - sb->inode_bitmap_start) * BITS_PER_BLOCK;
+        if (first >= ninodes) return 1;
+        memset(buf, 0, BS);
+        for (uint64_t i = first; i < ninodes && i < first + BITS_PER_BLOCK; i++) BIT_SET(buf, i - first);
+        return 0;
+    }
+    if (b >= sb->data_bitmap_start && b < sb->data_bitmap_start + sb->data_bitmap_blocks) {
+        uint64_t first = (b - sb->data_bitmap_start) * BITS_PER_BLOCK;
+        if (first >= p->used) return 1;
+        memset(buf, 0, BS);
+        for (uint64_t i = first; i < p->used && i < first + BITS_PER_BLOCK; i++) BIT_SET(buf, i - first);
+        return 0;
+    }
+    if (b >= sb->inode_table_start && b < sb->inode_table_start + sb->inode_table_blocks) {
+        uint64_t first = (b - sb->inode_table_start) * (BS / INODE_SIZE);
+        if (first >= ninodes) return 1;
+        memset(buf, 0, BS);
+        inode_t *node = (inode_t*)buf;
+        for (uint64_t i = first; i < ninodes && i < first + BS / INODE_SIZE; i++, node++) {
+            node->atime = node->mtime = node->ctime = p->now;
+            node->proj_id = 6;
+            if (i == 0) {
+                // Root keeps its historical one-link-per-file count.
+                node->mode = VSFS_S_IFDIR;
+                node->links = (uint16_t)(p->n + 2 < 0xFFFF ? p->n + 2 : 0xFFFF);
+                node->size_bytes = p->root_blocks * BS;
+                pop_map(node, sb->data_region_start, p->root_blocks);
+            } else {
+                const pop_file_t *f = &p->f[i - 1];
+                node->mode = VSFS_S_IFREG;
+                node->links = 1;
+                node->size_bytes = f->size;
+                pop_map(node, f->start, f->nblocks);
+                if (f->inl) {
+                    node->reserved_2 = VSFS_INO_INLINE;
+                    if (pop_read(p, i - 1, 0, (uint8_t*)node->direct, (size_t)f->size) != 0) return -1;
+                } else if (f->frag) {
+                    node->reserved_2 = VSFS_INO_TAIL;
+                    node->xattr_ptr = f->frag;
+                }
+            }
+            vsfs_inode_crc_finalize(node);
+        }
+        return 0;
+    }
+    if (b >= p->crc_start && b < p->crc_start + p->crc_blocks) {
+        // Entries of the table's own blocks (and the journal's) stay 0,
+        // as do those of zero blocks.
+        uint32_t *tab = (uint32_t*)buf;
+        uint8_t blk[BS];
+        int any = 0;
+        memset(buf, 0, BS);
+        for (uint64_t j = 0; j < PTRS_PER_BLOCK; j++) {
+            uint64_t c = (b - p->crc_start) * PTRS_PER_BLOCK + j;
+            if (c >= sb->data_region_start + p->used) break;
+            if (c >= p->crc_start && c < p->crc_start + p->crc_blocks) continue;
+            int rc = pop_block(p, c, blk, block0);
+            if (rc < 0) return -1;
+            if (rc > 0) continue;
+            uint64_t t0 = clock_ns();
+            tab[j] = vsfs_block_crc(blk);
+            p->st->crc_ns += clock_ns() - t0;
+            p->st->crc_bytes += BS;
+            any |= tab[j] != 0;
+        }
+        return any ? 0 : 1;
+    }
+    if (b >= sb->data_region_start && b - sb->data_region_start < p->used) return pop_data_block(p, b, buf);
+    return 1;   // reference counts, journal and free data blocks
+}
+
+// Plan file host_path as root entry name.
+static int pop_add(pop_plan_t *p, const char *host_path, const char *name) {
+    struct stat hs;
+    if (*name == '\0') return fail("%s: no file name", host_path);
+    if (stat(host_path, &hs) != 0) return fail("%s: %s", host_path, strerror(errno));
+    if (!S_ISREG(hs.st_mode)) return fail("%s: not a regular file", host_path);
+    if (p->n == p->cap) {
+        size_t ncap = p->cap ? p->cap * 2 : 64;
+        pop_file_t *nf = (pop_file_t*)realloc(p->f, ncap * sizeof(pop_file_t));
+        if (!nf) return fail("out of memory");
+        p->f = nf;
+        p->cap = ncap;
+    }
+    pop_file_t *f = &p->f[p->n];
+    memset(f, 0, sizeof(*f));
+    if (!(f->host = strdup(host_path))) return fail("out of memory");
+    memcpy(f->name, name, strnlen(name, VSFS_NAME_MAX));   // zeroed above
+    f->size = (uint64_t)hs.st_size;
+    p->n++;
+    return 0;
+}
+
+static int pop_name_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Plan the files src names: every line of a manifest ("-" for stdin) as
+// its base name, or the regular files of a directory in name order.
+static int pop_collect(pop_plan_t *p, const char *src) {
+    struct stat hs;
+    int rc = 0;
+    if (strcmp(src, "-") != 0 && stat(src, &hs) == 0 && S_ISDIR(hs.st_mode)) {
+        DIR *d = opendir(src);
+        if (!d) return fail("%s: %s", src, strerror(errno));
+        char **names = NULL;
+        size_t n = 0, cap = 0;
+        struct dirent *e;
+        while (rc == 0 && (e = readdir(d)) != NULL) {
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+            if (n == cap) {
+                size_t ncap = cap ? cap * 2 : 64;
+                char **nn = (char**)realloc(names, ncap * sizeof(char*));
+                if (!nn) {
+                    rc = fail("out of memory");
+                    break;
+                }
+                names = nn;
+                cap = ncap;
+            }
+            if (!(names[n] = strdup(e->d_name))) rc = fail("out of memory");
+            else n++;
+        }
+        closedir(d);
+        if (n) qsort(names, n, sizeof(char*), pop_name_cmp);
+        for (size_t i = 0; i < n; i++) {
+            size_t plen = strlen(src) + 1 + strlen(names[i]) + 1;
+            char *path = (char*)malloc(plen);
+            if (rc == 0 && !path) rc = fail("out of memory");
+            if (rc == 0) {
+                snprintf(path, plen, "%s/%s", src, names[i]);
+                rc = pop_add(p, path, names[i]);
+            }
+            free(path);
+            free(names[i]);
+        }
+        free(names);
+        return rc;
+    }
+    FILE *fm = strcmp(src, "-") == 0 ? stdin : fopen(src, "r");
+    if (!fm) return fail("%s: %s", src, strerror(errno));
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t n;
+    while (rc == 0 && (n = getline(&line, &linecap, fm)) >= 0) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        if (n == 0) continue;
+        const char *slash = strrchr(line, '/');
+        rc = pop_add(p, line, slash ? slash + 1 : line);
+    }
+    free(line);
+    if (fm != stdin) fclose(fm);
+    return rc;
+}
+
+// Lay the planned files out (see the top of this section). Fails before
+// anything is written when they do not fit.
+static int pop_layout(pop_plan_t *p) {
+    superblock_t *sb = p->sb;
+    const int packed = (sb->flags & VSFS_FLAG_PACKED) != 0;
+    const char **names = (const char**)malloc((p->n ? p->n : 1) * sizeof(char*));
+    if (!names) return fail("out of memory");
+    for (size_t i = 0; i < p->n; i++) names[i] = p->f[i].name;
+    if (p->n) qsort(names, p->n, sizeof(char*), pop_name_cmp);
+    for (size_t i = 1; i < p->n; i++) {
+        if (strcmp(names[i - 1], names[i]) == 0) {
+            fail("'%s' already exists in root", names[i]);
+            free(names);
+            return -1;
+        }
+    }
+    free(names);
+    if (p->n + 1 > sb->inode_count)
+        return fail("%zu files need %zu inodes, the image has %" PRIu64, p->n, p->n + 1, sb->inode_count);
+
+    p->root_blocks = (p->n + 2 + VSFS_DIRENTS_PER_BLOCK - 1) / VSFS_DIRENTS_PER_BLOCK;
+    uint64_t next = sb->data_region_start + p->root_blocks + indirect_blocks_for(p->root_blocks);
+    for (size_t i = 0; i < p->n; i++) {
+        pop_file_t *f = &p->f[i];
+        f->inl = packed && f->size <= VSFS_INLINE_MAX;
+        int tail = packed && !f->inl && f->size % BS <= VSFS_TAIL_MAX;
+        f->nblocks = f->inl ? 0 : tail ? f->size / BS : (f->size + BS - 1) / BS;
+        if (f->nblocks == 0 && !f->inl && !tail) f->nblocks = 1;
+        if (f->nblocks > FILE_BLOCKS_MAX)
+            return fail("%s: file too big for MiniVSFS (needs %" PRIu64 " blocks, max %" PRIu64 ")",
+                        f->host, f->nblocks, (uint64_t)FILE_BLOCKS_MAX);
+        f->start = next;
+        next += f->nblocks + indirect_blocks_for(f->nblocks);
+    }
+    // Tails fill fragment blocks in file order, a new one whenever the
+    // next does not fit.
+    p->frag_start = next;
+    uint32_t end = BS, live = 0;
+    size_t cap = 0;
+    for (size_t i = 0; i < p->n; i++) {
+        pop_file_t *f = &p->f[i];
+        uint32_t tail = (uint32_t)(f->size % BS);
+        if (!packed || f->inl || tail == 0 || tail > VSFS_TAIL_MAX) continue;
+        if (BS - end < tail || live == UINT16_MAX) {
+            if (p->nfrag == cap) {
+                cap = cap ? cap * 2 : 16;
+                size_t *nf = (size_t*)realloc(p->frag_first, cap * sizeof(size_t));
+                if (!nf) return fail("out of memory");
+                p->frag_first = nf;
+            }
+            p->frag_first[p->nfrag++] = i;
+            end = sizeof(vsfs_frag_hdr_t);
+            live = 0;
+        }
+        f->frag = VSFS_FRAG(p->frag_start + p->nfrag - 1, end, tail);
+        end += tail;
+        live++;
+    }
+    next += p->nfrag;
+    p->used = next - sb->data_region_start;
+    if (p->used > sb->data_region_blocks)
+        return fail("the files need %" PRIu64 " data blocks, the image has %" PRIu64, p->used, sb->data_region_blocks);
+
+    // Later adds go on filling the last fragment block.
+    vsfs_sb_ext_t *ext = (vsfs_sb_ext_t*)((uint8_t*)sb + VSFS_SB_EXT_OFFSET);
+    ext->frag_block = p->nfrag ? p->frag_start + p->nfrag - 1 : 0;
+    vsfs_superblock_crc_finalize(sb);
+    if (vsfs_crc_table(sb, &p->crc_start, &p->crc_blocks) <= 0) p->crc_start = p->crc_blocks = 0;
+    return 0;
+}
+
+#define POP_RUN  64   // blocks per write
+#define POP_RUNS 8    // run buffers a file is written from, at most
+
+// Where the blocks go: a stream written in order from one run buffer, or
+// a file written through an I/O queue from nruns of them, which are
+// reused once all are in flight.
+typedef struct {
+    int          fd;
+    vsfs_io_t   *io;      // NULL for a stream
+    uint8_t     *buf;     // nruns * POP_RUN blocks
+    unsigned     nruns, cur;
+    vsfs_stats_t *st;
+} pop_out_t;
+
+static uint8_t *pop_run_buf(const pop_out_t *o) {
+    return o->buf + (size_t)o->cur * POP_RUN * BS;
+}
+
+// Write the first nbuf blocks of the current run at off and move to the
+// next run buffer. -1 with errno set on failure.
+static int pop_flush(pop_out_t *o, size_t nbuf, uint64_t off) {
+    uint64_t t0 = clock_ns();
+    const uint8_t *p = pop_run_buf(o);
+    size_t len = nbuf * BS;
+    int e = 0;
+    if (o->io) {
+        e = vsfs_io_write(o->io, o->fd, p, len, off);
+        if (!e && ++o->cur == o->nruns) {
+            e = vsfs_io_wait(o->io);
+            o->cur = 0;
+        }
+    } else {
+        while (len > 0 && !e) {
+            ssize_t nw = write(o->fd, p, len);
+            count_write(o->st, nw);
+            if (nw < 0 && errno == EINTR) continue;
+            if (nw < 0) {
+                e = errno;
+                break;
+            }
+            p += nw;
+            len -= (size_t)nw;
+        }
+    }
+    o->st->write_ns += clock_ns() - t0;
+    errno = e;
+    return e ? -1 : 0;
+}
+
+// vsfs_format() of a populated image, or of any image to stdout (path
+// "-"). block0 holds the superblock, which gets the fragment block.
+static int populate_image(const char *path, const vsfs_format_opts_t *opts, uint8_t *block0, vsfs_stats_t *st) {
+    superblock_t *sb = (superblock_t*)block0;
+    pop_plan_t p;
+    memset(&p, 0, sizeof(p));
+    p.sb = sb;
+    p.now = sb->mtime_epoch;
+    p.fd = -1;
+    p.st = st;
+    const int stream = strcmp(path, "-") == 0;
+    int out = -1, rc = -1;
+    pop_out_t o;
+    memset(&o, 0, sizeof(o));
+    if ((opts->populate && pop_collect(&p, opts->populate) != 0) || pop_layout(&p) != 0) goto done;
+
+    if (stream) {
+        out = STDOUT_FILENO;
+    } else {
+        // O_DIRECT where the filesystem takes it: the run buffers are
+        // aligned and every write is whole blocks.
+        if (opts->io.direct) out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+        if (out < 0) out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (out < 0) {
+        fail("open %s: %s", path, strerror(errno));
+        goto done;
+    }
+    // A file is sized first so zero blocks can be skipped; a stream gets
+    // every block.
+    const uint64_t img_bytes = sb->total_blocks * (uint64_t)BS;
+    if (!stream && ftruncate(out, (off_t)img_bytes) != 0) {
+        fail("ftruncate %s: %s", path, strerror(errno));
+        goto done;
+    }
+    if (!stream && opts->preallocate) {
+        int e = posix_fallocate(out, 0, (off_t)img_bytes);
+        if (e != 0) {
+            fail("fallocate %s: %s", path, strerror(e));
+            goto done;
+        }
+    }
+    o.fd = out;
+    o.st = st;
+    o.nruns = 1;
+    if (!stream) {
+        if (!(o.io = vsfs_io_new(opts->io.kind, opts->io.depth))) {
+            fail("out of memory");
+            goto done;
+        }
+        o.nruns = opts->io.depth && opts->io.depth < POP_RUNS ? opts->io.depth : POP_RUNS;
+    }
+    const size_t buf_len = (size_t)o.nruns * POP_RUN * BS;
+    if (posix_memalign((void**)&o.buf, BS, buf_len) != 0) {
+        o.buf = NULL;
+        fail("out of memory");
+        goto done;
+    }
+    if (o.io) vsfs_io_register(o.io, o.buf, buf_len);   // unregistered writes work as well
+    uint64_t off = 0;   // of the current run's first block
+    size_t nbuf = 0;
+    for (uint64_t b = 0; b < sb->total_blocks; b++) {
+        int r = pop_block(&p, b, pop_run_buf(&o) + nbuf * BS, block0);
+        if (r < 0) goto done;
+        if (r > 0 && !stream) {
+            if (nbuf && pop_flush(&o, nbuf, off) != 0) goto write_err;
+            nbuf = 0;
+            off = (b + 1) * BS;
+            continue;
+        }
+        if (r > 0) memset(pop_run_buf(&o) + nbuf * BS, 0, BS);
+        if (++nbuf == POP_RUN) {
+            if (pop_flush(&o, nbuf, off) != 0) goto write_err;
+            off += nbuf * BS;
+            nbuf = 0;
+        }
+    }
+    if (nbuf && pop_flush(&o, nbuf, off) != 0) goto write_err;
+    if (o.io && (errno = vsfs_io_wait(o.io)) != 0) goto write_err;
+    if (!stream) {
+        int c = close(out);
+        out = -1;
+        if (c != 0) {
+            fail("close %s: %s", path, strerror(errno));
+            goto done;
+        }
+    }
+    st->inodes_total = sb->inode_count;
+    st->inodes_free  = sb->inode_count - p.n - 1;
+    st->blocks_total = sb->data_region_blocks;
+    st->blocks_free  = sb->data_region_blocks - p.used;
+    rc = 0;
+    goto done;
+
+write_err:
+    fail("write %s: %s", stream ? "stdout" : path, strerror(errno));
+done:
+    if (o.io) {
+        vsfs_io_wait(o.io);   // nothing may still be writing from o.buf
+        io_count(o.io, st);
+        vsfs_io_free(o.io);
+    }
+    // A half-written image file is worse than none.
+    if (!stream && out >= 0) {
+        close(out);
+        unlink(path);
+    }
+    if (p.fd >= 0) close(p.fd);
+    for (size_t i = 0; i < p.n; i++) free(p.f[i].host);
+    free(p.f);
+    free(p.frag_first);
+    free(o.buf);
+    return rc;
+}
+
+// ----------------- Format -----------------
+
+int vsfs_format(const char *path, const vsfs_format_opts_t *opts, superblock_t *sb_out) {
+    uint64_t t_start = clock_ns();
+    vsfs_stats_t st;
+    memset(&st, 0, sizeof(st));
+    vsfs_crc32_init();
+    const uint64_t size_kib = opts->size_kib, inode_count = opts->inodes;
+    if (size_kib < VSFS_MIN_SIZE_KIB || size_kib > VSFS_MAX_SIZE_KIB || (size_kib % 4) != 0)
+        return fail("size must be a multiple of 4 KiB in [%llu,%llu]",
+                    (unsigned long long)VSFS_MIN_SIZE_KIB, (unsigned long long)VSFS_MAX_SIZE_KIB);
+    if (inode_count < VSFS_MIN_INODES || inode_count > VSFS_MAX_INODES)
+        return fail("inode count must be in [%llu,%llu]",
+                    (unsigned long long)VSFS_MIN_INODES, (unsigned long long)VSFS_MAX_INODES);
+    if (opts->journal && opts->journal != VSFS_JOURNAL_AUTO && (opts->journal < 4 || opts->journal % 2 != 0))
+        return fail("journal must be an even number of blocks, at least 4");
+
+    // compute layout numbers
+    const uint64_t total_blocks = size_kib / 4;
+    const uint64_t inodes_per_block = BS / INODE_SIZE;
+    const uint64_t inode_table_blocks = (inode_count + inodes_per_block - 1) / inodes_per_block;
+    const uint64_t crc_blocks = opts->block_crc ? (total_blocks + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK : 0;
+    const uint64_t ref_blocks = opts->refcount  ? (total_blocks + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK : 0;
+    const uint64_t ibm_blocks = (inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    // An automatic journal gives each slot room for every fixed metadata
+    // block plus 64 directory blocks, within a quarter of the image.
+    uint64_t jnl_blocks = opts->journal;
+    if (jnl_blocks == VSFS_JOURNAL_AUTO) {
+        uint64_t fixed = 1 + ibm_blocks + (total_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK +
+                         inode_table_blocks + crc_blocks + ref_blocks;
+        jnl_blocks = 2 * journal_slot_need(fixed + 64);
+        if (jnl_blocks > total_blocks / 4) jnl_blocks = total_blocks / 4 & ~1ull;
+        if (jnl_blocks < 4) jnl_blocks = 4;
+    }
+
+    // One bitmap bit per inode / data block. The data bitmap's own size
+    // shrinks the data region it describes, so settle it by iterating
+    // (converges in a step or two).
+    uint64_t dbm_blocks = 1;
+    for (;;) {
+        uint64_t meta = 1 + ibm_blocks + dbm_blocks + inode_table_blocks + crc_blocks + ref_blocks + jnl_blocks;
+        if (total_blocks <= meta) break;
+        uint64_t need = (total_blocks - meta + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        if (need <= dbm_blocks) break;
+        dbm_blocks = need;
+    }
+
+    const uint64_t super_start = 0;
+    const uint64_t ibm_start   = 1;
+    const uint64_t dbm_start   = ibm_start + ibm_blocks;
+    const uint64_t itab_start  = dbm_start + dbm_blocks;
+    const uint64_t crc_start   = itab_start + inode_table_blocks;
+    const uint64_t ref_start   = crc_start + crc_blocks;
+    const uint64_t jnl_start   = ref_start + ref_blocks;
+    const uint64_t data_start  = jnl_start + jnl_blocks;
+
+    if (total_blocks <= data_start) return fail("image too small for metadata layout (need more blocks)");
+    const uint64_t data_blocks = total_blocks - data_start;
+
+    // Only five blocks ever hold anything but zeros: superblock, the first
+    // block of each bitmap, the first inode-table block and the root
+    // directory block (plus the block CRC table entries for those five).
+    // Stage just those; the rest of the image is a hole from ftruncate.
+    const uint64_t img_bytes = total_blocks * (uint64_t)BS;
+    enum { M_SUPER, M_IBM, M_DBM, M_ITAB, M_ROOT, M_COUNT };
+    const uint64_t meta_bno[M_COUNT] = { super_start, ibm_start, dbm_start, itab_start, data_start };
+    uint8_t *meta = (uint8_t*)calloc(M_COUNT, BS);
+    if (!meta) return fail("out of memory");
+    #define META_PTR(m) (meta + (uint64_t)(m) * BS)
+
+    // ---------------- Superblock (block 0) ----------------
+    superblock_t *sb = (superblock_t*)META_PTR(M_SUPER);
+    sb->magic               = VSFS_MAGIC;
+    sb->version             = VSFS_VERSION;
+    sb->block_size          = BS;
+    sb->total_blocks        = total_blocks;
+    sb->inode_count         = inode_count;
+    sb->inode_bitmap_start  = ibm_start;
+    sb->inode_bitmap_blocks = ibm_blocks;
+    sb->data_bitmap_start   = dbm_start;
+    sb->data_bitmap_blocks  = dbm_blocks;
+    sb->inode_table_start   = itab_start;
+    sb->inode_table_blocks  = inode_table_blocks;
+    sb->data_region_start   = data_start;
+    sb->data_region_blocks  = data_blocks;
+    sb->root_inode          = ROOT_INO;
+    sb->mtime_epoch         = (uint64_t)time(NULL);
+    sb->flags               = (opts->block_crc ? VSFS_FLAG_BLOCK_CRC : 0) | (opts->refcount ? VSFS_FLAG_REFCOUNT : 0) |
+                              (opts->packed ? VSFS_FLAG_PACKED : 0) | (jnl_blocks ? VSFS_FLAG_JOURNAL : 0);
+    vsfs_sb_ext_t *ext = (vsfs_sb_ext_t*)(META_PTR(M_SUPER) + VSFS_SB_EXT_OFFSET);
+    if (opts->block_crc) {
+        ext->crc_table_start  = crc_start;
+        ext->crc_table_blocks = crc_blocks;
+    }
+    if (opts->refcount) {   // all zeros: every block has one reference
+        ext->refcount_start  = ref_start;
+        ext->refcount_blocks = ref_blocks;
+    }
+    if (jnl_blocks) {       // all zeros: both slots empty
+        ext->journal_start  = jnl_start;
+        ext->journal_blocks = jnl_blocks;
+    }
+    vsfs_superblock_crc_finalize(sb);
+
+    // A populated image (or one for a pipe) is streamed out in one pass.
+    if (opts->populate || strcmp(path, "-") == 0) {
+        int rc = populate_image(path, opts, META_PTR(M_SUPER), &st);
+        if (rc == 0 && sb_out) memcpy(sb_out, sb, sizeof(*sb));
+        free(meta);
+        if (rc == 0 && opts->stats) {
+            st.total_ns = clock_ns() - t_start;
+            *opts->stats = st;
+        }
+        return rc;
+    }
+
+    // ---------------- Bitmaps ----------------
+    // allocate inode #1 (root) and the first data block for root directory
+    BIT_SET(META_PTR(M_IBM), 0);
+    BIT_SET(META_PTR(M_DBM), 0);
+
+    // ---------------- Inode table ----------------
+    inode_t *root = (inode_t*)META_PTR(M_ITAB);
+    root->mode       = VSFS_S_IFDIR;
+    root->links      = 2;
+    root->size_bytes = BS;
+    root->atime = root->mtime = root->ctime = (uint64_t)time(NULL);
+    root->direct[0]  = (uint32_t)data_start;
+    root->proj_id    = 6;
+    vsfs_inode_crc_finalize(root);
+
+    // ---------------- Root directory data ----------------
+    dirent64_t *ents = (dirent64_t*)META_PTR(M_ROOT);
+    ents[0].inode_no = ROOT_INO;
+    ents[0].type = VSFS_DT_DIR;
+    strncpy(ents[0].name, ".", sizeof(ents[0].name));
+    vsfs_dirent_checksum_finalize(&ents[0]);
+    ents[1].inode_no = ROOT_INO;
+    ents[1].type = VSFS_DT_DIR;
+    strncpy(ents[1].name, "..", sizeof(ents[1].name));
+    vsfs_dirent_checksum_finalize(&ents[1]);
+
+    // ---------------- Write the image to disk ----------------
+    uint64_t t_write = clock_ns();
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fail("open %s: %s", path, strerror(errno));
+        free(meta);
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)img_bytes) != 0) {
+        fail("ftruncate %s: %s", path, strerror(errno));
+        close(fd);
+        free(meta);
+        return -1;
+    }
+    if (opts->preallocate) {
+        // Reserve the extents now so later in-place adds cannot hit ENOSPC.
+        int e = posix_fallocate(fd, 0, (off_t)img_bytes);
+        if (e != 0) {
+            fail("fallocate %s: %s", path, strerror(e));
+            close(fd);
+            free(meta);
+            return -1;
+        }
+    }
+    for (int m = 0; m < M_COUNT; m++) {
+        if (write_all(fd, META_PTR(m), BS, (off_t)(meta_bno[m] * BS), &st) != 0) {
+            fail("write %s: %s", path, strerror(errno));
+            close(fd);
+            free(meta);
+            return -1;
+        }
+    }
+    // Every other block is zero, which the table encodes as 0: only the
+    // table blocks holding entries for the staged blocks need writing.
+    for (int m = 0; opts->block_crc && m < M_COUNT; ) {
+        uint32_t tab[PTRS_PER_BLOCK];
+        memset(tab, 0, sizeof(tab));
+        uint64_t t = meta_bno[m] / PTRS_PER_BLOCK, t_crc = clock_ns();
+        for (; m < M_COUNT && meta_bno[m] / PTRS_PER_BLOCK == t; m++) {
+            tab[meta_bno[m] % PTRS_PER_BLOCK] = vsfs_block_crc(META_PTR(m));
+            st.crc_bytes += BS;
+        }
+        st.crc_ns += clock_ns() - t_crc;
+        if (write_all(fd, tab, BS, (off_t)((crc_start + t) * BS), &st) != 0) {
+            fail("write %s: %s", path, strerror(errno));
+            close(fd);
+            free(meta);
+            return -1;
+        }
+    }
+    if (close(fd) != 0) {
+        fail("close %s: %s", path, strerror(errno));
+        free(meta);
+        return -1;
+    }
+    if (sb_out) memcpy(sb_out, sb, sizeof(*sb));
+    #undef META_PTR
+    free(meta);
+    if (opts->stats) {
+        st.total_ns     = clock_ns() - t_start;
+        st.write_ns     = clock_ns() - t_write - st.crc_ns;
+        st.inodes_total = inode_count;
+        st.inodes_free  = inode_count - 1;   // the root
+        st.blocks_total = data_blocks;
+        st.blocks_free  = data_blocks - 1;   // its directory block
+        *opts->stats = st;
+    }
+    return 0;
+}
+
+// ----------------- Handles -----------------
+
+typedef struct dir_index dir_index_t;
+typedef struct ingest_job ingest_job_t;
+
+// Deduplication index: CRC32C of a file data block -> block number, open
+// addressing. Entries are never removed; one is only trusted while its
+// block's bit in live is set (cleared when the block is freed or
+// overwritten) and its contents compare equal.
+typedef struct {
+    uint32_t hash;
+    uint32_t block;               // 0 = empty slot
+} dedup_slot_t;
+
+typedef struct {
+    dedup_slot_t *tab;
+    uint64_t      cap, n;         // cap is a power of two
+    uint8_t      *live;           // per data block: indexed and unchanged since
+    uint64_t      blocks, shared; // see vsfs_dedup_stats()
+} dedup_t;
+
+// Compression: counters for vsfs_compress_stats() and the last cluster
+// decompressed by a read, kept for the next one.
+typedef struct {
+    uint64_t      blocks, stored;
+    uint64_t      pending;        // bytes of queued files waiting to be compressed and committed
+    uint64_t      ino, cluster;   // cluster held in out; ino 0 = none
+    uint8_t      *in, *out;       // VSFS_ZCLUSTER bytes each
+} zip_t;
+
+#define ZIP_PENDING_MAX (256ull << 20)
+
+typedef struct {
+    vsfs_t         *im;
+    pthread_mutex_t lock;
+    pthread_cond_t  more;
+    ingest_job_t  **jobs;
+    size_t          njobs, cap;
+    size_t          next;    // first job no worker has taken
+    int             closed;  // no more jobs will be queued
+    pthread_t      *threads;
+    int             nthreads;
+} ingest_pool_t;
+
+// An open image. The file is mapped MAP_PRIVATE, so edits stay in memory
+// until vsfs_sync() decides what to write back. All region pointers alias
+// into img.
+struct vsfs {
+    int            fd;
+    int            in_place;  // VSFS_RDWR: data copies go straight to fd
+    int            view;      // VSFS_VIEW: the mapping is read-only
+    uint8_t       *img;
+    size_t         len;
+    uint64_t       nblocks;
+    uint8_t       *dirty;     // one bit per image block changed in the mapping since the last sync
+    uint8_t       *copied;    // in place: blocks written straight to fd since the last sync
+    uint32_t      *crctab;    // block CRC table in the mapping, or NULL
+    uint64_t       crc_start, crc_blocks;
+    uint32_t      *refcnt;    // extra references per data block, or NULL
+    uint32_t       frag_block; // fragment block tails go into next, or 0
+    uint64_t       jstart, jblocks; // journal region (VSFS_FLAG_JOURNAL), or jblocks 0
+    uint64_t       jseq;      // last transaction committed to it
+    uint8_t       *fresh;     // journaled, in place: data blocks allocated since the last sync
+    uint8_t       *held;      // journaled, in place: data blocks freed since the last sync
+    int            dedup_on;
+    dedup_t        dedup;     // built on the first deduplicating add
+    int            compress_on;
+    zip_t          zip;
+    superblock_t  *sb;
+    vsfs_bitmap_t  inodes;    // allocator over the inode bitmap
+    vsfs_bitmap_t  blocks;    // allocator over the data bitmap
+    inode_t       *itab;
+    dir_index_t  **dirs;      // name indexes of directories, chained by inode number
+    uint64_t       dirs_cap;  // buckets in dirs, power of two
+    uint64_t       ndirs;
+    ingest_pool_t  pool;
+    int            pool_live; // workers started and not yet drained
+    int            nthreads;
+    vsfs_report_fn report;
+    void          *report_ctx;
+    vsfs_stats_t   stats;     // see vsfs_stats(); workers count into their jobs
+    uint64_t       opened_ns;
+    vsfs_io_opts_t io_opts;
+    vsfs_io_t     *io;        // sync writes, created on first use; counts into stats at vsfs_stats()
+};
+
+// Bitmap searches, timed for vsfs_stats_t.scan_ns.
+static uint64_t inode_bit_alloc(vsfs_t *im) {
+    uint64_t t0 = clock_ns();
+    uint64_t bit = vsfs_bitmap_alloc(&im->inodes);
+    im->stats.scan_ns += clock_ns() - t0;
+    return bit;
+}
+
+static int block_bits_alloc(vsfs_t *im, uint64_t n, uint64_t *out) {
+    uint64_t t0 = clock_ns();
+    int rc = vsfs_bitmap_alloc_n(&im->blocks, n, out);
+    im->stats.scan_ns += clock_ns() - t0;
+    for (uint64_t k = 0; rc == 0 && im->fresh && k < n; k++) BIT_SET(im->fresh, out[k]);
+    return rc;
+}
+
+// Record that the block holding p (which must point into the image) changed.
+static void image_mark(vsfs_t *im, const void *p) {
+    uint64_t bno = (uint64_t)((const uint8_t*)p - im->img) / BS;
+    BIT_SET(im->dirty, bno);
+}
+
+// The header of fragment block b, or NULL when b is not an allocated data
+// block holding a plausible one.
+static vsfs_frag_hdr_t *frag_hdr(const vsfs_t *im, uint32_t b) {
+    uint64_t start = im->sb->data_region_start;
+    if (b < start || b - start >= im->sb->data_region_blocks || !BIT_TEST(im->blocks.bits, b - start)) return NULL;
+    vsfs_frag_hdr_t *h = (vsfs_frag_hdr_t*)(im->img + (uint64_t)b * BS);
+    if (h->magic != VSFS_FRAG_MAGIC || h->end < sizeof(*h) || h->end > BS) return NULL;
+    return h;
+}
+
+// Calls that would change the image fail on a VSFS_VIEW handle.
+static int view_only(const vsfs_t *im) {
+    return im->view ? fail("the image was opened VSFS_VIEW, for reading only") : 0;
+}
+
+int vsfs_open(const char *path, int flags, vsfs_t **out) {
+    uint64_t t_open = clock_ns();
+    *out = NULL;
+    vsfs_crc32_init();
+    int in_place = (flags & VSFS_RDWR) != 0, view = (flags & VSFS_VIEW) != 0;
+    if (in_place && view) return fail("VSFS_RDWR and VSFS_VIEW exclude each other");
+    int fd = open(path, in_place ? O_RDWR : O_RDONLY);
+    if (fd < 0) return fail("open %s: %s", path, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fail("fstat %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // Parse superblock
+    if ((uint64_t)st.st_size < BS) {
+        close(fd);
+        return fail("image too small");
+    }
+    // Nothing is reserved against the image size: only blocks changed in
+    // the mapping take memory, so images larger than RAM open too. A view
+    // cannot change anything, so its mapping is read-only.
+    const int prot = view ? PROT_READ : PROT_READ | PROT_WRITE;
+    uint8_t *img = (uint8_t*)mmap(NULL, (size_t)st.st_size, prot, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (img == MAP_FAILED) {
+        fail("mmap %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    superblock_t *sb = (superblock_t*)(img + 0);
+    uint64_t crc_start = 0, crc_blocks = 0, ref_start = 0, ref_blocks = 0, jstart = 0, jblocks = 0, jseq = 0;
+    // Recover from a crash first: the superblock itself may be journaled,
+    // so only its layout is checked before the replay, not its CRC.
+    vsfs_stats_t jst = {0};
+    const char *bad = vsfs_superblock_check(sb, (uint64_t)st.st_size, 0);
+    if (!bad && (sb->flags & VSFS_FLAG_JOURNAL) &&
+        journal_locate(img, (uint64_t)st.st_size, &jstart, &jblocks) == 0) {
+        // A view replays into its mapping too, made writable just for
+        // that; the blocks replayed are the only ones it copies.
+        int rc = 0;
+        if (view && mprotect(img, (size_t)st.st_size, PROT_READ | PROT_WRITE) != 0)
+            rc = fail("mprotect: %s", strerror(errno));
+        if (rc == 0 && journal_replay(img, (uint64_t)st.st_size, in_place ? fd : -1, &jst, &jseq) < 0) rc = -1;
+        if (rc == 0 && !in_place && !view) rc = vsfs_journal_reset(img, (uint64_t)st.st_size, -1);
+        if (rc == 0 && view && mprotect(img, (size_t)st.st_size, PROT_READ) != 0)
+            rc = fail("mprotect: %s", strerror(errno));
+        if (rc != 0) {
+            munmap(img, (size_t)st.st_size);
+            close(fd);
+            return -1;
+        }
+    }
+    if (!bad) bad = vsfs_superblock_check(sb, (uint64_t)st.st_size, 1);
+    if (!bad && vsfs_crc_table(sb, &crc_start, &crc_blocks) < 0)
+        bad = "block CRC table does not fit the layout";
+    if (!bad && vsfs_refcount_table(sb, &ref_start, &ref_blocks) < 0)
+        bad = "reference-count region does not fit the layout";
+    if (!bad && vsfs_journal_region(sb, &jstart, &jblocks) < 0)
+        bad = "journal does not fit the layout";
+    if (bad) {
+        munmap(img, (size_t)st.st_size);
+        close(fd);
+        return fail("%s", bad);
+    }
+    vsfs_t *im = (vsfs_t*)calloc(1, sizeof(*im));
+    uint8_t *dirty = (uint8_t*)calloc(1, (size_t)((sb->total_blocks + 7) / 8));
+    uint8_t *copied = (uint8_t*)calloc(1, (size_t)((sb->total_blocks + 7) / 8));
+    uint8_t *fresh = NULL, *held = NULL;
+    if (in_place && jblocks) {
+        fresh = (uint8_t*)calloc(1, (size_t)((sb->data_region_blocks + 7) / 8));
+        held  = (uint8_t*)calloc(1, (size_t)((sb->data_region_blocks + 7) / 8));
+    }
+    if (!im || !dirty || !copied || (in_place && jblocks && (!fresh || !held))) {
+        free(im);
+        free(dirty);
+        free(copied);
+        free(fresh);
+        free(held);
+        munmap(img, (size_t)st.st_size);
+        close(fd);
+        return fail("out of memory");
+    }
+
+    // Map important regions
+    im->fd       = fd;
+    im->in_place = in_place;
+    im->view     = view;
+    im->img      = img;
+    im->len      = (size_t)st.st_size;
+    im->nblocks  = sb->total_blocks;
+    im->dirty    = dirty;
+    im->copied   = copied;
+    im->sb       = sb;
+    if (crc_blocks) {
+        im->crctab     = (uint32_t*)(img + crc_start * BS);
+        im->crc_start  = crc_start;
+        im->crc_blocks = crc_blocks;
+    }
+    if (ref_blocks) im->refcnt = (uint32_t*)(img + ref_start * BS);
+    im->jstart   = jstart;
+    im->jblocks  = jblocks;
+    im->jseq     = jseq;
+    im->fresh    = fresh;
+    im->held     = held;
+    im->stats    = jst;
+    vsfs_bitmap_init(&im->inodes, img + sb->inode_bitmap_start * BS, sb->inode_count);
+    vsfs_bitmap_init(&im->blocks, img + sb->data_bitmap_start  * BS, sb->data_region_blocks);
+    if ((sb->flags & VSFS_FLAG_PACKED) && frag_hdr(im, (uint32_t)sb_ext(sb)->frag_block))
+        im->frag_block = (uint32_t)sb_ext(sb)->frag_block;
+    im->itab     = (inode_t*)(img + sb->inode_table_start * BS);
+    im->nthreads = 1;
+    im->opened_ns = t_open;
+    im->stats.load_ns = clock_ns() - t_open;
+    *out = im;
+    return 0;
+}
+
+// Refresh the block CRC table entries of every block changed since the
+// last sync: dirty blocks from the mapping, blocks copied straight into
+// the image file read back from it. Changed table blocks are marked dirty.
+static int crc_table_update(vsfs_t *im) {
+    uint64_t t0 = clock_ns();
+    uint8_t buf[BS];
+    for (uint64_t i = 0; i < (im->nblocks + 7) / 8; i++) {
+        if ((im->dirty[i] | im->copied[i]) == 0) continue;
+        for (uint64_t b = i * 8; b < i * 8 + 8 && b < im->nblocks; b++) {
+            int in_map = BIT_TEST(im->dirty, b);
+            if (!in_map && !BIT_TEST(im->copied, b)) continue;
+            if (b - im->crc_start < im->crc_blocks) continue;
+            const uint8_t *src = im->img + b * BS;
+            if (!in_map) {
+                for (size_t got = 0; got < BS; ) {
+                    ssize_t nr = pread(im->fd, buf + got, BS - got, (off_t)(b * BS + got));
+                    count_read(&im->stats, nr);
+                    if (nr < 0 && errno == EINTR) continue;
+                    if (nr <= 0) return fail("pread: %s", nr < 0 ? strerror(errno) : "image file shrank");
+                    got += (size_t)nr;
+                }
+                src = buf;
+            }
+            uint32_t e = vsfs_block_crc(src);
+            im->stats.crc_bytes += BS;
+            if (im->crctab[b] != e) {
+                im->crctab[b] = e;
+                image_mark(im, &im->crctab[b]);
+            }
+        }
+    }
+    im->stats.crc_ns += clock_ns() - t0;
+    return 0;
+}
+
+// Dirty data block b of a journaled handle was free before this
+// transaction, so it is written home directly rather than journaled.
+static int block_fresh(const vsfs_t *im, uint64_t b) {
+    uint64_t d = b - im->sb->data_region_start;
+    return d < im->sb->data_region_blocks && BIT_TEST(im->fresh, d);
+}
+
+static int block_journaled(const vsfs_t *im, uint64_t b) {
+    return !block_fresh(im, b);
+}
+
+#define IO_CHUNK ((size_t)256 * BS)   // 1 MiB: long runs are split so the pieces overlap
+
+// The handle's I/O queue, created from io_opts on first use.
+static vsfs_io_t *handle_io(vsfs_t *im) {
+    if (!im->io && !(im->io = vsfs_io_new(im->io_opts.kind, im->io_opts.depth))) fail("out of memory");
+    return im->io;
+}
+
+// Queue a write of len bytes at off, in IO_CHUNK pieces.
+static int io_write_chunks(vsfs_io_t *io, int fd, const uint8_t *buf, size_t len, uint64_t off) {
+    int e = 0;
+    for (size_t at = 0; at < len && !e; at += IO_CHUNK)
+        e = vsfs_io_write(io, fd, buf + at, len - at < IO_CHUNK ? len - at : IO_CHUNK, off + at);
+    return e;
+}
+
+// Write the dirty blocks for which want() holds (every one when want is
+// NULL), coalescing adjacent ones; the runs go through the I/O queue
+// together.
+static int write_dirty(vsfs_t *im, int (*want)(const vsfs_t*, uint64_t), uint64_t *nw_blocks) {
+    vsfs_io_t *io = handle_io(im);
+    if (!io) return -1;
+    // The mapping is page aligned and runs are whole blocks, as O_DIRECT
+    // wants; a filesystem without it stays buffered.
+    const int fl = im->io_opts.direct ? fcntl(im->fd, F_GETFL) : -1;
+    const int direct = fl >= 0 && fcntl(im->fd, F_SETFL, fl | O_DIRECT) == 0;
+    int e = 0;
+    for (uint64_t b = 0; b < im->nblocks && !e; ) {
+        if (!BIT_TEST(im->dirty, b) || (want && !want(im, b))) { b++; continue; }
+        uint64_t e_blk = b + 1;
+        while (e_blk < im->nblocks && BIT_TEST(im->dirty, e_blk) && (!want || want(im, e_blk))) e_blk++;
+        e = io_write_chunks(io, im->fd, im->img + b * BS, (size_t)((e_blk - b) * BS), b * BS);
+        *nw_blocks += e_blk - b;
+        b = e_blk;
+    }
+    int w = vsfs_io_wait(io);
+    if (!e) e = w;
+    if (direct) fcntl(im->fd, F_SETFL, fl);
+    if (e) return fail("pwrite: %s", strerror(e));
+    return 0;
+}
+
+// Start a transaction: blocks freed since the last sync become free, and
+// dirty data blocks that are free now need not be written at all (the
+// image this sync commits does not use them).
+static void journal_begin(vsfs_t *im) {
+    const uint64_t start = im->sb->data_region_start, n = im->sb->data_region_blocks;
+    for (uint64_t d = 0; d < n; d++) {
+        if (!BIT_TEST(im->held, d)) continue;
+        vsfs_bitmap_free(&im->blocks, d);
+        image_mark(im, &im->blocks.bits[d >> 3]);
+    }
+    for (uint64_t d = 0; d < n; d++)
+        if (BIT_TEST(im->dirty, start + d) && !BIT_TEST(im->blocks.bits, d)) BIT_CLEAR(im->dirty, start + d);
+}
+
+// Commit the transaction journal_begin() started; see vsfs_sync(). When
+// it does not fit a slot, the blocks it freed are held again.
+static int journal_commit(vsfs_t *im, uint64_t *nw_blocks) {
+    const uint64_t half = im->jblocks / 2;
+    uint64_t count = 0;
+    for (uint64_t b = 0; b < im->nblocks; b++)
+        if (BIT_TEST(im->dirty, b) && block_journaled(im, b)) count++;
+    const uint64_t need = journal_slot_need(count);
+    if (count && need > half) {
+        for (uint64_t d = 0; d < im->sb->data_region_blocks; d++)
+            if (BIT_TEST(im->held, d)) vsfs_bitmap_set(&im->blocks, d);
+        return fail("the changes since the last sync need %" PRIu64 " journal blocks but a transaction holds at most %"
+                    PRIu64 "; sync more often or make a larger journal", need, half);
+    }
+
+    // Ordered: new data must be on disk before the metadata that points at it.
+    uint64_t direct = 0;
+    if (write_dirty(im, block_fresh, &direct) != 0) return -1;
+    int copied = 0;
+    for (uint64_t i = 0; i < (im->nblocks + 7) / 8 && !copied; i++) copied = im->copied[i] != 0;
+    if ((direct || copied) && count && fdatasync(im->fd) != 0) return fail("fdatasync: %s", strerror(errno));
+    *nw_blocks += direct;
+    if (count == 0) return 0;
+
+    uint8_t *slot = (uint8_t*)calloc(need, BS);
+    if (!slot) return fail("out of memory");
+    vsfs_journal_hdr_t *h = (vsfs_journal_hdr_t*)slot;
+    h->magic = VSFS_JOURNAL_MAGIC;
+    h->seq   = im->jseq + 1;
+    h->count = (uint32_t)count;
+    uint8_t *images = slot + (need - count) * BS;
+    for (uint64_t b = 0, i = 0; b < im->nblocks; b++) {
+        if (!BIT_TEST(im->dirty, b) || !block_journaled(im, b)) continue;
+        *journal_home(slot, i) = (uint32_t)b;
+        memcpy(images + i++ * BS, im->img + b * BS, BS);
+    }
+    h->crc = journal_crc(slot, need);
+    uint64_t at = im->jstart + (h->seq % 2) * half;
+    int rc = write_all(im->fd, slot, (size_t)(need * BS), (off_t)(at * BS), &im->stats);
+    free(slot);
+    if (rc != 0) return fail("pwrite: %s", strerror(errno));
+    // The commit point. The home writes below are made durable by the next
+    // transaction's flush, before it can reuse this slot's other half.
+    if (fdatasync(im->fd) != 0) return fail("fdatasync: %s", strerror(errno));
+    im->jseq++;
+    *nw_blocks += need;
+    return write_dirty(im, block_journaled, nw_blocks);
+}
+
+int vsfs_sync(vsfs_t *im, const char *out_path, uint64_t *written) {
+    if (view_only(im) != 0) return -1;
+    vsfs_flush(im);
+    uint64_t nw_blocks = 0;
+    if (written) *written = 0;
+    if (im->in_place && out_path) return fail("an in-place (VSFS_RDWR) handle can only be synced to its own file");
+    if (!im->in_place && !out_path) return fail("an output path is required for a read-only (VSFS_RDONLY) handle");
+    if (im->held) journal_begin(im);
+    if (BIT_TEST(im->dirty, 0)) vsfs_superblock_crc_finalize(im->sb);
+    if (im->crctab && crc_table_update(im) != 0) return -1;
+    uint64_t t0 = clock_ns();
+    if (im->in_place) {
+        if ((im->held ? journal_commit(im, &nw_blocks) : write_dirty(im, NULL, &nw_blocks)) != 0) {
+            im->stats.write_ns += clock_ns() - t0;
+            return -1;
+        }
+        if (im->held) {
+            memset(im->fresh, 0, (size_t)((im->sb->data_region_blocks + 7) / 8));
+            memset(im->held, 0, (size_t)((im->sb->data_region_blocks + 7) / 8));
+        }
+        memset(im->dirty, 0, (size_t)((im->nblocks + 7) / 8));
+        memset(im->copied, 0, (size_t)((im->nblocks + 7) / 8));
+        im->stats.write_ns += clock_ns() - t0;
+        if (written) *written = nw_blocks;
+        return 0;
+    }
+
+    // Writing over the mapped input would truncate it under us.
+    struct stat si, so;
+    if (fstat(im->fd, &si) == 0 && stat(out_path, &so) == 0 && si.st_dev == so.st_dev && si.st_ino == so.st_ino)
+        return fail("%s is the open image; open it VSFS_RDWR to update it in place", out_path);
+    vsfs_io_t *io = handle_io(im);
+    if (!io) return -1;
+    int fd = im->io_opts.direct ? open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666) : -1;
+    if (fd < 0) fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return fail("open %s: %s", out_path, strerror(errno));
+    int e = io_write_chunks(io, fd, im->img, im->len, 0);
+    int w = vsfs_io_wait(io);
+    if (e || w) {
+        fail("write %s: %s", out_path, strerror(e ? e : w));
+        close(fd);
+        return -1;
+    }
+    if (close(fd) != 0) return fail("close %s: %s", out_path, strerror(errno));
+    im->stats.write_ns += clock_ns() - t0;
+    if (written) *written = im->nblocks;
+    return 0;
+}
+
+const superblock_t *vsfs_superblock(const vsfs_t *im) {
+    return im->sb;
+}
+
+// Block number b if it lies in the data region, else 0.
+static uint32_t data_block(const vsfs_t *im, uint32_t b) {
+    uint64_t start = im->sb->data_region_start;
+    if (b < start || b - start >= im->sb->data_region_blocks) return 0;
+    return b;
+}
+
+static uint32_t *image_ptr_block(const vsfs_t *im, uint32_t bno) {
+    if (!data_block(im, bno)) return NULL;
+    return (uint32_t*)(im->img + (uint64_t)bno * BS);
+}
+
+// Physical block holding logical block k of ino, or 0 if it is unmapped
+// (or the chain points outside the data region).
+static uint32_t inode_bmap(const vsfs_t *im, const inode_t *ino, uint64_t k) {
+    if (k < DIRECT_MAX) return data_block(im, ino->direct[k]);
+    k -= DIRECT_MAX;
+    if (k < PTRS_PER_BLOCK) {
+        uint32_t *ind = image_ptr_block(im, ino->reserved_0);
+        return ind ? data_block(im, ind[k]) : 0;
+    }
+    k -= PTRS_PER_BLOCK;
+    uint32_t *dind = image_ptr_block(im, ino->reserved_1);
+    if (!dind || k / PTRS_PER_BLOCK >= PTRS_PER_BLOCK) return 0;
+    uint32_t *leaf = image_ptr_block(im, dind[k / PTRS_PER_BLOCK]);
+    return leaf ? data_block(im, leaf[k % PTRS_PER_BLOCK]) : 0;
+}
+
+// Give ino a new zeroed logical block k, where k is its current block
+// count, allocating whatever pointer block the new slot needs first.
+// All or nothing: returns the new block, or 0 when space ran out.
+static uint32_t inode_append_block(vsfs_t *im, inode_t *ino, uint64_t k) {
+    uint64_t need = 1;
+    if (k == DIRECT_MAX) need++;                                   // single indirect
+    else if (k == DIRECT_MAX + PTRS_PER_BLOCK) need += 2;          // double indirect + first leaf
+    else if (k > DIRECT_MAX + PTRS_PER_BLOCK &&
+             (k - DIRECT_MAX - PTRS_PER_BLOCK) % PTRS_PER_BLOCK == 0) need++;  // next leaf
+    if (k >= FILE_BLOCKS_MAX) return 0;
+    uint64_t bits[3];
+    if (block_bits_alloc(im, need, bits) != 0) return 0;
+    uint32_t b[3];
+    for (uint64_t i = 0; i < need; i++) {
+        image_mark(im, &im->blocks.bits[bits[i] >> 3]);
+        b[i] = (uint32_t)(im->sb->data_region_start + bits[i]);
+        memset(im->img + (uint64_t)b[i] * BS, 0, BS);
+        image_mark(im, im->img + (uint64_t)b[i] * BS);
+    }
+    uint32_t blk = b[need - 1];
+    if (k < DIRECT_MAX) {
+        ino->direct[k] = blk;
+    } else if (k < DIRECT_MAX + PTRS_PER_BLOCK) {
+        if (k == DIRECT_MAX) ino->reserved_0 = b[0];
+        uint32_t *ind = image_ptr_block(im, ino->reserved_0);
+        ind[k - DIRECT_MAX] = blk;
+        image_mark(im, ind);
+    } else {
+        uint64_t r = k - DIRECT_MAX - PTRS_PER_BLOCK;
+        if (r == 0) ino->reserved_1 = b[0];
+        uint32_t *dind = image_ptr_block(im, ino->reserved_1);
+        if (r % PTRS_PER_BLOCK == 0) {
+            dind[r / PTRS_PER_BLOCK] = b[need - 2];
+            image_mark(im, dind);
+        }
+        uint32_t *leaf = image_ptr_block(im, dind[r / PTRS_PER_BLOCK]);
+        leaf[r % PTRS_PER_BLOCK] = blk;
+        image_mark(im, leaf);
+    }
+    return blk;
+}
+
+static void image_free_block(vsfs_t *im, uint32_t b) {
+    uint64_t start = im->sb->data_region_start;
+    if (!data_block(im, b)) return;
+    // A shared block only loses a reference.
+    if (im->refcnt && im->refcnt[b - start] > 0) {
+        im->refcnt[b - start]--;
+        image_mark(im, &im->refcnt[b - start]);
+        return;
+    }
+    if (im->dedup.live) BIT_CLEAR(im->dedup.live, b - start);
+    // The committed image still uses it: a crash before the next sync must
+    // find it as it was, so it stays allocated until then.
+    if (im->held && !BIT_TEST(im->fresh, b - start)) {
+        BIT_SET(im->held, b - start);
+        return;
+    }
+    vsfs_bitmap_free(&im->blocks, b - start);
+    image_mark(im, &im->blocks.bits[(b - start) >> 3]);
+}
+
+// Point the superblock at the fragment block to fill next.
+static void frag_set_next(vsfs_t *im, uint32_t b) {
+    vsfs_sb_ext_t *ext = (vsfs_sb_ext_t*)((uint8_t*)im->sb + VSFS_SB_EXT_OFFSET);
+    im->frag_block = b;
+    if (ext->frag_block == b) return;
+    ext->frag_block = b;
+    image_mark(im, ext);
+}
+
+// Drop a file's tail fragment. Space is only given back when it was the
+// last one handed out; the block goes with its last fragment.
+static void frag_release(vsfs_t *im, uint64_t frag) {
+    uint32_t b = VSFS_FRAG_BLOCK(frag);
+    vsfs_frag_hdr_t *h = frag_hdr(im, b);
+    if (!h || h->live == 0) return;
+    h->live--;
+    if (VSFS_FRAG_OFF(frag) + VSFS_FRAG_LEN(frag) == h->end) h->end = (uint16_t)VSFS_FRAG_OFF(frag);
+    image_mark(im, h);
+    if (h->live > 0) return;
+    h->magic = 0;
+    image_free_block(im, b);
+    if (im->frag_block == b) frag_set_next(im, 0);
+}
+
+// Hand out a len-byte fragment for a tail, starting a new fragment block
+// when the current one is full. Returns the fragment (see VSFS_FRAG), or 0
+// when no block is free.
+static uint64_t frag_append(vsfs_t *im, uint32_t len) {
+    vsfs_frag_hdr_t *h = frag_hdr(im, im->frag_block);
+    if (!h || BS - h->end < len || h->live == UINT16_MAX) {
+        uint64_t bit;
+        if (block_bits_alloc(im, 1, &bit) != 0) return 0;
+        image_mark(im, &im->blocks.bits[bit >> 3]);
+        uint32_t b = (uint32_t)(im->sb->data_region_start + bit);
+        h = (vsfs_frag_hdr_t*)(im->img + (uint64_t)b * BS);
+        memset(h, 0, BS);
+        h->magic = VSFS_FRAG_MAGIC;
+        h->end = sizeof(*h);
+        frag_set_next(im, b);
+    }
+    uint64_t f = VSFS_FRAG(im->frag_block, h->end, len);
+    h->live++;
+    h->end = (uint16_t)(h->end + len);
+    image_mark(im, h);
+    return f;
+}
+
+// Where the bytes of file node past its whole blocks go: direct[] for an
+// inline file, the fragment for a packed tail (always in the mapping),
+// else NULL. *len receives how many.
+static uint8_t *file_tail(const vsfs_t *im, const inode_t *node, uint64_t *len) {
+    *len = 0;
+    if ((node->mode & VSFS_S_IFMT) != VSFS_S_IFREG) return NULL;
+    if ((node->reserved_2 & VSFS_INO_INLINE) && node->size_bytes <= VSFS_INLINE_MAX) {
+        *len = node->size_bytes;
+        return (uint8_t*)node->direct;
+    }
+    if (!(node->reserved_2 & VSFS_INO_TAIL)) return NULL;
+    uint64_t f = node->xattr_ptr;
+    uint32_t off = VSFS_FRAG_OFF(f), n = VSFS_FRAG_LEN(f);
+    if (!frag_hdr(im, VSFS_FRAG_BLOCK(f)) || n != node->size_bytes % BS || n == 0 ||
+        off < sizeof(vsfs_frag_hdr_t) || off + n > BS)
+        return NULL;
+    *len = n;
+    return im->img + (uint64_t)VSFS_FRAG_BLOCK(f) * BS + off;
+}
+
+// Release every block ino maps, pointer blocks included.
+static void inode_free_blocks(vsfs_t *im, const inode_t *ino) {
+    uint64_t n = vsfs_inode_blocks(ino);
+    im->zip.ino = 0;   // the cached cluster may be this file's
+    if ((ino->mode & VSFS_S_IFMT) == VSFS_S_IFREG && (ino->reserved_2 & VSFS_INO_INLINE)) return;
+    if ((ino->mode & VSFS_S_IFMT) == VSFS_S_IFREG && (ino->reserved_2 & VSFS_INO_TAIL)) frag_release(im, ino->xattr_ptr);
+    for (uint64_t k = 0; k < n; k++) image_free_block(im, inode_bmap(im, ino, k));
+    uint32_t *dind = image_ptr_block(im, ino->reserved_1);
+    for (uint64_t i = 0; dind && i < PTRS_PER_BLOCK; i++) image_free_block(im, dind[i]);
+    image_free_block(im, ino->reserved_0);
+    image_free_block(im, ino->reserved_1);
+}
+
+// Where logical block k of ino is mapped: its direct[] entry or pointer
+// block slot, or NULL when the pointer block is missing.
+static uint32_t *inode_slot(const vsfs_t *im, inode_t *ino, uint64_t k) {
+    if (k < DIRECT_MAX) return &ino->direct[k];
+    k -= DIRECT_MAX;
+    if (k < PTRS_PER_BLOCK) {
+        uint32_t *ind = image_ptr_block(im, ino->reserved_0);
+        return ind ? &ind[k] : NULL;
+    }
+    k -= PTRS_PER_BLOCK;
+    uint32_t *dind = image_ptr_block(im, ino->reserved_1);
+    if (!dind || k / PTRS_PER_BLOCK >= PTRS_PER_BLOCK) return NULL;
+    uint32_t *leaf = image_ptr_block(im, dind[k / PTRS_PER_BLOCK]);
+    return leaf ? &leaf[k % PTRS_PER_BLOCK] : NULL;
+}
+
+// Shrink ino from n logical blocks to k: free blocks k.. and every
+// pointer block left mapping nothing. Slots in pointer blocks that stay
+// are cleared.
+static void inode_truncate_blocks(vsfs_t *im, inode_t *ino, uint64_t k, uint64_t n) {
+    // Leaves of the double indirect block still in use.
+    uint64_t leaves = k > DIRECT_MAX + PTRS_PER_BLOCK
+                    ? (k - DIRECT_MAX - PTRS_PER_BLOCK + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK : 0;
+    for (uint64_t j = k; j < n; j++) {
+        uint32_t *slot = inode_slot(im, ino, j);
+        if (!slot) continue;
+        image_free_block(im, data_block(im, *slot));
+        int kept = j < DIRECT_MAX ||
+                   (j < DIRECT_MAX + PTRS_PER_BLOCK ? k > DIRECT_MAX
+                                                    : (j - DIRECT_MAX - PTRS_PER_BLOCK) / PTRS_PER_BLOCK < leaves);
+        if (!kept) continue;
+        *slot = 0;
+        if (j >= DIRECT_MAX) image_mark(im, slot);
+    }
+    uint32_t *dind = image_ptr_block(im, ino->reserved_1);
+    for (uint64_t i = leaves; dind && i < PTRS_PER_BLOCK; i++) {
+        if (!dind[i]) continue;
+        image_free_block(im, dind[i]);
+        dind[i] = 0;
+        if (leaves) image_mark(im, dind);
+    }
+    if (dind && leaves == 0) {
+        image_free_block(im, ino->reserved_1);
+        ino->reserved_1 = 0;
+    }
+    if (k <= DIRECT_MAX && ino->reserved_0) {
+        image_free_block(im, ino->reserved_0);
+        ino->reserved_0 = 0;
+    }
+}
+
+// ----------------- Directory name index -----------------
+// A directory is size_bytes / BS blocks of dirent64_t slots. Its index is
+// built once per load (one pass over the slots) and then kept in step, so
+// lookup and duplicate detection are expected O(1) and insertion pops a
+// free slot instead of scanning for one.
+
+#define DIRENTS_PER_BLOCK VSFS_DIRENTS_PER_BLOCK
+
+typedef struct {
+    uint32_t hash;
+    uint32_t slot1;      // dirent slot index + 1; 0 = empty bucket
+} dir_bucket_t;
+
+struct dir_index {
+    uint64_t      ino;
+    dir_index_t  *next;      // chain in vsfs_t.dirs
+    dir_bucket_t *tab;
+    uint64_t      cap;       // power of two
+    uint64_t      used;
+    uint64_t     *free;      // stack of empty slot indices
+    uint64_t      nfree, free_cap;
+    uint64_t      nslots;    // blocks * DIRENTS_PER_BLOCK
+};
+
+// FNV-1a over the name as stored (at most 58 bytes, maybe unterminated).
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < VSFS_NAME_MAX && name[i]; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static dirent64_t *dir_slot(const vsfs_t *im, const inode_t *dir, uint64_t slot) {
+    uint32_t blk = inode_bmap(im, dir, slot / DIRENTS_PER_BLOCK);
+    if (blk == 0) return NULL;
+    return (dirent64_t*)(im->img + (uint64_t)blk * BS) + slot % DIRENTS_PER_BLOCK;
+}
+
+static int dir_free_push(dir_index_t *dx, uint64_t slot) {
+    if (dx->nfree == dx->free_cap) {
+        uint64_t ncap = dx->free_cap ? dx->free_cap * 2 : 64;
+        uint64_t *nf = (uint64_t*)realloc(dx->free, ncap * sizeof(uint64_t));
+        if (!nf) return -1;
+        dx->free = nf;
+        dx->free_cap = ncap;
+    }
+    dx->free[dx->nfree++] = slot;
+    return 0;
+}
+
+static void dir_tab_put(dir_bucket_t *tab, uint64_t cap, uint32_t hash, uint64_t slot) {
+    uint64_t i = hash & (cap - 1);
+    while (tab[i].slot1) i = (i + 1) & (cap - 1);
+    tab[i].hash = hash;
+    tab[i].slot1 = (uint32_t)(slot + 1);
+}
+
+// Keep the load factor under 1/2.
+static int dir_tab_reserve(dir_index_t *dx) {
+    if ((dx->used + 1) * 2 <= dx->cap) return 0;
+    uint64_t ncap = dx->cap ? dx->cap * 2 : 128;
+    dir_bucket_t *nt = (dir_bucket_t*)calloc(ncap, sizeof(dir_bucket_t));
+    if (!nt) return -1;
+    for (uint64_t i = 0; i < dx->cap; i++)
+        if (dx->tab[i].slot1) dir_tab_put(nt, ncap, dx->tab[i].hash, dx->tab[i].slot1 - 1);
+    free(dx->tab);
+    dx->tab = nt;
+    dx->cap = ncap;
+    return 0;
+}
+
+static void dir_index_free(dir_index_t *dx) {
+    if (!dx) return;
+    free(dx->tab);
+    free(dx->free);
+    free(dx);
+}
+
+static void dir_cache_free(vsfs_t *im) {
+    for (uint64_t i = 0; i < im->dirs_cap; i++) {
+        while (im->dirs[i]) {
+            dir_index_t *dx = im->dirs[i];
+            im->dirs[i] = dx->next;
+            dir_index_free(dx);
+        }
+    }
+    free(im->dirs);
+    im->dirs = NULL;
+    im->dirs_cap = im->ndirs = 0;
+}
+
+// Make room in the per-image cache of directory indexes for one more.
+static int dir_cache_reserve(vsfs_t *im) {
+    if (im->ndirs < im->dirs_cap) return 0;
+    uint64_t ncap = im->dirs_cap ? im->dirs_cap * 2 : 64;
+    dir_index_t **nd = (dir_index_t**)calloc(ncap, sizeof(dir_index_t*));
+    if (!nd) return -1;
+    for (uint64_t i = 0; i < im->dirs_cap; i++) {
+        while (im->dirs[i]) {
+            dir_index_t *dx = im->dirs[i];
+            im->dirs[i] = dx->next;
+            dx->next = nd[dx->ino & (ncap - 1)];
+            nd[dx->ino & (ncap - 1)] = dx;
+        }
+    }
+    free(im->dirs);
+    im->dirs = nd;
+    im->dirs_cap = ncap;
+    return 0;
+}
+
+// Index for directory inode ino, built on first use and kept until
+// vsfs_close(), so each directory is scanned at most once per load.
+static dir_index_t *dir_index_get(vsfs_t *im, uint64_t ino) {
+    if (im->dirs_cap) {
+        for (dir_index_t *dx = im->dirs[ino & (im->dirs_cap - 1)]; dx; dx = dx->next)
+            if (dx->ino == ino) return dx;
+    }
+    if (ino == 0 || ino > im->sb->inode_count || dir_cache_reserve(im) != 0) return NULL;
+    inode_t *dir = &im->itab[ino - 1];
+    dir_index_t *dx = (dir_index_t*)calloc(1, sizeof(*dx));
+    if (!dx) return NULL;
+    dx->ino = ino;
+    dx->nslots = (dir->size_bytes / BS) * DIRENTS_PER_BLOCK;
+    for (uint64_t s = 0; s < dx->nslots; s++) {
+        dirent64_t *de = dir_slot(im, dir, s);
+        if (!de) { dir_index_free(dx); return NULL; }
+        if (de->inode_no == 0) {
+            if (dir_free_push(dx, s) != 0) { dir_index_free(dx); return NULL; }
+            continue;
+        }
+        if (dir_tab_reserve(dx) != 0) { dir_index_free(dx); return NULL; }
+        dir_tab_put(dx->tab, dx->cap, name_hash(de->name), s);
+        dx->used++;
+    }
+    // Pop low slots first so entries fill in directory order.
+    for (uint64_t i = 0; i < dx->nfree / 2; i++) {
+        uint64_t t = dx->free[i];
+        dx->free[i] = dx->free[dx->nfree - 1 - i];
+        dx->free[dx->nfree - 1 - i] = t;
+    }
+    dx->next = im->dirs[ino & (im->dirs_cap - 1)];
+    im->dirs[ino & (im->dirs_cap - 1)] = dx;
+    im->ndirs++;
+    return dx;
+}
+
+// Entry named name in the indexed directory, or NULL.
+static dirent64_t *dir_lookup(vsfs_t *im, dir_index_t *dx, const char *name) {
+    if (dx->cap == 0) return NULL;
+    inode_t *dir = &im->itab[dx->ino - 1];
+    uint32_t h = name_hash(name);
+    for (uint64_t i = h & (dx->cap - 1); dx->tab[i].slot1; i = (i + 1) & (dx->cap - 1)) {
+        if (dx->tab[i].hash != h) continue;
+        dirent64_t *de = dir_slot(im, dir, dx->tab[i].slot1 - 1);
+        if (de && strncmp(de->name, name, sizeof(de->name)) == 0) return de;
+    }
+    return NULL;
+}
+
+// Write entry de into a free slot, growing the directory by a block when
+// none is left. Returns 0, or -1 when the directory cannot grow.
+static int dir_insert(vsfs_t *im, dir_index_t *dx, const dirent64_t *de) {
+    inode_t *dir = &im->itab[dx->ino - 1];
+    if (dir_tab_reserve(dx) != 0) return -1;
+    if (dx->nfree == 0) {
+        uint64_t k = dx->nslots / DIRENTS_PER_BLOCK;
+        if (inode_append_block(im, dir, k) == 0) return -1;
+        dir->size_bytes += BS;
+        for (uint64_t s = dx->nslots + DIRENTS_PER_BLOCK; s-- > dx->nslots; )
+            if (dir_free_push(dx, s) != 0) return -1;
+        dx->nslots += DIRENTS_PER_BLOCK;
+    }
+    uint64_t slot = dx->free[--dx->nfree];
+    dirent64_t *dst = dir_slot(im, dir, slot);
+    memcpy(dst, de, sizeof(*de));
+    image_mark(im, dst);
+    dir_tab_put(dx->tab, dx->cap, name_hash(de->name), slot);
+    dx->used++;
+    return 0;
+}
+
+// Clear the entry named name and give its slot back. Returns 0, or -1 if
+// there is no such entry.
+static int dir_remove(vsfs_t *im, dir_index_t *dx, const char *name) {
+    if (dx->cap == 0) return -1;
+    inode_t *dir = &im->itab[dx->ino - 1];
+    uint64_t mask = dx->cap - 1;
+    uint32_t h = name_hash(name);
+    for (uint64_t i = h & mask; dx->tab[i].slot1; i = (i + 1) & mask) {
+        if (dx->tab[i].hash != h) continue;
+        uint64_t slot = dx->tab[i].slot1 - 1;
+        dirent64_t *de = dir_slot(im, dir, slot);
+        if (!de || strncmp(de->name, name, sizeof(de->name)) != 0) continue;
+        memset(de, 0, sizeof(*de));
+        image_mark(im, de);
+        dir_free_push(dx, slot);   // on OOM the slot is only lost to reuse
+        // Backward-shift deletion: pull later members of the probe chain
+        // into the hole so lookups never stop early.
+        for (uint64_t j = i;;) {
+            dx->tab[i].slot1 = 0;
+            for (;;) {
+                j = (j + 1) & mask;
+                if (!dx->tab[j].slot1) { 
+                    dx->used--; 
+                    return 0; 
+                }
+                uint64_t home = dx->tab[j].hash & mask;
+                if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) break;
+            }
+            dx->tab[i] = dx->tab[j];
+            i = j;
+        }
+    }
+    return -1;
+}
+
+// Stamp a directory whose entries (or links) changed and refresh its CRC.
+static void dir_touch(vsfs_t *im, uint64_t ino) {
+    inode_t *dir = &im->itab[ino - 1];
+    dir->mtime = (uint64_t)time(NULL);
+    vsfs_inode_crc_finalize(dir);
+    image_mark(im, dir);
+}
+
+// ----------------- Ingest pipeline -----------------
+// Adding a host file is split in two. The caller's thread does all the
+// bookkeeping in call order: inode and block allocation, pointer blocks,
+// the inode and the directory entry. It then queues the file, and a pool
+// of workers copies the payloads straight into the allocated blocks in
+// parallel. Workers never allocate or touch metadata, so the image is
+// byte-identical whatever the thread count. A file whose copy fails is
+// rolled back by vsfs_flush() once the workers are done.
+//
+// A file to be compressed cannot be allocated before its compressed size
+// is known, so it goes the other way round: a worker reads and compresses
+// it into memory, and vsfs_flush() commits it, in queue order.
+
+struct ingest_job {
+    char     *path;                  // host file
+    uint64_t  size;                  // bytes, as seen when committed
+    uint64_t  ino;
+    uint64_t  dir_ino;               // directory holding the entry
+    char      name[VSFS_NAME_MAX + 1];  // entry name as stored, NUL-terminated
+    void     *tag;
+    int       err;                   // set by the worker: errno, or -1 for a size change
+    uint8_t   inl[VSFS_INLINE_MAX];  // inline data, stored in the inode by vsfs_flush()
+    int       zip;                   // compress, and commit in vsfs_flush() (ino is 0 until then)
+    uint8_t  *data;                  // zip: the compressed stream, or the file if it did not shrink
+    uint64_t  zlen;                  // zip: stream length, 0 when data is the file itself
+    vsfs_stats_t io;                 // the worker's I/O for this file, added up by vsfs_flush()
+};
+
+static const uint8_t zero_block[BS];
+
+// Copy len bytes from in_fd at in_off to out_fd at out_off without going
+// through user space when the kernel allows it: copy_file_range (which may
+// reflink), else splice through a pipe, else a pread/pwrite bounce buffer.
+// Returns 0, an errno, or -1 when the input ends early.
+static int copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off, uint64_t len, vsfs_stats_t *io) {
+    while (len > 0) {
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, (size_t)len, 0);
+        count_read(io, n);
+        if (n > 0) io->bytes_written += (uint64_t)n;
+        if (n > 0) { 
+            len -= (uint64_t)n; 
+            continue; 
+        }
+        if (n == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EPERM)
+            return errno;
+        break;
+    }
+    if (len == 0) return 0;
+
+    int pfd[2];
+    if (pipe(pfd) == 0) {
+        off_t in0 = in_off, out0 = out_off;
+        uint64_t len0 = len;
+        int rc = 0;
+        while (len > 0) {
+            ssize_t n = splice(in_fd, &in_off, pfd[1], NULL, (size_t)(len < (1u << 16) ? len : (1u << 16)), SPLICE_F_MOVE);
+            count_read(io, n);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) { 
+                rc = errno; 
+                break; 
+            }
+            if (n == 0) { 
+                rc = -1; 
+                break; 
+            }
+            for (ssize_t left = n; left > 0; ) {
+                ssize_t m = splice(pfd[0], NULL, out_fd, &out_off, (size_t)left, SPLICE_F_MOVE);
+                count_write(io, m);
+                if (m < 0 && errno == EINTR) continue;
+                if (m <= 0) { 
+                    rc = m < 0 ? errno : EIO; 
+                    break; 
+                }
+                left -= m;
+            }
+            if (rc) break;
+            len -= (uint64_t)n;
+        }
+        close(pfd[0]);
+        close(pfd[1]);
+        if (rc != EINVAL) return rc;
+        // splice does not support these files: redo the range with copies.
+        in_off = in0;
+        out_off = out0;
+        len = len0;
+    }
+
+    uint8_t buf[1u << 16];
+    while (len > 0) {
+        ssize_t n = pread(in_fd, buf, (size_t)(len < sizeof(buf) ? len : sizeof(buf)), in_off);
+        count_read(io, n);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        if (n == 0) return -1;
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t m = pwrite(out_fd, buf + done, (size_t)(n - done), out_off + done);
+            count_write(io, m);
+            if (m < 0 && errno == EINTR) continue;
+            if (m < 0) return errno;
+            done += m;
+        }
+        in_off += n;
+        out_off += n;
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+// Copy the host file into the blocks the committer mapped for job->ino.
+// In place the bytes go file-to-file through copy_range() and the mapped
+// copy of those blocks is never written back; otherwise adjacent blocks
+// are read into the mapping with one pread. Either way the tail of the
+// last block is zeroed. A packed tail is read into its fragment in the
+// mapping; inline data into the job, since the inode is not the worker's
+// to change.
+static int ingest_copy(const vsfs_t *im, ingest_job_t *job) {
+    vsfs_stats_t *io = &job->io;
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0) return errno;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { 
+        int e = errno; 
+        close(fd); 
+        return e; 
+    }
+    if ((uint64_t)st.st_size != job->size) { 
+        close(fd); 
+        return -1; 
+    }
+    inode_t *node = &im->itab[job->ino - 1];
+    uint64_t nblocks = vsfs_inode_blocks(node);
+    uint64_t left = nblocks * BS < job->size ? nblocks * BS : job->size;
+    for (uint64_t k = 0; k < nblocks; ) {
+        uint32_t first = inode_bmap(im, node, k);
+        uint64_t run = 1;
+        while (k + run < nblocks && inode_bmap(im, node, k + run) == first + run) run++;
+        uint8_t *dst = im->img + (uint64_t)first * BS;
+        uint64_t want = run * BS < left ? run * BS : left;
+        if (im->in_place) {
+            int e = copy_range(fd, (off_t)(k * BS), im->fd, (off_t)first * BS, want, io);
+            for (uint64_t z = want; e == 0 && z < run * BS; ) {
+                size_t part = (size_t)(BS - z % BS);
+                ssize_t m = pwrite(im->fd, zero_block, part, (off_t)((uint64_t)first * BS + z));
+                count_write(io, m);
+                if (m < 0 && errno == EINTR) continue;
+                if (m < 0) e = errno;
+                else z += (uint64_t)m;
+            }
+            if (e) { 
+                close(fd); 
+                return e; 
+            }
+            left -= want;
+            k += run;
+            continue;
+        }
+        uint64_t got = 0;
+        while (got < want) {
+            ssize_t nr = pread(fd, dst + got, (size_t)(want - got), (off_t)(k * BS + got));
+            count_read(io, nr);
+            if (nr < 0) {
+                if (errno == EINTR) continue;
+                int e = errno;
+                close(fd);
+                return e;
+            }
+            if (nr == 0) { 
+                close(fd); 
+                return -1; 
+            }
+            got += (uint64_t)nr;
+        }
+        if (want < run * BS) memset(dst + want, 0, (size_t)(run * BS - want));
+        left -= want;
+        k += run;
+    }
+    uint64_t tlen;
+    uint8_t *dst = file_tail(im, node, &tlen);
+    if (node->reserved_2 & VSFS_INO_INLINE) dst = job->inl;
+    for (uint64_t got = 0; dst && got < tlen; ) {
+        ssize_t nr = pread(fd, dst + got, (size_t)(tlen - got), (off_t)(nblocks * BS + got));
+        count_read(io, nr);
+        if (nr < 0 && errno == EINTR) continue;
+        if (nr <= 0) {
+            int e = nr < 0 ? errno : -1;
+            close(fd);
+            return e;
+        }
+        got += (uint64_t)nr;
+    }
+    close(fd);
+    return 0;
+}
+
+// Compress size bytes of data into a VSFS_INO_COMPRESSED stream. Returns
+// 0 with the stream (malloc'd) in *out and its length in *zlen; 0 with
+// *out NULL when the stream would not take fewer blocks than the data; or
+// ENOMEM.
+static int zip_encode(const uint8_t *data, uint64_t size, uint8_t **out, uint64_t *zlen) {
+    *out = NULL;
+    uint64_t n = (size + VSFS_ZCLUSTER - 1) / VSFS_ZCLUSTER;
+    uint64_t cap = (size + BS - 1) / BS * BS - BS;   // one block less than the data
+    if (cap > UINT32_MAX) cap = UINT32_MAX;          // table entries are 32-bit
+    if (size <= BS || n * 4 >= cap) return 0;
+    // Only the pages written are ever touched, so a cap-sized buffer costs
+    // about the stream.
+    uint8_t *z = (uint8_t*)malloc((size_t)cap);
+    if (!z) return ENOMEM;
+    uint64_t pos = n * 4;
+    for (uint64_t c = 0; c < n; c++) {
+        const uint8_t *src = data + c * VSFS_ZCLUSTER;
+        size_t raw = (size_t)(c + 1 < n ? VSFS_ZCLUSTER : size - c * VSFS_ZCLUSTER);
+        size_t room = (size_t)(cap - pos);
+        size_t len = vsfs_lz_compress(src, raw, z + pos, room < raw ? room : raw - 1);
+        if (len == 0) {
+            if (room < raw) {
+                free(z);
+                return 0;
+            }
+            memcpy(z + pos, src, raw);
+            len = raw;
+        }
+        pos += len;
+        uint32_t end = (uint32_t)pos;
+        memcpy(z + c * 4, &end, 4);
+    }
+    uint8_t *shrunk = (uint8_t*)realloc(z, (size_t)pos);
+    *out = shrunk ? shrunk : z;
+    *zlen = pos;
+    return 0;
+}
+
+// Read the host file of a zip job whole and compress it (zip_encode());
+// job->data ends up holding the stream, or the file itself when it did
+// not shrink.
+static int ingest_compress(ingest_job_t *job) {
+    uint64_t t0 = clock_ns();
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0) return errno;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int e = errno;
+        close(fd);
+        return e;
+    }
+    if ((uint64_t)st.st_size != job->size) {
+        close(fd);
+        return -1;
+    }
+    uint8_t *data = (uint8_t*)malloc((size_t)job->size);
+    if (!data) {
+        close(fd);
+        return ENOMEM;
+    }
+    for (uint64_t got = 0; got < job->size; ) {
+        ssize_t nr = pread(fd, data + got, (size_t)(job->size - got), (off_t)got);
+        count_read(&job->io, nr);
+        if (nr < 0 && errno == EINTR) continue;
+        if (nr <= 0) {
+            int e = nr < 0 ? errno : -1;
+            free(data);
+            close(fd);
+            return e;
+        }
+        got += (uint64_t)nr;
+    }
+    close(fd);
+    job->io.host_read_ns = clock_ns() - t0;
+    uint8_t *z;
+    if (zip_encode(data, job->size, &z, &job->zlen) != 0) {
+        free(data);
+        return ENOMEM;
+    }
+    if (z) {
+        free(data);
+        job->data = z;
+    } else {
+        job->data = data;
+        job->zlen = 0;
+    }
+    return 0;
+}
+
+static void *ingest_worker(void *arg) {
+    ingest_pool_t *p = (ingest_pool_t*)arg;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->next == p->njobs && !p->closed) pthread_cond_wait(&p->more, &p->lock);
+        if (p->next == p->njobs) { 
+            pthread_mutex_unlock(&p->lock); 
+            return NULL; 
+        }
+        ingest_job_t *job = p->jobs[p->next++];
+        pthread_mutex_unlock(&p->lock);
+        // A compressing job times its read itself, leaving out the encoding.
+        uint64_t t0 = clock_ns();
+        job->err = job->zip ? ingest_compress(job) : ingest_copy(p->im, job);
+        if (!job->zip) job->io.host_read_ns = clock_ns() - t0;
+    }
+}
+
+// Start nthreads workers. Returns 0, or -1 (nothing started) on error.
+static int ingest_pool_start(ingest_pool_t *p, vsfs_t *im, int nthreads) {
+    memset(p, 0, sizeof(*p));
+    p->im = im;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->more, NULL);
+    p->threads = (pthread_t*)calloc((size_t)nthreads, sizeof(pthread_t));
+    if (!p->threads) {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->more);
+        return fail("out of memory");
+    }
+    for (int t = 0; t < nthreads; t++) {
+        int e = pthread_create(&p->threads[t], NULL, ingest_worker, p);
+        if (e != 0) {
+            fail("pthread_create: %s", strerror(e));
+            pthread_mutex_lock(&p->lock);
+            p->closed = 1;
+            pthread_cond_broadcast(&p->more);
+            pthread_mutex_unlock(&p->lock);
+            for (int u = 0; u < t; u++) pthread_join(p->threads[u], NULL);
+            free(p->threads);
+            pthread_mutex_destroy(&p->lock);
+            pthread_cond_destroy(&p->more);
+            return -1;
+        }
+        p->nthreads++;
+    }
+    return 0;
+}
+
+// Make room to queue one more job, so that ingest_pool_push() cannot fail
+// once a file is committed.
+static int ingest_pool_reserve(ingest_pool_t *p) {
+    int rc = 0;
+    pthread_mutex_lock(&p->lock);
+    if (p->njobs == p->cap) {
+        size_t ncap = p->cap ? p->cap * 2 : 64;
+        ingest_job_t **nj = (ingest_job_t**)realloc(p->jobs, ncap * sizeof(ingest_job_t*));
+        if (nj) {
+            p->jobs = nj;
+            p->cap = ncap;
+        } else {
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return rc;
+}
+
+// Hand a committed file to the workers. Takes ownership of job.
+static void ingest_pool_push(ingest_pool_t *p, ingest_job_t *job) {
+    pthread_mutex_lock(&p->lock);
+    p->jobs[p->njobs++] = job;
+    pthread_cond_signal(&p->more);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Wait for every queued copy to finish.
+static void ingest_pool_drain(ingest_pool_t *p) {
+    pthread_mutex_lock(&p->lock);
+    p->closed = 1;
+    pthread_cond_broadcast(&p->more);
+    pthread_mutex_unlock(&p->lock);
+    for (int t = 0; t < p->nthreads; t++) pthread_join(p->threads[t], NULL);
+    p->nthreads = 0;
+}
+
+static void ingest_pool_free(ingest_pool_t *p) {
+    for (size_t k = 0; k < p->njobs; k++) {
+        free(p->jobs[k]->path);
+        free(p->jobs[k]->data);
+        free(p->jobs[k]);
+    }
+    free(p->jobs);
+    free(p->threads);
+    p->jobs = NULL;
+    p->threads = NULL;
+    p->njobs = p->cap = p->next = 0;
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->more);
+}
+
+// Inode ino after checking its number and CRC, or NULL.
+static inode_t *inode_get(vsfs_t *im, uint64_t ino) {
+    if (ino == 0 || ino > im->sb->inode_count) {
+        fail("inode %" PRIu64 " out of range", ino);
+        return NULL;
+    }
+    inode_t *node = &im->itab[ino - 1];
+    if (!vsfs_inode_crc_ok(node)) {
+        fail("inode %" PRIu64 " checksum mismatch", ino);
+        return NULL;
+    }
+    return node;
+}
+
+// Index of directory inode ino, after checking that it is one.
+static dir_index_t *dir_get(vsfs_t *im, uint64_t ino) {
+    inode_t *node = inode_get(im, ino);
+    if (!node) return NULL;
+    if ((node->mode & VSFS_S_IFMT) != VSFS_S_IFDIR) {
+        fail("inode %" PRIu64 " is not a directory", ino);
+        return NULL;
+    }
+    dir_index_t *dx = dir_index_get(im, ino);
+    if (!dx) fail("cannot index directory inode %" PRIu64 " (corrupt FS or OOM)", ino);
+    return dx;
+}
+
+static void report(vsfs_t *im, vsfs_event_kind_t kind, const char *host_path, const char *name,
+                   uint64_t ino, uint64_t size, void *tag, const char *msg) {
+    if (!im->report) return;
+    vsfs_event_t ev = { kind, host_path, name, ino, size, tag, msg };
+    im->report(im->report_ctx, &ev);
+}
+
+// Entry name as stored in a dirent (truncated to VSFS_NAME_MAX bytes), or
+// -1 when it cannot be a name at all.
+static int dirent_name(dirent64_t *de, const char *name) {
+    if (name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return fail("'%s' is not a valid entry name", name);
+    memset(de, 0, sizeof(*de));
+    memcpy(de->name, name, strnlen(name, sizeof(de->name)));
+    return 0;
+}
+
+// 0 when no entry of directory dx has the name in de, else -1.
+static int name_free(vsfs_t *im, dir_index_t *dx, const dirent64_t *de) {
+    if (!dir_lookup(im, dx, de->name)) return 0;
+    if (dx->ino == ROOT_INO)
+        return fail("'%.*s' already exists in root", (int)sizeof(de->name), de->name);
+    return fail("'%.*s' already exists in directory inode %" PRIu64,
+                (int)sizeof(de->name), de->name, dx->ino);
+}
+
+// Commit a size-byte file into directory dx under name: inode, blocks,
+// pointer blocks and directory entry. Its data blocks are left for the
+// caller to fill; with direct set they will be written straight to the
+// image file, so they are not marked dirty. The directory inode itself is
+// left for the caller to stamp, so a batch into one directory rewrites it
+// once. On failure nothing in the image is modified (bits set along the
+// way are rolled back).
+//
+// shared (NULL, or one entry per data block) lets a deduplicating caller
+// map existing blocks: a non-zero entry is the block to use instead of a
+// new one, or DEDUP_SAME | j for whatever logical block j < k gets. On
+// success every entry holds the block mapped; reference counts are left
+// to the caller.
+//
+// In a packed image (and without shared) a small file is made inline and
+// a short tail gets a fragment; the caller fills those through
+// file_tail().
+//
+// A non-zero zlen stores the file compressed: its blocks are sized for,
+// and left to be filled with, a zlen-byte stream (see VSFS_ZCLUSTER).
+#define DEDUP_SAME (1ull << 63)
+static int file_commit(vsfs_t *im, dir_index_t *dx, const char *name, uint64_t fsize, uint64_t zlen,
+                       int direct, uint64_t *shared, uint64_t *out_ino) {
+    superblock_t *sb = im->sb;
+    inode_t *itab = im->itab;
+
+    int packed = (sb->flags & VSFS_FLAG_PACKED) && !shared && !zlen;
+    int inl = packed && fsize <= VSFS_INLINE_MAX;
+    uint32_t tail = packed && !inl && fsize % BS <= VSFS_TAIL_MAX ? (uint32_t)(fsize % BS) : 0;
+    uint64_t need_blocks = tail ? fsize / BS : (fsize + BS - 1) / BS;
+    if (zlen) need_blocks = (zlen + BS - 1) / BS;
+    if (need_blocks == 0 && !inl && !tail) need_blocks = 1;
+    if (inl) need_blocks = 0;
+    // A tail starts a new fragment block when the current one is full.
+    const vsfs_frag_hdr_t *fh = tail ? frag_hdr(im, im->frag_block) : NULL;
+    const int new_frag = tail && (!fh || BS - fh->end < tail || fh->live == UINT16_MAX);
+    if (need_blocks > FILE_BLOCKS_MAX)
+        return fail("file too big for MiniVSFS (needs %" PRIu64 " blocks, max %" PRIu64 ")",
+                    need_blocks, (uint64_t)FILE_BLOCKS_MAX);
+    uint64_t fresh = need_blocks;
+    for (uint64_t k = 0; shared && k < need_blocks; k++)
+        if (shared[k]) fresh--;
+    const uint64_t total_blocks = fresh + indirect_blocks_for(need_blocks) + (uint64_t)new_frag;
+
+    // Reject duplicates before allocating anything
+    dirent64_t de;
+    if (dirent_name(&de, name) != 0 || name_free(im, dx, &de) != 0) return -1;
+
+    // Check capacity up front from the allocator hints; no bitmap scan.
+    if (im->inodes.free_count == 0) return fail("no free inode");
+    if (im->blocks.free_count < total_blocks) return fail("not enough free data blocks");
+
+    // Allocate the inode, then the data blocks (one contiguous run if possible)
+    uint64_t ibit = inode_bit_alloc(im);
+    if (ibit == VSFS_BITMAP_NONE) return fail("no free inode");
+    uint64_t inum = ibit + 1;
+    image_mark(im, &im->inodes.bits[ibit >> 3]);
+
+    uint64_t *dbits = (uint64_t*)malloc((total_blocks ? total_blocks : 1) * sizeof(uint64_t));
+    uint64_t found = 0;
+    if (!dbits) {
+        fail("out of memory");
+        goto rollback;
+    }
+    if (total_blocks && block_bits_alloc(im, total_blocks, dbits) != 0) {
+        fail("not enough free data blocks");
+        goto rollback;
+    }
+    found = total_blocks;
+    for (uint64_t k = 0; k < total_blocks; k++) image_mark(im, &im->blocks.bits[dbits[k] >> 3]);
+
+    // Hand out the allocated blocks in file layout order, each pointer
+    // block just ahead of the data it maps. Data blocks are left to the
+    // caller, which fills every byte of them: in the mapping (marked dirty
+    // here) or, direct, in the image file (so any earlier dirty mark must
+    // go, or the stale mapping would be written over them).
+    inode_t node; memset(&node, 0, sizeof(node));
+    uint64_t next = 0;
+    uint32_t *ind = NULL, *leaf = NULL;
+    for (uint64_t k = 0; k < need_blocks; k++) {
+        uint32_t *slot;
+        if (k < DIRECT_MAX) {
+            slot = &node.direct[k];
+        } else if (k < DIRECT_MAX + PTRS_PER_BLOCK) {
+            if (k == DIRECT_MAX) {
+                node.reserved_0 = (uint32_t)(sb->data_region_start + dbits[next++]);
+                ind = (uint32_t*)(im->img + (uint64_t)node.reserved_0 * BS);
+                memset(ind, 0, BS);
+                image_mark(im, ind);
+            }
+            slot = &ind[k - DIRECT_MAX];
+        } else {
+            uint64_t r = k - DIRECT_MAX - PTRS_PER_BLOCK;
+            if (r == 0) {
+                node.reserved_1 = (uint32_t)(sb->data_region_start + dbits[next++]);
+                ind = (uint32_t*)(im->img + (uint64_t)node.reserved_1 * BS);
+                memset(ind, 0, BS);
+                image_mark(im, ind);
+            }
+            if (r % PTRS_PER_BLOCK == 0) {
+                ind[r / PTRS_PER_BLOCK] = (uint32_t)(sb->data_region_start + dbits[next++]);
+                leaf = (uint32_t*)(im->img + (uint64_t)ind[r / PTRS_PER_BLOCK] * BS);
+                memset(leaf, 0, BS);
+                image_mark(im, leaf);
+            }
+            slot = &leaf[r % PTRS_PER_BLOCK];
+        }
+        if (shared && shared[k]) {
+            if (shared[k] & DEDUP_SAME) shared[k] = shared[shared[k] & ~DEDUP_SAME];
+            *slot = (uint32_t)shared[k];
+            continue;
+        }
+        *slot = (uint32_t)(sb->data_region_start + dbits[next++]);
+        if (shared) shared[k] = *slot;
+        if (direct) {
+            BIT_CLEAR(im->dirty, *slot);
+            BIT_SET(im->copied, *slot);
+        } else {
+            image_mark(im, im->img + (uint64_t)*slot * BS);
+        }
+    }
+
+    // Add a directory entry (grows the directory by a block when full)
+    de.inode_no = (uint32_t)inum;
+    de.type = VSFS_DT_FILE;
+    vsfs_dirent_checksum_finalize(&de);
+    if (dir_insert(im, dx, &de) != 0) {
+        fail("directory cannot grow");
+        goto rollback;
+    }
+    if (tail) {
+        if (new_frag) {
+            uint32_t b = (uint32_t)(sb->data_region_start + dbits[next++]);
+            vsfs_frag_hdr_t *h = (vsfs_frag_hdr_t*)(im->img + (uint64_t)b * BS);
+            memset(h, 0, BS);
+            h->magic = VSFS_FRAG_MAGIC;
+            h->end = sizeof(*h);
+            frag_set_next(im, b);
+        }
+        vsfs_frag_hdr_t *h = (vsfs_frag_hdr_t*)(im->img + (uint64_t)im->frag_block * BS);
+        node.reserved_2 = VSFS_INO_TAIL;
+        node.xattr_ptr = VSFS_FRAG(im->frag_block, h->end, tail);
+        h->live++;
+        h->end = (uint16_t)(h->end + tail);
+        image_mark(im, h);
+    }
+    if (inl) node.reserved_2 = VSFS_INO_INLINE;
+    if (zlen) {
+        node.reserved_2 = VSFS_INO_COMPRESSED;
+        node.xattr_ptr = zlen;
+        if (!(sb->flags & VSFS_FLAG_COMPRESSED)) {
+            sb->flags |= VSFS_FLAG_COMPRESSED;
+            image_mark(im, sb);
+        }
+    }
+    free(dbits);
+
+    // Create the new inode
+    node.mode  = VSFS_S_IFREG;
+    node.links = 1;
+    node.uid = node.gid = 0;
+    node.size_bytes = fsize;
+    node.atime = node.mtime = node.ctime = (uint64_t)time(NULL);
+    node.proj_id = 6;
+    vsfs_inode_crc_finalize(&node);
+    itab[inum - 1] = node;
+    image_mark(im, &itab[inum - 1]);
+
+    // Root keeps its historical one-link-per-file count.
+    inode_t *dir = &itab[dx->ino - 1];
+    if (dx->ino == ROOT_INO && dir->links < 0xFFFF) dir->links++;
+    *out_ino = inum;
+    return 0;
+
+rollback:
+    // Only the bitmap bits need undoing; the blocks stay marked dirty,
+    // which only costs a redundant write-back.
+    for (uint64_t k = 0; k < found; k++) vsfs_bitmap_free(&im->blocks, dbits[k]);
+    vsfs_bitmap_free(&im->inodes, ibit);
+    free(dbits);
+    return -1;
+}
+
+// Undo a committed file: free its blocks and inode and drop its directory
+// entry (name as stored).
+static void file_undo(vsfs_t *im, uint64_t ino, uint64_t dir_ino, const char *name) {
+    inode_t *node = &im->itab[ino - 1];
+    inode_free_blocks(im, node);
+    memset(node, 0, sizeof(*node));
+    image_mark(im, node);
+    vsfs_bitmap_free(&im->inodes, ino - 1);
+    image_mark(im, &im->inodes.bits[(ino - 1) >> 3]);
+    dir_index_t *dx = dir_index_get(im, dir_ino);
+    if (dx) dir_remove(im, dx, name);
+    inode_t *dir = &im->itab[dir_ino - 1];
+    if (dir_ino == ROOT_INO && dir->links > 2) dir->links--;
+    dir_touch(im, dir_ino);
+}
+
+// Undo a committed file whose copy failed.
+static void ingest_undo(vsfs_t *im, const ingest_job_t *job) {
+    file_undo(im, job->ino, job->dir_ino, job->name);
+}
+
+// Commit a file of size bytes into directory dx under name and fill it
+// from data: the file itself, or with zlen set its compressed stream.
+static int file_store(vsfs_t *im, dir_index_t *dx, const char *name, uint64_t size, const uint8_t *data,
+                      uint64_t zlen, uint64_t *out_ino) {
+    uint64_t inum;
+    if (file_commit(im, dx, name, size, zlen, 0, NULL, &inum) != 0) return -1;
+    inode_t *node = &im->itab[inum - 1];
+    uint64_t len = zlen ? zlen : size, nblocks = vsfs_inode_blocks(node);
+    for (uint64_t k = 0; k < nblocks; k++) {
+        uint8_t *dst = im->img + (uint64_t)inode_bmap(im, node, k) * BS;
+        uint64_t n = len > k * BS ? len - k * BS : 0;
+        if (n > BS) n = BS;
+        memcpy(dst, data + k * BS, (size_t)n);
+        memset(dst + n, 0, (size_t)(BS - n));
+    }
+    uint64_t tlen;
+    uint8_t *tail = file_tail(im, node, &tlen);
+    if (tail) {
+        if (tlen) memcpy(tail, data + nblocks * BS, (size_t)tlen);
+        vsfs_inode_crc_finalize(node);   // inline data is part of the inode
+    }
+    *out_ino = inum;
+    return 0;
+}
+
+// Count a file of size bytes offered to compression, stored in a zlen-byte
+// stream (0: as is).
+static void zip_account(vsfs_t *im, uint64_t size, uint64_t zlen) {
+    uint64_t blocks = (size + BS - 1) / BS;
+    im->zip.blocks += blocks;
+    im->zip.stored += zlen ? (zlen + BS - 1) / BS : blocks;
+}
+
+// Commit the file of a compressed copy, now that its size is known.
+static int zip_commit(vsfs_t *im, ingest_job_t *job) {
+    dir_index_t *dx = dir_index_get(im, job->dir_ino);
+    if (!dx) return fail("cannot index directory inode %" PRIu64 " (corrupt FS or OOM)", job->dir_ino);
+    if (file_store(im, dx, job->name, job->size, job->data, job->zlen, &job->ino) != 0) return -1;
+    zip_account(im, job->size, job->zlen);
+    dir_touch(im, job->dir_ino);
+    return 0;
+}
+
+uint64_t vsfs_flush(vsfs_t *im) {
+    if (!im->pool_live) return 0;
+    ingest_pool_t *p = &im->pool;
+    ingest_pool_drain(p);
+    im->pool_live = 0;
+    im->zip.pending = 0;
+    uint64_t failed = 0;
+    for (size_t k = 0; k < p->njobs; k++) {
+        ingest_job_t *job = p->jobs[k];
+        im->stats.host_read_ns  += job->io.host_read_ns;
+        im->stats.bytes_read    += job->io.bytes_read;
+        im->stats.bytes_written += job->io.bytes_written;
+        im->stats.io_calls      += job->io.io_calls;
+        if (job->zip && job->err == 0 && zip_commit(im, job) != 0) {
+            report(im, VSFS_EV_FAILED, job->path, job->name, 0, job->size, job->tag, vsfs_errmsg());
+            failed++;
+            continue;
+        }
+        if (job->err == 0) {
+            inode_t *node = &im->itab[job->ino - 1];
+            if (node->reserved_2 & VSFS_INO_INLINE) {
+                memcpy(node->direct, job->inl, (size_t)job->size);
+                vsfs_inode_crc_finalize(node);
+                image_mark(im, node);
+            }
+            report(im, VSFS_EV_ADDED, job->path, job->name, job->ino, job->size, job->tag, NULL);
+            continue;
+        }
+        if (!job->zip) ingest_undo(im, job);
+        report(im, VSFS_EV_FAILED, job->path, job->name, 0, job->size, job->tag,
+               job->err < 0 ? "file changed while being added" : strerror(job->err));
+        failed++;
+    }
+    ingest_pool_free(p);
+    return failed;
+}
+
+// ----------------- Deduplication -----------------
+
+// Where a deduplicating add reads its payload: a host file or memory.
+typedef struct {
+    int            fd;          // host file, or -1
+    const uint8_t *mem;
+    uint64_t       size;
+} dedup_src_t;
+
+// Logical block k of src, zero-padded to BS, counting the reads in st.
+// Returns 0, an errno, or -1 when the file came up short.
+static int dedup_read(const dedup_src_t *src, uint64_t k, uint8_t *buf, vsfs_stats_t *st) {
+    uint64_t off = k * BS, want = src->size > off ? src->size - off : 0;
+    if (want > BS) want = BS;
+    if (src->fd < 0) {
+        if (want) memcpy(buf, src->mem + off, (size_t)want);
+    } else {
+        uint64_t t0 = clock_ns();
+        for (uint64_t got = 0; got < want; ) {
+            ssize_t nr = pread(src->fd, buf + got, (size_t)(want - got), (off_t)(off + got));
+            count_read(st, nr);
+            if (nr < 0 && errno == EINTR) continue;
+            if (nr < 0) return errno;
+            if (nr == 0) return -1;
+            got += (uint64_t)nr;
+        }
+        st->host_read_ns += clock_ns() - t0;
+    }
+    memset(buf + want, 0, (size_t)(BS - want));
+    return 0;
+}
+
+// Current contents of block b: the mapping, or for a clean block of an
+// in-place image the file, since copies may have gone straight there.
+// NULL (with the error recorded) if it cannot be read.
+static const uint8_t *block_bytes(vsfs_t *im, uint32_t b, uint8_t *buf) {
+    if (!im->in_place || BIT_TEST(im->dirty, b)) return im->img + (uint64_t)b * BS;
+    for (size_t got = 0; got < BS; ) {
+        ssize_t nr = pread(im->fd, buf + got, BS - got, (off_t)((uint64_t)b * BS + got));
+        count_read(&im->stats, nr);
+        if (nr < 0 && errno == EINTR) continue;
+        if (nr <= 0) {
+            fail("pread: %s", nr < 0 ? strerror(errno) : "image file shrank");
+            return NULL;
+        }
+        got += (size_t)nr;
+    }
+    return buf;
+}
+
+// CRC32C of a data block, the key of the index.
+static uint32_t dedup_hash(vsfs_t *im, const uint8_t *buf) {
+    uint64_t t0 = clock_ns();
+    uint32_t h = vsfs_crc32c(buf, BS);
+    im->stats.crc_ns += clock_ns() - t0;
+    im->stats.crc_bytes += BS;
+    return h;
+}
+
+static void dedup_put(dedup_slot_t *tab, uint64_t cap, uint32_t hash, uint32_t block) {
+    uint64_t i = hash & (cap - 1);
+    for (; tab[i].block; i = (i + 1) & (cap - 1))
+        if (tab[i].block == block && tab[i].hash == hash) return;
+    tab[i].hash = hash;
+    tab[i].block = block;
+}
+
+static int dedup_insert(vsfs_t *im, uint32_t hash, uint32_t block) {
+    dedup_t *dd = &im->dedup;
+    if ((dd->n + 1) * 2 > dd->cap) {
+        uint64_t ncap = dd->cap * 2;
+        dedup_slot_t *nt = (dedup_slot_t*)calloc((size_t)ncap, sizeof(dedup_slot_t));
+        if (!nt) return fail("out of memory");
+        for (uint64_t i = 0; i < dd->cap; i++)
+            if (dd->tab[i].block) dedup_put(nt, ncap, dd->tab[i].hash, dd->tab[i].block);
+        free(dd->tab);
+        dd->tab = nt;
+        dd->cap = ncap;
+    }
+    dedup_put(dd->tab, dd->cap, hash, block);
+    dd->n++;
+    BIT_SET(dd->live, block - im->sb->data_region_start);
+    return 0;
+}
+
+// A live indexed block holding exactly buf (whose hash is h), or 0.
+static uint32_t dedup_find(vsfs_t *im, uint32_t h, const uint8_t *buf, uint8_t *tmp) {
+    dedup_t *dd = &im->dedup;
+    uint64_t start = im->sb->data_region_start;
+    for (uint64_t i = h & (dd->cap - 1); dd->tab[i].block; i = (i + 1) & (dd->cap - 1)) {
+        const dedup_slot_t *e = &dd->tab[i];
+        if (e->hash != h || !BIT_TEST(dd->live, e->block - start) || im->refcnt[e->block - start] == UINT32_MAX)
+            continue;
+        const uint8_t *cur = block_bytes(im, e->block, tmp);
+        if (cur && memcmp(cur, buf, BS) == 0) return e->block;
+    }
+    return 0;
+}
+
+// Index the data blocks of every file already in the image. Reads all of
+// them once; runs on the first deduplicating add.
+static int dedup_build(vsfs_t *im) {
+    vsfs_flush(im);   // queued copies must have landed before blocks are hashed
+    dedup_t *dd = &im->dedup;
+    dd->cap = 1024;
+    dd->tab = (dedup_slot_t*)calloc((size_t)dd->cap, sizeof(dedup_slot_t));
+    dd->live = (uint8_t*)calloc(1, (size_t)((im->sb->data_region_blocks + 7) / 8));
+    if (!dd->tab || !dd->live) {
+        free(dd->tab);
+        free(dd->live);
+        memset(dd, 0, sizeof(*dd));
+        return fail("out of memory");
+    }
+    uint8_t buf[BS];
+    uint64_t start = im->sb->data_region_start;
+    for (uint64_t ino = 1; ino <= im->sb->inode_count; ino++) {
+        const inode_t *node = &im->itab[ino - 1];
+        if (!BIT_TEST(im->inodes.bits, ino - 1) || (node->mode & VSFS_S_IFMT) != VSFS_S_IFREG ||
+            !vsfs_inode_crc_ok(node))
+            continue;
+        uint64_t n = vsfs_inode_blocks(node);
+        for (uint64_t k = 0; k < n && k < FILE_BLOCKS_MAX; k++) {
+            uint32_t b = inode_bmap(im, node, k);
+            if (!b || BIT_TEST(dd->live, b - start)) continue;
+            const uint8_t *cur = block_bytes(im, b, buf);
+            if (!cur || dedup_insert(im, dedup_hash(im, cur), b) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Add src as file name in directory dx, sharing every block that is
+// already in the image (or earlier in the file). Blocks are hashed on a
+// first read; only the new ones are read again, into the mapping.
+static int dedup_commit(vsfs_t *im, dir_index_t *dx, const char *name, const dedup_src_t *src, uint64_t *out_ino) {
+    if (!im->dedup.tab && dedup_build(im) != 0) return -1;
+    uint64_t n = src->size ? (src->size + BS - 1) / BS : 1;
+    if (n > FILE_BLOCKS_MAX)
+        return fail("file too big for MiniVSFS (needs %" PRIu64 " blocks, max %" PRIu64 ")", n, (uint64_t)FILE_BLOCKS_MAX);
+    uint64_t pcap = 16;
+    while (pcap < 2 * n) pcap *= 2;
+    uint64_t *map  = (uint64_t*)calloc((size_t)n, sizeof(uint64_t));
+    uint32_t *hash = (uint32_t*)malloc((size_t)n * sizeof(uint32_t));
+    uint64_t *pend = (uint64_t*)malloc((size_t)pcap * sizeof(uint64_t));   // new blocks of this file, by hash
+    uint8_t  *buf  = (uint8_t*)malloc(2 * BS);
+    int rc = -1;
+    if (!map || !hash || !pend || !buf) {
+        fail("out of memory");
+        goto out;
+    }
+    uint8_t *tmp = buf + BS;
+    memset(pend, 0xFF, (size_t)pcap * sizeof(uint64_t));
+    uint64_t fresh = 0;
+    for (uint64_t k = 0; k < n; k++) {
+        int e = dedup_read(src, k, buf, &im->stats);
+        if (e) {
+            fail("%s", e < 0 ? "file changed while being added" : strerror(e));
+            goto out;
+        }
+        uint32_t h = hash[k] = dedup_hash(im, buf);
+        map[k] = dedup_find(im, h, buf, tmp);
+        if (map[k]) continue;
+        uint64_t i = h & (pcap - 1);
+        for (; pend[i] != UINT64_MAX; i = (i + 1) & (pcap - 1)) {
+            uint64_t j = pend[i];
+            if (hash[j] == h && dedup_read(src, j, tmp, &im->stats) == 0 && memcmp(tmp, buf, BS) == 0) {
+                map[k] = DEDUP_SAME | j;
+                break;
+            }
+        }
+        if (!map[k]) {
+            pend[i] = k;
+            fresh++;
+        }
+    }
+
+    uint64_t inum;
+    if (file_commit(im, dx, name, src->size, 0, 0, map, &inum) != 0) goto out;
+    // Take the extra references first, so an undo drops them again; then
+    // read the new blocks into place. Each must still hash as it did, or a
+    // later block mapped onto it would read back wrong.
+    uint64_t start = im->sb->data_region_start;
+    for (uint64_t k = 0; k < n; k++) {
+        uint64_t i = hash[k] & (pcap - 1);
+        while (pend[i] != UINT64_MAX && pend[i] != k) i = (i + 1) & (pcap - 1);
+        if (pend[i] == k) continue;
+        im->refcnt[map[k] - start]++;
+        image_mark(im, &im->refcnt[map[k] - start]);
+    }
+    for (uint64_t i = 0; i < pcap; i++) {
+        if (pend[i] == UINT64_MAX) continue;
+        uint64_t k = pend[i];
+        uint8_t *dst = im->img + map[k] * BS;
+        int e = dedup_read(src, k, dst, &im->stats);
+        if (e == 0 && dedup_hash(im, dst) != hash[k]) e = -1;
+        if (e == 0 && dedup_insert(im, hash[k], (uint32_t)map[k]) != 0) e = ENOMEM;
+        if (e) {
+            fail("%s", e < 0 ? "file changed while being added" : strerror(e));
+            file_undo(im, inum, dx->ino, name);   // lookups only see the first VSFS_NAME_MAX bytes
+            goto out;
+        }
+    }
+    struct stat st;
+    if (src->fd >= 0 && (fstat(src->fd, &st) != 0 || (uint64_t)st.st_size != src->size)) {
+        fail("file changed while being added");
+        file_undo(im, inum, dx->ino, name);
+        goto out;
+    }
+    im->dedup.blocks += n;
+    im->dedup.shared += n - fresh;
+    *out_ino = inum;
+    rc = 0;
+out:
+    free(map);
+    free(hash);
+    free(pend);
+    free(buf);
+    return rc;
+}
+
+// Commit host file host_path into directory dx under name and queue its
+// payload copy. The directory inode is left for the caller to stamp.
+static int queue_file(vsfs_t *im, dir_index_t *dx, const char *name, const char *host_path, void *tag) {
+    // Size the host file; the worker checks it did not change by the copy
+    struct stat hs;
+    if (stat(host_path, &hs) != 0) return fail("%s", strerror(errno));
+    if (!S_ISREG(hs.st_mode)) return fail("not a regular file");
+
+    uint64_t inum;
+    if (im->dedup_on) {
+        dedup_src_t src = { open(host_path, O_RDONLY), NULL, 0 };
+        if (src.fd < 0) return fail("%s", strerror(errno));
+        int rc = fstat(src.fd, &hs) != 0 ? fail("%s", strerror(errno)) : 0;
+        src.size = (uint64_t)hs.st_size;
+        if (rc == 0) rc = dedup_commit(im, dx, name, &src, &inum);
+        close(src.fd);
+        if (rc != 0) return -1;
+        char stored[VSFS_NAME_MAX + 1] = {0};
+        memcpy(stored, name, strnlen(name, VSFS_NAME_MAX));
+        report(im, VSFS_EV_ADDED, host_path, stored, inum, src.size, tag, NULL);
+        return 0;
+    }
+
+    // A file to compress is only committed by vsfs_flush(): check its name
+    // now, and flush first when too much is already waiting in memory.
+    int zip = im->compress_on && (uint64_t)hs.st_size > BS;
+    if (zip) {
+        dirent64_t de;
+        if (dirent_name(&de, name) != 0 || name_free(im, dx, &de) != 0) return -1;
+        if (im->zip.pending && im->zip.pending + (uint64_t)hs.st_size > ZIP_PENDING_MAX) vsfs_flush(im);
+    }
+    if (!im->pool_live) {
+        if (ingest_pool_start(&im->pool, im, im->nthreads) != 0) return -1;
+        im->pool_live = 1;
+    }
+    ingest_job_t *job = (ingest_job_t*)calloc(1, sizeof(*job));
+    char *path = strdup(host_path);
+    if (!job || !path || ingest_pool_reserve(&im->pool) != 0) {
+        free(job);
+        free(path);
+        return fail("out of memory");
+    }
+    if (zip) {
+        inum = 0;
+        im->zip.pending += (uint64_t)hs.st_size;
+    } else if (file_commit(im, dx, name, (uint64_t)hs.st_size, 0, im->in_place, NULL, &inum) != 0) {
+        free(job);
+        free(path);
+        return -1;
+    }
+    job->path = path;
+    job->size = (uint64_t)hs.st_size;
+    job->ino = inum;
+    job->zip = zip;
+    job->dir_ino = dx->ino;
+    size_t nlen = strnlen(name, VSFS_NAME_MAX);
+    memcpy(job->name, name, nlen);
+    job->name[nlen] = '\0';
+    job->tag = tag;
+    ingest_pool_push(&im->pool, job);
+    return 0;
+}
+
+int vsfs_add_file(vsfs_t *im, uint64_t dir, const char *name, const char *host_path, void *tag) {
+    if (view_only(im) != 0) return -1;
+    dir_index_t *dx = dir_get(im, dir);
+    if (!dx || queue_file(im, dx, name, host_path, tag) != 0) return -1;
+    dir_touch(im, dir);
+    return 0;
+}
+
+int vsfs_add_data(vsfs_t *im, uint64_t dir, const char *name, const void *data, uint64_t len, uint64_t *ino) {
+    if (view_only(im) != 0) return -1;
+    dir_index_t *dx = dir_get(im, dir);
+    uint64_t inum;
+    if (dx && im->dedup_on) {
+        dedup_src_t src = { -1, (const uint8_t*)data, len };
+        if (dedup_commit(im, dx, name, &src, &inum) != 0) return -1;
+        dir_touch(im, dir);
+        if (ino) *ino = inum;
+        return 0;
+    }
+    if (!dx) return -1;
+    uint8_t *z = NULL;
+    uint64_t zlen = 0;
+    if (im->compress_on && zip_encode((const uint8_t*)data, len, &z, &zlen) != 0) return fail("out of memory");
+    int rc = file_store(im, dx, name, len, z ? z : (const uint8_t*)data, z ? zlen : 0, &inum);
+    free(z);
+    if (rc != 0) return -1;
+    if (im->compress_on) zip_account(im, len, z ? zlen : 0);
+    dir_touch(im, dir);
+    if (ino) *ino = inum;
+    return 0;
+}
+
+// Create subdirectory name in directory pdx, holding just "." and "..", and
+// count its ".." link on the parent. An existing subdirectory of that name
+// is reused so trees can be merged. The parent inode is left for the caller
+// to stamp. Returns 0 and the directory inode in *out_ino, or -1 (with
+// nothing modified) on error.
+static int make_dir(vsfs_t *im, dir_index_t *pdx, const char *name, uint64_t *out_ino) {
+    dirent64_t de;
+    if (dirent_name(&de, name) != 0) return -1;
+    dirent64_t *old = dir_lookup(im, pdx, de.name);
+    if (old) {
+        if (old->type == VSFS_DT_DIR) {
+            *out_ino = old->inode_no;
+            return 0;
+        }
+        return fail("'%.*s' already exists and is not a directory", (int)sizeof(de.name), de.name);
+    }
+    if (im->inodes.free_count == 0) return fail("no free inode");
+    uint64_t ibit = inode_bit_alloc(im);
+    if (ibit == VSFS_BITMAP_NONE) return fail("no free inode");
+    uint64_t inum = ibit + 1;
+    image_mark(im, &im->inodes.bits[ibit >> 3]);
+
+    inode_t node; memset(&node, 0, sizeof(node));
+    uint32_t blk = inode_append_block(im, &node, 0);
+    if (blk == 0) {
+        vsfs_bitmap_free(&im->inodes, ibit);
+        return fail("not enough free data blocks");
+    }
+    dirent64_t *ents = (dirent64_t*)(im->img + (uint64_t)blk * BS);
+    ents[0].inode_no = (uint32_t)inum;
+    ents[0].type = VSFS_DT_DIR;
+    strncpy(ents[0].name, ".", sizeof(ents[0].name));
+    vsfs_dirent_checksum_finalize(&ents[0]);
+    ents[1].inode_no = (uint32_t)pdx->ino;
+    ents[1].type = VSFS_DT_DIR;
+    strncpy(ents[1].name, "..", sizeof(ents[1].name));
+    vsfs_dirent_checksum_finalize(&ents[1]);
+
+    de.inode_no = (uint32_t)inum;
+    de.type = VSFS_DT_DIR;
+    vsfs_dirent_checksum_finalize(&de);
+    if (dir_insert(im, pdx, &de) != 0) {
+        vsfs_bitmap_free(&im->blocks, blk - im->sb->data_region_start);
+        vsfs_bitmap_free(&im->inodes, ibit);
+        return fail("directory cannot grow");
+    }
+
+    node.mode  = VSFS_S_IFDIR;
+    node.links = 2;
+    node.size_bytes = BS;
+    node.atime = node.mtime = node.ctime = (uint64_t)time(NULL);
+    node.proj_id = 6;
+    vsfs_inode_crc_finalize(&node);
+    im->itab[inum - 1] = node;
+    image_mark(im, &im->itab[inum - 1]);
+
+    inode_t *parent = &im->itab[pdx->ino - 1];
+    if (parent->links < 0xFFFF) parent->links++;
+    *out_ino = inum;
+    return 0;
+}
+
+int vsfs_mkdir(vsfs_t *im, uint64_t parent, const char *name, uint64_t *ino) {
+    if (view_only(im) != 0) return -1;
+    dir_index_t *pdx = dir_get(im, parent);
+    uint64_t inum;
+    if (!pdx || make_dir(im, pdx, name, &inum) != 0) return -1;
+    dir_touch(im, parent);
+    if (ino) *ino = inum;
+    return 0;
+}
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Copy the contents of host directory host_dir into directory dx: regular
+// files become files, directories become subdirectories (recursively),
+// anything else is skipped. Entries go in name order so the same tree
+// always yields the same image. Each directory inode is stamped once,
+// after all of its entries are in. Returns the number of failures, each
+// already reported.
+static uint64_t import_tree(vsfs_t *im, dir_index_t *dx, const char *host_dir, void *tag) {
+    // Read the whole listing first so no directory stream stays open
+    // while recursing.
+    DIR *d = opendir(host_dir);
+    if (!d) {
+        report(im, VSFS_EV_FAILED, host_dir, NULL, 0, 0, tag, strerror(errno));
+        return 1;
+    }
+    uint64_t failed = 0;
+    char **names = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        if (n == cap) {
+            size_t ncap = cap ? cap * 2 : 32;
+            char **nn = (char**)realloc(names, ncap * sizeof(char*));
+            if (!nn) break;
+            names = nn;
+            cap = ncap;
+        }
+        if (!(names[n] = strdup(e->d_name))) break;
+        n++;
+    }
+    int oom = e != NULL;
+    closedir(d);
+    if (oom) {
+        report(im, VSFS_EV_FAILED, host_dir, NULL, 0, 0, tag, "out of memory reading directory");
+        failed++;
+    }
+    if (n) qsort(names, n, sizeof(char*), name_cmp);
+
+    for (size_t i = 0; i < n; i++) {
+        size_t plen = strlen(host_dir) + 1 + strlen(names[i]) + 1;
+        char *path = (char*)malloc(plen);
+        if (!path) {
+            report(im, VSFS_EV_FAILED, host_dir, names[i], 0, 0, tag, "out of memory");
+            failed++;
+            continue;
+        }
+        snprintf(path, plen, "%s/%s", host_dir, names[i]);
+        struct stat hs;
+        if (lstat(path, &hs) != 0) {
+            report(im, VSFS_EV_FAILED, path, names[i], 0, 0, tag, strerror(errno));
+            failed++;
+        } else if (S_ISDIR(hs.st_mode)) {
+            uint64_t ino;
+            dir_index_t *cdx;
+            if (make_dir(im, dx, names[i], &ino) != 0 || !(cdx = dir_get(im, ino))) {
+                report(im, VSFS_EV_FAILED, path, names[i], 0, 0, tag, vsfs_errmsg());
+                failed++;
+            } else {
+                report(im, VSFS_EV_DIR, path, names[i], ino, 0, tag, NULL);
+                failed += import_tree(im, cdx, path, tag);
+                dir_touch(im, ino);
+            }
+        } else if (S_ISREG(hs.st_mode)) {
+            if (queue_file(im, dx, names[i], path, tag) != 0) {
+                report(im, VSFS_EV_FAILED, path, names[i], 0, (uint64_t)hs.st_size, tag, vsfs_errmsg());
+                failed++;
+            }
+        } else {
+            report(im, VSFS_EV_SKIPPED, path, names[i], 0, 0, tag, "not a regular file or directory");
+        }
+        free(path);
+    }
+    for (size_t i = 0; i < n; i++) free(names[i]);
+    free(names);
+    return failed;
+}
+
+int vsfs_import_tree(vsfs_t *im, uint64_t dir, const char *host_dir, void *tag) {
+    if (view_only(im) != 0) return -1;
+    struct stat hs;
+    if (stat(host_dir, &hs) != 0) {
+        fail("%s", strerror(errno));
+    } else if (!S_ISDIR(hs.st_mode)) {
+        fail("not a directory");
+    } else {
+        dir_index_t *dx = dir_get(im, dir);
+        if (dx) {
+            uint64_t failed = import_tree(im, dx, host_dir, tag);
+            dir_touch(im, dir);
+            if (failed == 0) return 0;
+            return fail("%" PRIu64 " entries of %s could not be imported", failed, host_dir);
+        }
+    }
+    report(im, VSFS_EV_FAILED, host_dir, NULL, 0, 0, tag, vsfs_errmsg());
+    return -1;
+}
+
+void vsfs_set_report(vsfs_t *im, vsfs_report_fn fn, void *ctx) {
+    im->report = fn;
+    im->report_ctx = ctx;
+}
+
+int vsfs_set_threads(vsfs_t *im, int nthreads) {
+    if (nthreads < 1 || nthreads > 256) return fail("thread count must be in [1,256]");
+    im->nthreads = nthreads;   // taken up by the next pool start
+    return 0;
+}
+
+int vsfs_set_io(vsfs_t *im, const vsfs_io_opts_t *opts) {
+    if (opts->depth > 4096) return fail("I/O depth must be in [1,4096]");
+    io_count(im->io, &im->stats);
+    vsfs_io_free(im->io);
+    im->io = NULL;
+    im->io_opts = *opts;
+    return 0;
+}
+
+// ----------------- Replace and remove -----------------
+
+// Regular file named name in directory dx: its inode number, with the
+// name as stored (NUL-terminated) in stored. -1 if there is none.
+static int64_t file_entry(vsfs_t *im, dir_index_t *dx, const char *name, char stored[VSFS_NAME_MAX + 1]) {
+    dirent64_t key;
+    if (dirent_name(&key, name) != 0) return -1;
+    memcpy(stored, key.name, sizeof(key.name));
+    stored[sizeof(key.name)] = '\0';
+    const dirent64_t *de = dir_lookup(im, dx, stored);
+    if (!de) return fail("'%s' not found", stored);
+    if (de->type != VSFS_DT_FILE) return fail("'%s' is a directory", stored);
+    const inode_t *node = inode_get(im, de->inode_no);
+    if (!node) return -1;
+    if ((node->mode & VSFS_S_IFMT) != VSFS_S_IFREG) return fail("'%s' is not a regular file", stored);
+    return de->inode_no;
+}
+
+// Whether rewriting block b must go to a new block: another file shares
+// it, or the committed image of a journaled handle still uses it.
+static int block_cow(const vsfs_t *im, uint32_t b) {
+    uint64_t i = b - im->sb->data_region_start;
+    return (im->refcnt && im->refcnt[i] > 0) || (im->held && !BIT_TEST(im->fresh, i));
+}
+
+// Give file node the contents of src. Blocks both layouts have are
+// compared first and only the ones that differ are written; the file then
+// grows or shrinks at its end. The new layout follows the packing rules
+// of an add but is never compressed or shared. Everything that can fail
+// is checked before the image is touched, except the host file changing
+// under us: the file is then left holding the whole blocks written so far.
+// *changed receives the number of blocks written, a new tail or inline
+// data counting as one.
+static int file_replace(vsfs_t *im, inode_t *node, const dedup_src_t *src, uint64_t *changed) {
+    const uint64_t size = src->size;
+    const int packed = (im->sb->flags & VSFS_FLAG_PACKED) != 0;
+    const int inl = packed && size <= VSFS_INLINE_MAX;
+    const uint32_t tail = packed && !inl && size % BS <= VSFS_TAIL_MAX ? (uint32_t)(size % BS) : 0;
+    uint64_t n_new = tail ? size / BS : (size + BS - 1) / BS;
+    if (n_new == 0 && !inl && !tail) n_new = 1;
+    if (inl) n_new = 0;
+    if (n_new > FILE_BLOCKS_MAX)
+        return fail("file too big for MiniVSFS (needs %" PRIu64 " blocks, max %" PRIu64 ")",
+                    n_new, (uint64_t)FILE_BLOCKS_MAX);
+
+    // A compressed stream has no blocks to compare with, and inline data
+    // sits where the block pointers go: both start over.
+    inode_t n = *node;
+    const int restart = (n.reserved_2 & (VSFS_INO_COMPRESSED | VSFS_INO_INLINE)) != 0;
+    const uint64_t n_old = restart ? 0 : vsfs_inode_blocks(&n);
+    const uint64_t keep = n_old < n_new ? n_old : n_new;
+
+    // Pass 1: which kept blocks differ, and how many of them move.
+    uint8_t buf[BS], tmp[BS];
+    uint8_t *diff = (uint8_t*)calloc(1, (size_t)((keep + 7) / 8 + 1));
+    if (!diff) return fail("out of memory");
+    uint64_t ncow = 0;
+    int e = 0;
+    for (uint64_t k = 0; k < keep; k++) {
+        uint32_t b = inode_bmap(im, &n, k);
+        if (!b) {
+            free(diff);
+            return fail("block %" PRIu64 " of the file is not mapped (corrupt FS)", k);
+        }
+        if ((e = dedup_read(src, k, buf, &im->stats)) != 0) break;
+        const uint8_t *cur = block_bytes(im, b, tmp);
+        if (!cur) {
+            free(diff);
+            return -1;
+        }
+        if (memcmp(cur, buf, BS) == 0) continue;
+        BIT_SET(diff, k);
+        if (block_cow(im, b)) ncow++;
+    }
+    uint64_t old_len = 0;
+    const uint8_t *old_tail = (n.reserved_2 & VSFS_INO_TAIL) ? file_tail(im, &n, &old_len) : NULL;
+    int keep_tail = 0;
+    if (!e && tail && old_tail && old_len == tail) {
+        e = dedup_read(src, n_new, buf, &im->stats);
+        keep_tail = !e && memcmp(old_tail, buf, tail) == 0;
+    }
+    if (e) {
+        free(diff);
+        return fail("%s", e < 0 ? "file changed while being replaced" : strerror(e));
+    }
+    uint64_t need = ncow + (tail && !keep_tail);
+    if (n_new > n_old) need += n_new - n_old + indirect_blocks_for(n_new) - indirect_blocks_for(n_old);
+    if (im->blocks.free_count < need) {
+        free(diff);
+        return fail("not enough free data blocks");
+    }
+
+    // Pass 2: let go of what the new layout does not use.
+    im->zip.ino = 0;   // the cached cluster may be this file's
+    if (n.reserved_2 & VSFS_INO_COMPRESSED) inode_free_blocks(im, &n);
+    if (restart) {
+        memset(n.direct, 0, sizeof(n.direct));
+        n.reserved_0 = n.reserved_1 = 0;
+        n.reserved_2 = 0;
+        n.xattr_ptr = 0;
+    }
+    if ((n.reserved_2 & VSFS_INO_TAIL) && !keep_tail) {
+        frag_release(im, n.xattr_ptr);
+        n.reserved_2 = 0;
+        n.xattr_ptr = 0;
+    }
+    if (n_new < n_old) inode_truncate_blocks(im, &n, n_new, n_old);
+    uint64_t mapped = keep;
+
+    // Rewrite the blocks that differ, then append the new ones.
+    uint64_t written = 0;
+    for (uint64_t k = 0; !e && k < keep; k++) {
+        if (!BIT_TEST(diff, k)) continue;
+        if ((e = dedup_read(src, k, buf, &im->stats)) != 0) break;
+        uint32_t *slot = inode_slot(im, &n, k);
+        uint32_t b = *slot;
+        if (block_cow(im, b)) {
+            uint64_t bit;
+            if (block_bits_alloc(im, 1, &bit) != 0) {
+                e = ENOSPC;
+                break;
+            }
+            image_mark(im, &im->blocks.bits[bit >> 3]);
+            image_free_block(im, b);
+            b = (uint32_t)(im->sb->data_region_start + bit);
+            *slot = b;
+            if (k >= DIRECT_MAX) image_mark(im, slot);
+        } else if (im->dedup.live) {
+            BIT_CLEAR(im->dedup.live, b - im->sb->data_region_start);   // no longer what was indexed
+        }
+        memcpy(im->img + (uint64_t)b * BS, buf, BS);
+        image_mark(im, im->img + (uint64_t)b * BS);
+        written++;
+    }
+    free(diff);
+    for (uint64_t k = n_old; !e && k < n_new; k++) {
+        if ((e = dedup_read(src, k, buf, &im->stats)) != 0) break;
+        uint32_t b = inode_append_block(im, &n, k);
+        if (!b) {
+            e = ENOSPC;
+            break;
+        }
+        memcpy(im->img + (uint64_t)b * BS, buf, BS);
+        mapped++;
+        written++;
+    }
+    if (!e && ((tail && !keep_tail) || inl)) e = dedup_read(src, n_new, buf, &im->stats);
+    if (!e && tail && !keep_tail) {
+        n.xattr_ptr = frag_append(im, tail);
+        if (n.xattr_ptr) {
+            n.reserved_2 = VSFS_INO_TAIL;
+            memcpy(im->img + (uint64_t)VSFS_FRAG_BLOCK(n.xattr_ptr) * BS + VSFS_FRAG_OFF(n.xattr_ptr), buf, tail);
+            written++;
+        } else {
+            e = ENOSPC;
+        }
+    }
+    if (!e && inl) {
+        n.reserved_2 = VSFS_INO_INLINE;
+        memcpy(n.direct, buf, (size_t)size);
+        written++;
+    }
+
+    // The inode is written even on failure: whatever changed is mapped.
+    n.size_bytes = size;
+    if (e) {
+        if (n.reserved_2 & VSFS_INO_TAIL) frag_release(im, n.xattr_ptr);
+        n.size_bytes = mapped * BS;
+        n.reserved_2 = mapped ? 0 : VSFS_INO_INLINE;
+        n.xattr_ptr = 0;
+    }
+    n.mtime = n.ctime = (uint64_t)time(NULL);
+    vsfs_inode_crc_finalize(&n);
+    *node = n;
+    image_mark(im, node);
+    *changed = written;
+    if (e) return fail("%s", e < 0 ? "file changed while being replaced" : strerror(e));
+    return 0;
+}
+
+int vsfs_replace_file(vsfs_t *im, uint64_t dir, const char *name, const char *host_path, uint64_t *changed) {
+    if (view_only(im) != 0) return -1;
+    uint64_t written = 0;
+    if (changed) *changed = 0;
+    vsfs_flush(im);   // queued copies may be into this very file
+    dir_index_t *dx = dir_get(im, dir);
+    char stored[VSFS_NAME_MAX + 1];
+    int64_t ino = dx ? file_entry(im, dx, name, stored) : -1;
+    if (ino < 0) return -1;
+    dedup_src_t src = { open(host_path, O_RDONLY), NULL, 0 };
+    struct stat hs;
+    if (src.fd < 0) return fail("%s: %s", host_path, strerror(errno));
+    if (fstat(src.fd, &hs) != 0) {
+        fail("%s: %s", host_path, strerror(errno));
+        close(src.fd);
+        return -1;
+    }
+    if (!S_ISREG(hs.st_mode)) {
+        close(src.fd);
+        return fail("%s: not a regular file", host_path);
+    }
+    src.size = (uint64_t)hs.st_size;
+    int rc = file_replace(im, &im->itab[ino - 1], &src, &written);
+    close(src.fd);
+    if (changed) *changed = written;
+    dir_touch(im, dir);
+    return rc;
+}
+
+int vsfs_remove(vsfs_t *im, uint64_t dir, const char *name) {
+    if (view_only(im) != 0) return -1;
+    vsfs_flush(im);
+    dir_index_t *dx = dir_get(im, dir);
+    char stored[VSFS_NAME_MAX + 1];
+    int64_t ino = dx ? file_entry(im, dx, name, stored) : -1;
+    if (ino < 0) return -1;
+    file_undo(im, (uint64_t)ino, dir, stored);
+    return 0;
+}
+
+// ----------------- Raw allocation -----------------
+
+int vsfs_set_dedup(vsfs_t *im, int on) {
+    if (on && !im->refcnt) return fail("image has no reference-count region");
+    im->dedup_on = on;
+    return 0;
+}
+
+void vsfs_dedup_stats(const vsfs_t *im, uint64_t *blocks, uint64_t *shared) {
+    if (blocks) *blocks = im->dedup.blocks;
+    if (shared) *shared = im->dedup.shared;
+}
+
+int vsfs_set_compress(vsfs_t *im, int on) {
+    im->compress_on = on;
+    return 0;
+}
+
+void vsfs_compress_stats(const vsfs_t *im, uint64_t *blocks, uint64_t *stored) {
+    if (blocks) *blocks = im->zip.blocks;
+    if (stored) *stored = im->zip.stored;
+}
+
+void vsfs_stats(const vsfs_t *im, vsfs_stats_t *out) {
+    *out = im->stats;
+    io_count(im->io, out);
+    out->total_ns     = clock_ns() - im->opened_ns;
+    out->bits_scanned = im->inodes.scanned + im->blocks.scanned;
+    out->inodes_free  = im->inodes.free_count;
+    out->inodes_total = im->sb->inode_count;
+    out->blocks_free  = im->blocks.free_count;
+    out->blocks_total = im->sb->data_region_blocks;
+}
+
+int vsfs_alloc_inode(vsfs_t *im, uint64_t *ino) {
+    if (view_only(im) != 0) return -1;
+    uint64_t bit = inode_bit_alloc(im);
+    if (bit == VSFS_BITMAP_NONE) return fail("no free inode");
+    image_mark(im, &im->inodes.bits[bit >> 3]);
+    *ino = bit + 1;
+    return 0;
+}
+
+int vsfs_alloc_blocks(vsfs_t *im, uint64_t n, uint32_t *out) {
+    if (view_only(im) != 0) return -1;
+    if (n == 0) return 0;
+    if (n > im->blocks.free_count) return fail("not enough free data blocks");
+    uint64_t *bits = (uint64_t*)malloc(n * sizeof(uint64_t));
+    if (!bits) return fail("out of memory");
+    if (block_bits_alloc(im, n, bits) != 0) {
+        free(bits);
+        return fail("not enough free data blocks");
+    }
+    for (uint64_t k = 0; k < n; k++) {
+        image_mark(im, &im->blocks.bits[bits[k] >> 3]);
+        out[k] = (uint32_t)(im->sb->data_region_start + bits[k]);
+    }
+    free(bits);
+    return 0;
+}
+
+int vsfs_free_inode(vsfs_t *im, uint64_t ino) {
+    if (view_only(im) != 0) return -1;
+    if (ino == 0 || ino > im->sb->inode_count) return fail("inode %" PRIu64 " out of range", ino);
+    if (ino == ROOT_INO) return fail("the root inode cannot be freed");
+    vsfs_bitmap_free(&im->inodes, ino - 1);
+    image_mark(im, &im->inodes.bits[(ino - 1) >> 3]);
+    return 0;
+}
+
+int vsfs_free_blocks(vsfs_t *im, const uint32_t *blocks, uint64_t n) {
+    if (view_only(im) != 0) return -1;
+    // Check them all first so a bad list frees nothing.
+    for (uint64_t k = 0; k < n; k++)
+        if (!data_block(im, blocks[k])) return fail("block %" PRIu32 " is outside the data region", blocks[k]);
+    for (uint64_t k = 0; k < n; k++) image_free_block(im, blocks[k]);
+    return 0;
+}
+
+uint64_t vsfs_free_inode_count(const vsfs_t *im) {
+    return im->inodes.free_count;
+}
+
+uint64_t vsfs_free_block_count(const vsfs_t *im) {
+    return im->blocks.free_count;
+}
+
+int vsfs_write_inode(vsfs_t *im, uint64_t ino, const inode_t *node) {
+    if (view_only(im) != 0) return -1;
+    if (ino == 0 || ino > im->sb->inode_count) return fail("inode %" PRIu64 " out of range", ino);
+    inode_t *dst = &im->itab[ino - 1];
+    *dst = *node;
+    vsfs_inode_crc_finalize(dst);
+    image_mark(im, dst);
+    im->zip.ino = 0;
+    return 0;
+}
+
+int vsfs_write_block(vsfs_t *im, uint32_t bno, const void *buf) {
+    if (view_only(im) != 0) return -1;
+    if (!data_block(im, bno)) return fail("block %" PRIu32 " is outside the data region", bno);
+    memcpy(im->img + (uint64_t)bno * BS, buf, BS);
+    image_mark(im, im->img + (uint64_t)bno * BS);
+    if (im->dedup.live) BIT_CLEAR(im->dedup.live, bno - im->sb->data_region_start);
+    im->zip.ino = 0;
+    return 0;
+}
+
+// ----------------- Lookup and read -----------------
+
+int vsfs_lookup(vsfs_t *im, uint64_t dir, const char *name, uint64_t *ino) {
+    dir_index_t *dx = dir_get(im, dir);
+    if (!dx) return -1;
+    if (strlen(name) > VSFS_NAME_MAX) return 1;
+    dirent64_t *de = dir_lookup(im, dx, name);
+    if (!de) return 1;
+    *ino = de->inode_no;
+    return 0;
+}
+
+int vsfs_resolve(vsfs_t *im, const char *path, uint64_t *ino) {
+    uint64_t cur = ROOT_INO;
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        const char *e = strchr(p, '/');
+        size_t len = e ? (size_t)(e - p) : strlen(p);
+        if (len > VSFS_NAME_MAX) return 1;
+        char name[VSFS_NAME_MAX + 1];
+        memcpy(name, p, len);
+        name[len] = '\0';
+        int rc = vsfs_lookup(im, cur, name, &cur);
+        if (rc != 0) return rc;
+        p += len;
+    }
+    *ino = cur;
+    return 0;
+}
+
+int vsfs_stat(vsfs_t *im, uint64_t ino, inode_t *out) {
+    const inode_t *node = inode_get(im, ino);
+    if (!node) return -1;
+    *out = *node;
+    return 0;
+}
+
+int vsfs_readdir(vsfs_t *im, uint64_t dir, vsfs_dirent_fn fn, void *ctx) {
+    const inode_t *node = inode_get(im, dir);
+    if (!node) return -1;
+    if ((node->mode & VSFS_S_IFMT) != VSFS_S_IFDIR) return fail("inode %" PRIu64 " is not a directory", dir);
+    uint64_t nblocks = node->size_bytes / BS;
+    for (uint64_t k = 0; k < nblocks; k++) {
+        uint32_t b = inode_bmap(im, node, k);
+        if (b == 0)
+            return fail("directory inode %" PRIu64 " block %" PRIu64 " is unmapped or out of range", dir, k);
+        const dirent64_t *de = (const dirent64_t*)(im->img + (uint64_t)b * BS);
+        for (uint64_t s = 0; s < DIRENTS_PER_BLOCK; s++, de++) {
+            if (de->inode_no == 0) continue;
+            if (strncmp(de->name, ".", VSFS_NAME_MAX) == 0 || strncmp(de->name, "..", VSFS_NAME_MAX) == 0) continue;
+            int rc = fn(ctx, de);
+            if (rc) return rc;
+        }
+    }
+    return 0;
+}
+
+// Regular file ino, after waiting for any copy still filling it.
+static const inode_t *file_get(vsfs_t *im, uint64_t ino) {
+    vsfs_flush(im);
+    const inode_t *node = inode_get(im, ino);
+    if (node && (node->mode & VSFS_S_IFMT) != VSFS_S_IFREG) {
+        fail("inode %" PRIu64 " is not a regular file", ino);
+        return NULL;
+    }
+    return node;
+}
+
+// Where the current bytes of block b live: blocks changed since the last
+// sync only in the mapping; clean blocks of an in-place image only in the
+// file, since copies may have gone straight there. Clean blocks of any
+// other image are the same in both.
+static int block_in_file(const vsfs_t *im, uint32_t b) {
+    return !BIT_TEST(im->dirty, b);
+}
+
+// The run of physically contiguous blocks of node starting at logical
+// block k, at most max long, that all live in the same place.
+static uint64_t block_run(const vsfs_t *im, const inode_t *node, uint64_t k, uint32_t first, uint64_t max) {
+    uint64_t run = 1;
+    int where = block_in_file(im, first);
+    while (run < max && inode_bmap(im, node, k + run) == first + run &&
+           block_in_file(im, first + (uint32_t)run) == where) run++;
+    return run;
+}
+
+// Copy len bytes of what the blocks of file ino (node) hold, from byte off
+// of the first, into dst.
+static int read_blocks(vsfs_t *im, uint64_t ino, const inode_t *node, uint64_t off, uint8_t *dst, uint64_t len) {
+    uint64_t done = 0, nblocks = vsfs_inode_blocks(node);
+    while (done < len) {
+        uint64_t pos = off + done, k = pos / BS, boff = pos % BS;
+        uint32_t first = k < nblocks ? inode_bmap(im, node, k) : 0;
+        if (first == 0)
+            return fail("inode %" PRIu64 " block %" PRIu64 " is unmapped or out of range", ino, k);
+        uint64_t max = (boff + len - done + BS - 1) / BS;
+        uint64_t run = block_run(im, node, k, first, max < nblocks - k ? max : nblocks - k);
+        uint64_t n = run * BS - boff;
+        if (n > len - done) n = len - done;
+        uint64_t at = (uint64_t)first * BS + boff;
+        if (im->in_place && block_in_file(im, first)) {
+            for (uint64_t got = 0; got < n; ) {
+                ssize_t nr = pread(im->fd, dst + done + got, (size_t)(n - got), (off_t)(at + got));
+                if (nr < 0 && errno == EINTR) continue;
+                if (nr < 0) return fail("pread: %s", strerror(errno));
+                if (nr == 0) return fail("pread: image ends early");
+                got += (uint64_t)nr;
+            }
+        } else {
+            memcpy(dst + done, im->img + at, (size_t)n);
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Cluster c of compressed file ino (node), decompressed into im->zip.out
+// and kept there for the next read. Returns its length, or -1.
+static int64_t zip_cluster(vsfs_t *im, uint64_t ino, const inode_t *node, uint64_t c) {
+    zip_t *z = &im->zip;
+    uint64_t n = (node->size_bytes + VSFS_ZCLUSTER - 1) / VSFS_ZCLUSTER;
+    uint64_t raw = c + 1 < n ? VSFS_ZCLUSTER : node->size_bytes - c * VSFS_ZCLUSTER;
+    if (z->ino == ino && z->cluster == c) return (int64_t)raw;
+    if (!z->in) {
+        z->in = (uint8_t*)malloc(2 * (size_t)VSFS_ZCLUSTER);
+        if (!z->in) return fail("out of memory");
+        z->out = z->in + VSFS_ZCLUSTER;
+    }
+    z->ino = 0;
+    // Where cluster c starts and ends: the table entry before it (or the
+    // end of the table) and its own.
+    uint32_t ends[2] = { (uint32_t)(n * 4), 0 };
+    if (c == 0 ? read_blocks(im, ino, node, 0, (uint8_t*)&ends[1], 4)
+               : read_blocks(im, ino, node, (c - 1) * 4, (uint8_t*)ends, 8)) return -1;
+    if (ends[0] < n * 4 || ends[1] < ends[0] || ends[1] > node->xattr_ptr || ends[1] - ends[0] > raw)
+        return fail("inode %" PRIu64 " has a damaged compressed stream", ino);
+    uint64_t clen = ends[1] - ends[0];
+    if (read_blocks(im, ino, node, ends[0], clen == raw ? z->out : z->in, clen) != 0) return -1;
+    if (clen < raw && vsfs_lz_decompress(z->in, (size_t)clen, z->out, (size_t)raw) != 0)
+        return fail("inode %" PRIu64 " has a damaged compressed stream", ino);
+    z->ino = ino;
+    z->cluster = c;
+    return (int64_t)raw;
+}
+
+int64_t vsfs_read(vsfs_t *im, uint64_t ino, uint64_t off, void *buf, uint64_t len) {
+    const inode_t *node = file_get(im, ino);
+    if (!node) return -1;
+    if (off >= node->size_bytes) return 0;
+    if (len > node->size_bytes - off) len = node->size_bytes - off;
+    if (len > INT64_MAX) len = INT64_MAX;
+    uint8_t *dst = (uint8_t*)buf;
+    if (node->reserved_2 & VSFS_INO_COMPRESSED) {
+        for (uint64_t done = 0; done < len; ) {
+            uint64_t pos = off + done, coff = pos % VSFS_ZCLUSTER;
+            int64_t raw = zip_cluster(im, ino, node, pos / VSFS_ZCLUSTER);
+            if (raw < 0) return -1;
+            uint64_t n = (uint64_t)raw - coff < len - done ? (uint64_t)raw - coff : len - done;
+            memcpy(dst + done, im->zip.out + coff, (size_t)n);
+            done += n;
+        }
+        return (int64_t)len;
+    }
+    // Whole blocks first, then whatever lies past them: inline data or a
+    // packed tail.
+    uint64_t nblocks = vsfs_inode_blocks(node), inblocks = 0;
+    if (off < nblocks * BS) inblocks = nblocks * BS - off < len ? nblocks * BS - off : len;
+    if (inblocks && read_blocks(im, ino, node, off, dst, inblocks) != 0) return -1;
+    if (inblocks < len) {
+        uint64_t pos = off + inblocks, tlen;
+        const uint8_t *tail = file_tail(im, node, &tlen);
+        if (!tail || pos - nblocks * BS + (len - inblocks) > tlen)
+            return fail("inode %" PRIu64 " has a damaged inline or packed tail", ino);
+        memcpy(dst + inblocks, tail + (pos - nblocks * BS), (size_t)(len - inblocks));
+    }
+    return (int64_t)len;
+}
+
+// Send len bytes of the image at off to out_fd: with sendfile from the
+// image file when from_file, else (or once sendfile turns out not to work
+// for out_fd) with write from the mapping.
+static int send_range(const vsfs_t *im, int out_fd, uint64_t off, uint64_t len, int from_file, int *use_sendfile) {
+    while (len > 0 && from_file && *use_sendfile) {
+        off_t o = (off_t)off;
+        ssize_t n = sendfile(out_fd, im->fd, &o, (size_t)len);
+        if (n > 0) {
+            off += (uint64_t)n;
+            len -= (uint64_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            *use_sendfile = 0;
+            break;
+        }
+        return n < 0 ? errno : EIO;
+    }
+    // An in-place image's clean blocks may differ from the mapping: bounce
+    // them through a buffer instead.
+    uint8_t buf[1u << 16];
+    while (len > 0) {
+        const uint8_t *src = im->img + off;
+        size_t want = (size_t)len;
+        if (from_file && im->in_place) {
+            want = len < sizeof(buf) ? (size_t)len : sizeof(buf);
+            ssize_t nr = pread(im->fd, buf, want, (off_t)off);
+            if (nr < 0 && errno == EINTR) continue;
+            if (nr <= 0) return nr < 0 ? errno : EIO;
+            want = (size_t)nr;
+            src = buf;
+        }
+        for (size_t done = 0; done < want; ) {
+            ssize_t n = write(out_fd, src + done, want - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return n < 0 ? errno : EIO;
+            done += (size_t)n;
+        }
+        off += want;
+        len -= want;
+    }
+    return 0;
+}
+
+int vsfs_read_fd(vsfs_t *im, uint64_t ino, int fd) {
+    const inode_t *node = file_get(im, ino);
+    if (!node) return -1;
+    uint64_t size = node->size_bytes;
+    if (node->reserved_2 & VSFS_INO_COMPRESSED) {
+        // Decompressed a cluster at a time; nothing to send straight from the file.
+        for (uint64_t c = 0; c * VSFS_ZCLUSTER < size; c++) {
+            int64_t raw = zip_cluster(im, ino, node, c);
+            if (raw < 0) return -1;
+            for (int64_t done = 0; done < raw; ) {
+                ssize_t n = write(fd, im->zip.out + done, (size_t)(raw - done));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return fail("%s", strerror(n < 0 ? errno : EIO));
+                done += n;
+            }
+        }
+        return 0;
+    }
+    uint64_t nblocks = vsfs_inode_blocks(node);
+    if (nblocks > (size + BS - 1) / BS) nblocks = (size + BS - 1) / BS;   // the block of an empty file
+    int use_sendfile = 1;
+    for (uint64_t k = 0; k < nblocks; ) {
+        uint32_t first = inode_bmap(im, node, k);
+        if (first == 0)
+            return fail("inode %" PRIu64 " block %" PRIu64 " is unmapped or out of range", ino, k);
+        uint64_t run = block_run(im, node, k, first, nblocks - k);
+        uint64_t off = k * BS;
+        uint64_t len = (k + run) * BS <= size ? run * BS : size - off;
+        int e = send_range(im, fd, (uint64_t)first * BS, len, block_in_file(im, first), &use_sendfile);
+        if (e) return fail("%s", strerror(e));
+        k += run;
+    }
+    // Inline data and packed tails are metadata-like: always in the mapping.
+    uint64_t tlen;
+    const uint8_t *tail = file_tail(im, node, &tlen);
+    if (nblocks * BS < size) {
+        if (!tail || nblocks * BS + tlen != size)
+            return fail("inode %" PRIu64 " has a damaged inline or packed tail", ino);
+        int e = send_range(im, fd, (uint64_t)(tail - im->img), tlen, 0, &use_sendfile);
+        if (e) return fail("%s", strerror(e));
+    }
+    return 0;
+}
+
+void vsfs_close(vsfs_t *im) {
+    if (!im) return;
+    if (im->pool_live) {
+        ingest_pool_drain(&im->pool);
+        ingest_pool_free(&im->pool);
+    }
+    dir_cache_free(im);
+    vsfs_io_free(im->io);
+    munmap(im->img, im->len);
+    close(im->fd);
+    free(im->dirty);
+    free(im->copied);
+    free(im->fresh);
+    free(im->held);
+    free(im->dedup.tab);
+    free(im->dedup.live);
+    free(im->zip.in);
+    free(im);
+}
@@ -0,0 +1,496 @@
+// libminivsfs: MiniVSFS images as an in-process library.
+//
+// The on-disk structures and checksum helpers, plus a handle API to format
+// an image, open it, allocate, add files and directories, look names up,
+// read file contents, write changes back and close. A handle keeps the
+// image mapped and its allocator and directory indexes warm, so a service
+// can run any number of operations against one open image.
+//
+// Errors: calls return 0 on success and -1 on failure (a few return a
+// count, or 1 for "not found"; see each call). The reason for the last
+// failure on the calling thread is in vsfs_errmsg().
+//
+// Buffer ownership:
+//   - Strings and buffers passed in are borrowed for the duration of the
+//     call only; whatever the library needs later it copies.
+//   - Pointers handed out point into the handle: vsfs_superblock() stays
+//     valid until vsfs_close(); dirents and events passed to callbacks are
+//     valid only during the callback.
+//   - vsfs_read() fills the caller's buffer. The library never returns
+//     memory the caller has to free.
+//   - A handle is used by one thread at a time. The worker threads started
+//     for vsfs_add_file() copies never call back into user code; events
+//     are delivered on the caller's thread.
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vsfs_io.h"
+
+// ----------------- On-disk format -----------------
+
+#define VSFS_BS              4096u
+#define VSFS_INODE_SIZE      128u
+#define VSFS_ROOT_INO        1u
+#define VSFS_MAGIC           0x4D565346u
+#define VSFS_VERSION         1u
+#define VSFS_DIRECT_MAX      12
+#define VSFS_PTRS_PER_BLOCK  (VSFS_BS / 4u)
+// direct[] + single indirect (reserved_0) + double indirect (reserved_1)
+#define VSFS_FILE_BLOCKS_MAX ((uint64_t)VSFS_DIRECT_MAX + VSFS_PTRS_PER_BLOCK + \
+                              (uint64_t)VSFS_PTRS_PER_BLOCK * VSFS_PTRS_PER_BLOCK)
+#define VSFS_NAME_MAX        58
+#define VSFS_DIRENTS_PER_BLOCK (VSFS_BS / 64u)
+#define VSFS_MIN_SIZE_KIB    180ull
+#define VSFS_MAX_SIZE_KIB    (4ull * UINT32_MAX)    // block numbers are 32-bit
+#define VSFS_MIN_INODES      128ull
+#define VSFS_MAX_INODES      ((uint64_t)UINT32_MAX) // dirent64_t.inode_no is 32 bits
+
+#define VSFS_S_IFMT          0170000
+#define VSFS_S_IFDIR         0040000
+#define VSFS_S_IFREG         0100000
+
+#define VSFS_DT_FILE         1
+#define VSFS_DT_DIR          2
+
+// superblock_t.flags
+#define VSFS_FLAG_BLOCK_CRC  0x1u   // a per-block CRC table is kept (see vsfs_sb_ext_t)
+#define VSFS_FLAG_REFCOUNT   0x2u   // data blocks may be shared; see vsfs_sb_ext_t
+#define VSFS_FLAG_PACKED     0x4u   // small files and tails are packed; see vsfs_frag_hdr_t
+#define VSFS_FLAG_COMPRESSED 0x8u   // files may be stored compressed (VSFS_INO_COMPRESSED)
+#define VSFS_FLAG_JOURNAL    0x10u  // in-place updates go through a journal; see vsfs_journal_hdr_t
+
+// inode_t.reserved_2 of a regular file: where the data past its whole
+// blocks lives, or that the blocks hold a compressed stream.
+#define VSFS_INO_INLINE      0x1u   // all of it in direct[] itself, no blocks
+#define VSFS_INO_TAIL        0x2u   // the last partial block is a fragment (xattr_ptr)
+#define VSFS_INO_COMPRESSED  0x4u   // the blocks hold xattr_ptr bytes of compressed stream
+#define VSFS_INLINE_MAX      48u    // sizeof(inode_t.direct)
+#define VSFS_TAIL_MAX        (VSFS_BS / 2)  // longer tails keep a block of their own
+
+// inode_t.xattr_ptr of a VSFS_INO_TAIL file: fragment block, byte offset
+// in it and length (size_bytes % VSFS_BS).
+#define VSFS_FRAG(block, off, len) (((uint64_t)(block) << 32) | ((uint64_t)(off) << 16) | (uint64_t)(len))
+#define VSFS_FRAG_BLOCK(x)   ((uint32_t)((x) >> 32))
+#define VSFS_FRAG_OFF(x)     ((uint32_t)((x) >> 16) & 0xFFFFu)
+#define VSFS_FRAG_LEN(x)     ((uint32_t)(x) & 0xFFFFu)
+#define VSFS_FRAG_MAGIC      0x47524656u    // "VFRG"
+
+// A VSFS_INO_COMPRESSED file is cut into clusters of VSFS_ZCLUSTER bytes
+// (the last one shorter), each compressed on its own so a read only
+// decodes the clusters it touches. The stream in its blocks is a table of
+// one uint32_t per cluster, the stream offset where that cluster's bytes
+// end, followed by the clusters back to back (the first starts right
+// after the table). A cluster as long as its data is stored as is; a
+// shorter one is an LZ4 block (see vsfs_lz.h). size_bytes stays the
+// uncompressed size.
+#define VSFS_ZCLUSTER        (16u * VSFS_BS)
+
+// Fields past superblock_t in block 0 (still covered by its checksum).
+#define VSFS_SB_EXT_OFFSET   128u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;            // CRC32 of block 0 (BS - 4 bytes) with this field zeroed
+} superblock_t;
+
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[12];
+    uint32_t reserved_0;          // single indirect block (0 = none)
+    uint32_t reserved_1;          // double indirect block (0 = none)
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;           // low 4 bytes: CRC32 of the first 120 bytes
+} inode_t;
+
+typedef struct {
+    uint32_t inode_no;            // 0 = free slot
+    uint8_t  type;                // VSFS_DT_FILE / VSFS_DT_DIR
+    char     name[VSFS_NAME_MAX]; // NUL-padded, not terminated at full length
+    uint8_t  checksum;            // XOR of the first 63 bytes
+} dirent64_t;
+
+// Optional regions between the inode table and the data region.
+//
+// With VSFS_FLAG_BLOCK_CRC, the image keeps one 32-bit entry per block,
+// 0..total_blocks-1, in crc_table_blocks blocks. An entry is
+// vsfs_block_crc() of the block; entries for the table's own blocks and
+// the journal's are 0 and mean nothing.
+//
+// With VSFS_FLAG_REFCOUNT, data blocks may be mapped by more than one file
+// (deduplication). The region holds one 32-bit count per data block, by
+// block number minus data_region_start: how many references the block has
+// beyond the first. 0 for an ordinary block, so the region starts out as
+// zeros. Freeing a block with a non-zero count only drops the count.
+//
+// With VSFS_FLAG_JOURNAL, journal_blocks blocks (an even number, at least
+// 4) hold the journal of in-place updates; see vsfs_journal_hdr_t.
+typedef struct {
+    uint64_t crc_table_start;
+    uint64_t crc_table_blocks;
+    uint64_t refcount_start;
+    uint64_t refcount_blocks;
+    uint64_t frag_block;          // VSFS_FLAG_PACKED: fragment block to fill next, or 0
+    uint64_t journal_start;
+    uint64_t journal_blocks;
+} vsfs_sb_ext_t;
+
+// With VSFS_FLAG_PACKED, a file of at most VSFS_INLINE_MAX bytes keeps its
+// data in direct[], and the last partial block of a larger one (up to
+// VSFS_TAIL_MAX bytes) is appended to a fragment block shared with other
+// tails. A fragment block starts with this header; fragments follow it,
+// back to back, up to end. The block is freed with its last fragment.
+typedef struct {
+    uint32_t magic;               // VSFS_FRAG_MAGIC
+    uint16_t live;                // fragments in use
+    uint16_t end;                 // first byte not handed out yet
+} vsfs_frag_hdr_t;
+
+// The journal is two slots, each half of the region; transaction seq goes
+// to slot seq % 2. A transaction is the set of metadata blocks one sync
+// changes (superblock, bitmaps, inode table, CRC and reference-count
+// regions, directory and pointer blocks): their new contents are written
+// to a slot, made durable with one fdatasync, and only then written to
+// their home locations. A slot starts with this header; the home block
+// numbers continue into as many following blocks as they need
+// (VSFS_PTRS_PER_BLOCK each), and the block images follow them in the
+// same order. crc covers the header with crc = 0, the numbers and the
+// images, so a torn slot never counts as written.
+#define VSFS_JOURNAL_MAGIC   0x4C4E524Au   // "JRNL"
+#define VSFS_JOURNAL_HDR_PTRS ((VSFS_BS - 20u) / 4u)   // home numbers in the header block
+typedef struct {
+    uint32_t magic;               // VSFS_JOURNAL_MAGIC, or 0 for an empty slot
+    uint32_t crc;                 // CRC32, see above
+    uint64_t seq;                 // from 1, one more per transaction
+    uint32_t count;               // blocks in the transaction
+    uint32_t home[];              // VSFS_JOURNAL_HDR_PTRS of them fit here
+} vsfs_journal_hdr_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+_Static_assert(sizeof(inode_t) == VSFS_INODE_SIZE, "inode size mismatch");
+_Static_assert(sizeof(dirent64_t) == 64, "dirent size mismatch");
+_Static_assert(sizeof(vsfs_journal_hdr_t) == 20, "journal header size mismatch");
+
+// Checksums. sb must point at a whole block. These use vsfs_crc32(), so
+// call vsfs_crc32_init() (or vsfs_open()/vsfs_format(), which do) first.
+uint32_t vsfs_superblock_crc_finalize(superblock_t *sb);
+void     vsfs_inode_crc_finalize(inode_t *ino);
+int      vsfs_inode_crc_ok(const inode_t *ino);
+void     vsfs_dirent_checksum_finalize(dirent64_t *de);
+
+// Block CRC table entry for one BS-byte block: its CRC32C, xored with the
+// CRC32C of an all-zero block so that a fresh image's table is all zeros
+// (and stays sparse). Not CRC32: a block of checksummed inodes would keep
+// the same CRC32 whatever the inodes held.
+uint32_t vsfs_block_crc(const void *block);
+
+// Where the block CRC table of the image with superblock sb (a whole
+// block 0) lives: 1 with *start and *nblocks set, 0 when the image has
+// none, -1 when the flag is set but the table does not fit the layout.
+int      vsfs_crc_table(const superblock_t *sb, uint64_t *start, uint64_t *nblocks);
+
+// The same for the reference-count region (VSFS_FLAG_REFCOUNT).
+int      vsfs_refcount_table(const superblock_t *sb, uint64_t *start, uint64_t *nblocks);
+
+// The same for the journal (VSFS_FLAG_JOURNAL). The region may not
+// overlap the other two.
+int      vsfs_journal_region(const superblock_t *sb, uint64_t *start, uint64_t *nblocks);
+
+// Why the superblock sb (a whole block 0) of an image of len bytes cannot
+// be used, or NULL: the bitmaps, inode table and data region lie inside
+// the image and each bitmap has a bit for everything it tracks, so
+// pointers into them are safe. The optional regions are checked by
+// vsfs_crc_table() and the like. The CRC is checked only when crc is
+// non-zero; a journaled superblock may be stale until replayed.
+const char *vsfs_superblock_check(const superblock_t *sb, uint64_t len, int crc);
+
+// Crash recovery for an image of len bytes at img (a writable copy or
+// private mapping) whose superblock has VSFS_FLAG_JOURNAL: copy the
+// blocks of the last committed transaction home, together with those of
+// the one before it when both slots hold consecutive transactions (its
+// home writes may not have reached the disk either). The superblock CRC
+// is not checked first: block 0 may be one of the blocks being repaired.
+// With fd >= 0 every block that differed is also written to fd, which
+// is then flushed. Returns the number of blocks that differed, or -1.
+int64_t  vsfs_journal_replay(uint8_t *img, uint64_t len, int fd);
+
+// Mark both journal slots empty, in img and, with fd >= 0, on disk. For
+// tools that rewrite an image wholesale once it has been replayed.
+int      vsfs_journal_reset(uint8_t *img, uint64_t len, int fd);
+
+// Whole data blocks a file or directory maps through direct[] and its
+// indirect blocks: none for inline data, a packed tail is not one, and a
+// compressed file maps as many as its stream needs.
+uint64_t vsfs_inode_blocks(const inode_t *ino);
+
+// ----------------- Handle API -----------------
+
+typedef struct vsfs vsfs_t;
+
+// Reason for the last failed call on this thread.
+const char *vsfs_errmsg(void);
+
+// What a handle (or one vsfs_format()) spent its time and I/O on, for
+// tools to report. Times are CLOCK_MONOTONIC nanoseconds. host_read_ns is
+// summed over the worker threads, so it can exceed total_ns; the others
+// are spent on the caller's thread. Reads through vsfs_read() and
+// vsfs_read_fd() are not counted.
+typedef struct {
+    uint64_t load_ns;         // vsfs_open(): map and check the image, set up the allocators
+    uint64_t scan_ns;         // searching the bitmaps for free inodes and blocks
+    uint64_t host_read_ns;    // reading host files (in place: copying them into the image)
+    uint64_t crc_ns;          // block CRC table updates and deduplication hashes
+    uint64_t write_ns;        // writing the image file
+    uint64_t total_ns;        // since vsfs_open(), or all of vsfs_format()
+    uint64_t bytes_read;      // from host files and the image file; the mapping is not counted
+    uint64_t bytes_written;   // to the image or output file
+    uint64_t io_calls;        // read, write, copy, splice and io_uring_enter system calls
+    uint64_t bits_scanned;    // bitmap bits examined, including the count taken at open
+    uint64_t crc_bytes;       // bytes checksummed for the above
+    uint64_t inodes_free, inodes_total;
+    uint64_t blocks_free, blocks_total;   // data region blocks
+} vsfs_stats_t;
+
+#define VSFS_JOURNAL_AUTO UINT64_MAX   // size the journal to the metadata
+
+typedef struct {
+    uint64_t size_kib;      // multiple of 4, VSFS_MIN_SIZE_KIB..VSFS_MAX_SIZE_KIB
+    uint64_t inodes;        // VSFS_MIN_INODES..VSFS_MAX_INODES
+    int      preallocate;   // reserve the disk space with posix_fallocate
+    int      block_crc;     // keep a per-block CRC table (VSFS_FLAG_BLOCK_CRC)
+    int      refcount;      // reserve a reference-count region for vsfs_set_dedup()
+    int      packed;        // inline small files, pack tails (VSFS_FLAG_PACKED)
+    uint64_t journal;       // journal blocks (VSFS_FLAG_JOURNAL): 0 for none, VSFS_JOURNAL_AUTO, or even and >= 4
+    const char *populate;   // may be NULL; manifest ("-" for stdin) or host directory of files for the root
+    vsfs_io_opts_t io;      // how a populated image is written (all zeros: the defaults)
+    vsfs_stats_t *stats;    // may be NULL; receives the counters of the format
+} vsfs_format_opts_t;
+
+// Create (or truncate) path as an empty image holding just the root
+// directory. The file is left sparse unless opts->preallocate. When sb is
+// not NULL it receives the new superblock.
+//
+// With opts->populate the root also gets files: each path listed in the
+// manifest (one per line, stored under its base name), or each regular
+// file of the directory in name order. Their layout is planned in full
+// first, each file in one run of blocks, and the image is then written
+// front to back in a single pass, with memory that grows with the number
+// of files but not with the image size. Path "-" writes the image to
+// stdout, every block included. A file is written through the I/O queue
+// of opts->io (see vsfs_io.h), a few runs of blocks in flight at once from
+// registered buffers; a stream is written in order.
+int vsfs_format(const char *path, const vsfs_format_opts_t *opts, superblock_t *sb);
+
+#define VSFS_RDONLY 0       // changes stay in memory until vsfs_sync(h, out_path)
+#define VSFS_RDWR   1       // in place: vsfs_sync(h, NULL) writes changes back to path
+#define VSFS_VIEW   2       // reading only: mapped read-only, calls that change the image fail
+
+// Open an image. The superblock magic, CRC and layout are checked. A
+// journaled image is first recovered with vsfs_journal_replay(): on disk
+// for VSFS_RDWR, only in the mapping for VSFS_RDONLY (whose output then
+// gets an empty journal) and VSFS_VIEW. No memory is reserved against the
+// image size; a VSFS_VIEW handle takes none for the image at all beyond
+// replayed blocks, so browsing any image is cheap.
+int  vsfs_open(const char *path, int flags, vsfs_t **out);
+
+// Wait for pending copies, then write the image out. The block CRC table,
+// if the image has one, is brought up to date first. A VSFS_RDWR handle
+// writes only the blocks changed since the last sync back to its own file
+// (out_path must be NULL); a VSFS_RDONLY handle writes the whole image to
+// out_path; a VSFS_VIEW handle cannot be synced. *written (may be NULL)
+// receives the number of blocks written. The handle stays open and usable.
+//
+// On a journaled image a VSFS_RDWR sync is one transaction (group commit:
+// everything since the last sync, however many files): data blocks that
+// were free before it are written in place and flushed first, then the
+// changed metadata goes to the journal, one fdatasync commits it, and it
+// is written home. A crash at any point leaves the image as of either the
+// previous sync or this one. Blocks freed since the last sync are only
+// reused after it. Fails, changing nothing on disk but the new data
+// blocks, when the metadata does not fit a journal slot; sync more often
+// or format with a larger journal.
+int  vsfs_sync(vsfs_t *h, const char *out_path, uint64_t *written);
+
+// Release the handle; changes not synced are dropped.
+void vsfs_close(vsfs_t *h);
+
+const superblock_t *vsfs_superblock(const vsfs_t *h);
+
+// Allocation. Inode numbers start at 1; block numbers are absolute. Bits
+// are only marked; the caller writes the inode (vsfs_write_inode) and
+// blocks (vsfs_write_block) itself.
+int      vsfs_alloc_inode(vsfs_t *h, uint64_t *ino);
+// n blocks into out[], all or nothing, one contiguous run when possible.
+int      vsfs_alloc_blocks(vsfs_t *h, uint64_t n, uint32_t *out);
+int      vsfs_free_inode(vsfs_t *h, uint64_t ino);
+// A shared block (see VSFS_FLAG_REFCOUNT) only loses one reference.
+int      vsfs_free_blocks(vsfs_t *h, const uint32_t *blocks, uint64_t n);
+uint64_t vsfs_free_inode_count(const vsfs_t *h);
+uint64_t vsfs_free_block_count(const vsfs_t *h);
+// Store *node as inode ino (the CRC is recomputed).
+int      vsfs_write_inode(vsfs_t *h, uint64_t ino, const inode_t *node);
+// Overwrite data block bno with BS bytes from buf.
+int      vsfs_write_block(vsfs_t *h, uint32_t bno, const void *buf);
+
+// Per-file outcomes of vsfs_add_file() and vsfs_import_tree().
+typedef enum {
+    VSFS_EV_ADDED,          // file copied in (reported by vsfs_flush, or at once when deduplicating)
+    VSFS_EV_FAILED,         // file or directory could not be added; msg says why
+    VSFS_EV_SKIPPED,        // host entry that is neither a file nor a directory
+    VSFS_EV_DIR,            // directory created or merged into by vsfs_import_tree
+} vsfs_event_kind_t;
+
+typedef struct {
+    vsfs_event_kind_t kind;
+    const char *host_path;
+    const char *name;       // entry name in the image; NULL for a failed host directory
+    uint64_t    ino;
+    uint64_t    size;
+    void       *tag;        // as passed to vsfs_add_file / vsfs_import_tree
+    const char *msg;        // FAILED / SKIPPED only: why, without host_path
+} vsfs_event_t;
+
+typedef void (*vsfs_report_fn)(void *ctx, const vsfs_event_t *ev);
+
+// Where events go (default: nowhere).
+void vsfs_set_report(vsfs_t *h, vsfs_report_fn fn, void *ctx);
+
+// Worker threads used for file copies (default 1). The image comes out
+// byte-identical whatever the count: allocation always happens on the
+// caller's thread, in call order.
+int  vsfs_set_threads(vsfs_t *h, int nthreads);
+
+// How vsfs_sync() writes the image (default: all zeros, see vsfs_io.h).
+// Runs of dirty blocks, or the whole image in 1 MiB pieces, are queued
+// with up to opts->depth in flight; with opts->direct they bypass the page
+// cache. Registered buffers are not used here: the kernel refuses to
+// register the file-backed mapping the blocks live in.
+int  vsfs_set_io(vsfs_t *h, const vsfs_io_opts_t *opts);
+
+// Deduplicate data blocks from now on (the image needs a reference-count
+// region; see vsfs_format_opts_t.refcount). Every block added by
+// vsfs_add_file(), vsfs_import_tree() or vsfs_add_data() is hashed and
+// compared with the file data blocks already in the image; an identical
+// block is shared instead of stored again. Files are then read and
+// committed on the caller's thread, one at a time.
+int  vsfs_set_dedup(vsfs_t *h, int on);
+
+// Data blocks offered by deduplicating adds so far, and how many of them
+// were shared rather than stored (and written).
+void vsfs_dedup_stats(const vsfs_t *h, uint64_t *blocks, uint64_t *shared);
+
+// Compress files larger than a block from now on (VSFS_INO_COMPRESSED).
+// vsfs_add_file() and vsfs_import_tree() copies are read and compressed
+// on the worker threads; their files are committed by vsfs_flush() (or
+// when enough compressed data is waiting), so lookups only find them
+// after that. A file is stored compressed only when that saves at least
+// one block. Deduplicating adds are not compressed.
+int  vsfs_set_compress(vsfs_t *h, int on);
+
+// Data blocks the files offered to compression so far would have taken,
+// and how many they were stored in.
+void vsfs_compress_stats(const vsfs_t *h, uint64_t *blocks, uint64_t *stored);
+
+// Counters of the handle since vsfs_open(); copies still queued are
+// counted once vsfs_flush() has collected them.
+void vsfs_stats(const vsfs_t *h, vsfs_stats_t *out);
+
+// Render st as one "Stats: ..." line of text, or with json as a single
+// JSON object (keys as in vsfs_stats_t, plus "tool" naming the reporting
+// program), without a newline. Returns what snprintf() would.
+int  vsfs_stats_format(const vsfs_stats_t *st, const char *tool, int json, char *buf, size_t cap);
+
+// Create directory name in directory parent, or reuse the existing
+// directory of that name. *ino (may be NULL) receives its inode number.
+int  vsfs_mkdir(vsfs_t *h, uint64_t parent, const char *name, uint64_t *ino);
+
+// Add host file host_path to directory dir as name (at most VSFS_NAME_MAX
+// bytes are kept). Everything but the data copy happens now; the copy
+// runs on the worker threads and its outcome is reported by vsfs_flush()
+// as VSFS_EV_ADDED or VSFS_EV_FAILED (a failed copy is rolled back).
+// A file to be compressed is committed after its copy instead (see
+// vsfs_set_compress()). Returns -1 without queueing anything when the
+// file cannot be added.
+int  vsfs_add_file(vsfs_t *h, uint64_t dir, const char *name, const char *host_path, void *tag);
+
+// Add len bytes from data as file name in directory dir, synchronously.
+int  vsfs_add_data(vsfs_t *h, uint64_t dir, const char *name, const void *data, uint64_t len, uint64_t *ino);
+
+// Give file name in directory dir the contents of host file host_path,
+// keeping its inode. Blocks are compared with what the file holds and only
+// those that differ are written (to a new block when another file shares
+// the old one, or when a journaled image's last sync still uses it); the
+// file then grows or shrinks at its end. The result is neither compressed
+// nor deduplicated. *changed (may be NULL) receives the number of blocks
+// written. Queued copies are flushed first.
+int  vsfs_replace_file(vsfs_t *h, uint64_t dir, const char *name, const char *host_path, uint64_t *changed);
+
+// Delete file name from directory dir, freeing its inode and blocks (on a
+// journaled image, blocks the last sync still uses stay allocated until
+// the next one). Directories cannot be removed. Queued copies are flushed
+// first.
+int  vsfs_remove(vsfs_t *h, uint64_t dir, const char *name);
+
+// Copy the contents of host directory host_dir into directory dir:
+// regular files and subdirectories (recursively, in name order); anything
+// else is reported as VSFS_EV_SKIPPED. Every failure, host_dir itself
+// included, is reported as a VSFS_EV_FAILED event and the walk carries on
+// with the next entry. File copies are queued as with vsfs_add_file().
+// Returns 0, or -1 if anything failed.
+int  vsfs_import_tree(vsfs_t *h, uint64_t dir, const char *host_dir, void *tag);
+
+// Wait for all queued copies and report their outcomes. Returns the
+// number of copies that failed.
+uint64_t vsfs_flush(vsfs_t *h);
+
+// Look name up in directory dir: 0 and *ino when found, 1 when not, -1 on
+// error.
+int  vsfs_lookup(vsfs_t *h, uint64_t dir, const char *name, uint64_t *ino);
+
+// Resolve a '/'-separated path from the root; same returns as vsfs_lookup.
+int  vsfs_resolve(vsfs_t *h, const char *path, uint64_t *ino);
+
+// Copy of inode ino, after checking its CRC.
+int  vsfs_stat(vsfs_t *h, uint64_t ino, inode_t *out);
+
+// Call fn for every entry of directory dir except "." and "..". A non-zero
+// return from fn stops the walk and is returned.
+typedef int (*vsfs_dirent_fn)(void *ctx, const dirent64_t *de);
+int  vsfs_readdir(vsfs_t *h, uint64_t dir, vsfs_dirent_fn fn, void *ctx);
+
+// Copy up to len bytes of file ino from offset off into buf. Returns the
+// number of bytes copied (0 at end of file) or -1.
+int64_t vsfs_read(vsfs_t *h, uint64_t ino, uint64_t off, void *buf, uint64_t len);
+
+// Write the whole of file ino to fd, with sendfile where possible.
+int  vsfs_read_fd(vsfs_t *h, uint64_t ino, int fd);
+
+#endif
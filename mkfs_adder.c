@@ -1,342 +1,321 @@
+// Build: make mkfs_adder   (links libminivsfs.a)
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE             // getline
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
-#include <errno.h>
-#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
-#pragma pack(push, 1)
+#include "minivsfs.h"
 
 typedef struct {
-    // CREATE YOUR SUPERBLOCK HERE
-    // ADD ALL FIELDS AS PROVIDED BY THE SPECIFICATION
-    uint32_t magic;               
-    uint32_t version;             
-    uint32_t block_size;          
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;          
-    uint64_t mtime_epoch;        
-    uint32_t flags;            
-    uint32_t checksum;           
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+    uint64_t files, dirs, bytes, failed;   // files and bytes are counted once copied
+} import_stats_t;
 
-#pragma pack(push,1)
-typedef struct {
-    // CREATE YOUR INODE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[12];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-    uint64_t inode_crc;   
-
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
-typedef struct {
-    // CREATE YOUR DIRECTORY ENTRY STRUCTURE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-    uint32_t inode_no;            
-    uint8_t  type;               
-    char     name[58];
-    uint8_t  checksum; 
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+// Report callback. --dir entries carry their import_stats_t as the tag;
+// --file entries carry none and are reported one by one, their failures
+// counted in *ctx.
+static void report_event(void *ctx, const vsfs_event_t *ev) {
+    size_t *file_failed = (size_t*)ctx;
+    import_stats_t *st = (import_stats_t*)ev->tag;
+    switch (ev->kind) {
+    case VSFS_EV_ADDED:
+        if (st) {
+            st->files++;
+            st->bytes += ev->size;
+        } else {
+            fprintf(stderr, "OK: added '%s' as inode=%" PRIu64 " (%" PRIu64 " bytes)\n", ev->name, ev->ino, ev->size);
+        }
+        break;
+    case VSFS_EV_FAILED:
+        fprintf(stderr, "Error: %s: %s\n", ev->host_path, ev->msg);
+        if (st) st->failed++;
+        else    (*file_failed)++;
+        break;
+    case VSFS_EV_SKIPPED:
+        fprintf(stderr, "Warning: %s: %s, skipped\n", ev->host_path, ev->msg);
+        break;
+    case VSFS_EV_DIR:
+        if (st) st->dirs++;
+        break;
     }
 }
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-// ====================================CRC32====================================
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
+// Add one host file into the root directory under its base name. The
+// payload copy is queued; its outcome arrives through report_event().
+static int add_file(vsfs_t *h, const char *file_path) {
+    // place just the base name, truncate to 58 bytes if needed
+    const char *slash = strrchr(file_path, '/');
+    const char *base = slash ? slash + 1 : file_path;
+    if (*base == '\0') {
+        fprintf(stderr, "Error: %s: no file name\n", file_path);
+        return 1;
+    }
+    if (vsfs_add_file(h, VSFS_ROOT_INO, base, file_path, NULL) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", file_path, vsfs_errmsg());
+        return 1;
+    }
+    return 0;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+// Give the root entry named after host file file_path its new contents.
+// Only the blocks that differ are written.
+static int replace_file(vsfs_t *h, const char *file_path) {
+    const char *slash = strrchr(file_path, '/');
+    const char *base = slash ? slash + 1 : file_path;
+    uint64_t changed, ino;
+    inode_t node;
+    if (*base == '\0') {
+        fprintf(stderr, "Error: %s: no file name\n", file_path);
+        return 1;
+    }
+    if (vsfs_replace_file(h, VSFS_ROOT_INO, base, file_path, &changed) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", file_path, vsfs_errmsg());
+        return 1;
+    }
+    if (vsfs_lookup(h, VSFS_ROOT_INO, base, &ino) != 0 || vsfs_stat(h, ino, &node) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", file_path, vsfs_errmsg());
+        return 1;
+    }
+    // A tail fragment or inline data counts as a block of its own.
+    uint64_t blocks = vsfs_inode_blocks(&node) + ((node.reserved_2 & (VSFS_INO_TAIL | VSFS_INO_INLINE)) != 0);
+    fprintf(stderr, "OK: replaced '%s' as inode=%" PRIu64 " (%" PRIu64 " bytes, %" PRIu64 " of %" PRIu64 " blocks rewritten)\n",
+            base, ino, node.size_bytes, changed, blocks);
+    return 0;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   
-    de->checksum = x;
+// Append every non-empty line of the list file (or stdin for "-") to *files.
+static int read_manifest(const char *path, char ***files, size_t *nfiles, size_t *cap) {
+    FILE *fm = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!fm) { 
+        perror("fopen manifest"); 
+        return 1; 
+    }
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &linecap, fm)) >= 0) {
+        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) line[--n] = '\0';
+        if (n == 0) continue;
+        if (*nfiles == *cap) {
+            size_t ncap = *cap ? *cap * 2 : 16;
+            char **nf = (char**)realloc(*files, ncap * sizeof(char*));
+            if (!nf) { 
+                fprintf(stderr, "Error: OOM\n"); 
+                free(line); 
+                if (fm != stdin) fclose(fm); 
+                return 1; 
+            }
+            *files = nf;
+            *cap = ncap;
+        }
+        char *dup = strdup(line);
+        if (!dup) { 
+            fprintf(stderr, "Error: OOM\n"); 
+            free(line); 
+            if (fm != stdin) fclose(fm); 
+            return 1; 
+        }
+        (*files)[(*nfiles)++] = dup;
+    }
+    free(line);
+    if (fm != stdin) fclose(fm);
+    return 0;
 }
 
-// ----------------- Simple bitmap helpers (beginner‑friendly macros) -----------------
-#define BIT_SET(bm, bit)   ((bm)[(bit)>>3] |=  (uint8_t)(1u << ((bit)&7)))
-#define BIT_TEST(bm, bit)  ((((bm)[(bit)>>3] >> ((bit)&7)) & 1u))
-
 int main(int argc, char **argv) {
-    crc32_init();
-    // WRITE YOUR DRIVER CODE HERE
-    // PARSE YOUR CLI PARAMETERS
-    // THEN ADD THE SPECIFIED FILE TO YOUR FILE SYSTEM
-    // UPDATE THE .IMG FILE ON DISK
-
-    const char *in_path = NULL, *out_path = NULL, *file_path = NULL;
+    const char *in_path = NULL, *out_path = NULL;
+    char **files = NULL;
+    size_t nfiles = 0, cap = 0;
+    const char **dirs = NULL;
+    size_t ndirs = 0;
+    const char **edits = NULL;   // --replace paths and --delete names, in order
+    int *is_delete = NULL;
+    size_t nedits = 0;
+    int in_place = 0, dedup = 0, compress = 0;
+    int stats = 0;          // 1: text, 2: JSON
+    vsfs_io_opts_t io = { VSFS_IO_AUTO, 0, 0 };
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > 8) nthreads = 8;
+    int rc = 0;
 
-    // Simple CLI parsing
-    for (int i = 1; i < argc; i++) {
+    // Simple CLI parsing. --file and --dir may repeat; --manifest reads one path per line ("-" = stdin).
+    for (int i = 1; i < argc && rc == 0; i++) {
         if (strcmp(argv[i], "--input") == 0 && i+1 < argc)   in_path  = argv[++i];
         else if (strcmp(argv[i], "--output") == 0 && i+1 < argc) out_path = argv[++i];
-        else if (strcmp(argv[i], "--file") == 0 && i+1 < argc)   file_path= argv[++i];
+        else if (strcmp(argv[i], "--in-place") == 0)             in_place = 1;
+        else if (strcmp(argv[i], "--dedup") == 0)                dedup = 1;
+        else if (strcmp(argv[i], "--compress") == 0)             compress = 1;
+        else if (strcmp(argv[i], "--io") == 0 && i+1 < argc && vsfs_io_parse_kind(argv[i+1], &io.kind) == 0) i++;
+        else if (strcmp(argv[i], "--direct") == 0)               io.direct = 1;
+        else if (strcmp(argv[i], "--io-depth") == 0 && i+1 < argc) {
+            if (vsfs_io_parse_depth(argv[++i], &io.depth) != 0) {
+                fprintf(stderr, "Error: --io-depth must be between 1 and %d\n", VSFS_IO_DEPTH_MAX);
+                rc = 2;
+            }
+        }
+        else if (strcmp(argv[i], "--stats") == 0)                stats = 1;
+        else if (strcmp(argv[i], "--stats=json") == 0)           stats = 2;
+        else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            char *end;
+            nthreads = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || nthreads < 1 || nthreads > 256) {
+                fprintf(stderr, "Error: --threads must be between 1 and 256\n");
+                rc = 2;
+            }
+        }
+        else if (strcmp(argv[i], "--file") == 0 && i+1 < argc) {
+            if (nfiles == cap) {
+                size_t ncap = cap ? cap * 2 : 16;
+                char **nf = (char**)realloc(files, ncap * sizeof(char*));
+                if (!nf) { fprintf(stderr, "Error: OOM\n"); rc = 1; break; }
+                files = nf;
+                cap = ncap;
+            }
+            files[nfiles] = strdup(argv[++i]);
+            if (!files[nfiles]) { fprintf(stderr, "Error: OOM\n"); rc = 1; break; }
+            nfiles++;
+        }
+        else if (strcmp(argv[i], "--manifest") == 0 && i+1 < argc) rc = read_manifest(argv[++i], &files, &nfiles, &cap);
+        else if (strcmp(argv[i], "--dir") == 0 && i+1 < argc) {
+            const char **nd = (const char**)realloc(dirs, (ndirs + 1) * sizeof(char*));
+            if (!nd) { fprintf(stderr, "Error: OOM\n"); rc = 1; break; }
+            dirs = nd;
+            dirs[ndirs++] = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--replace") == 0 || strcmp(argv[i], "--delete") == 0) && i+1 < argc) {
+            const char **ne = (const char**)realloc(edits, (nedits + 1) * sizeof(char*));
+            int *nd = ne ? (int*)realloc(is_delete, (nedits + 1) * sizeof(int)) : NULL;
+            if (ne) edits = ne;
+            if (!nd) { fprintf(stderr, "Error: OOM\n"); rc = 1; break; }
+            is_delete = nd;
+            is_delete[nedits] = strcmp(argv[i], "--delete") == 0;
+            edits[nedits++] = argv[++i];
+        }
         else {
-            fprintf(stderr, "Usage: %s --input in.img --output out.img --file <path>\n", argv[0]);
-            return 2;
+            fprintf(stderr, "Usage: %s --input in.img (--output out.img | --in-place) (--file <path>)... [--manifest <list|->] [--dir <host_dir>]... [--replace <path>]... [--delete <name>]... [--threads N] [--dedup] [--compress] [--io auto|psync|uring] [--io-depth N] [--direct] [--stats[=json]]\n", argv[0]);
+            rc = 2;
         }
     }
-    if (!in_path || !out_path || !file_path) { fprintf(stderr, "Error: all three flags are required\n"); return 2; }
-
-    // Read input image fully into memory
-    FILE *fi = fopen(in_path, "rb");
-    if (!fi) { 
-        perror("fopen input"); 
-        return 1; 
-    }
-    if (fseek(fi, 0, SEEK_END) != 0) { 
-        perror("fseek"); 
-        fclose(fi); 
-        return 1; 
-    }
-    long long flen = ftell(fi);
-    if (flen < 0) { 
-        perror("ftell"); fclose(fi); return 1; 
-    }
-    if (fseek(fi, 0, SEEK_SET) != 0) { 
-        perror("fseek"); 
-        fclose(fi); 
-        return 1; 
-    }
-    uint8_t *img = (uint8_t*)malloc((size_t)flen);
-    if (!img) { 
-        fclose(fi); 
-        fprintf(stderr, "Error: OOM\n"); 
-        return 1; 
+    if (rc == 0 && (!in_path || (!out_path && !in_place) || (nfiles == 0 && ndirs == 0 && nedits == 0))) { 
+        fprintf(stderr, "Error: --input, --output (or --in-place) and at least one --file, --manifest entry, --dir, --replace or --delete are required\n"); 
+        rc = 2; 
     }
-    if (fread(img, 1, (size_t)flen, fi) != (size_t)flen) { 
-        perror("fread"); 
-        fclose(fi); 
-        free(img); 
-        return 1; 
+    if (rc == 0 && dedup && compress) {
+        fprintf(stderr, "Error: --dedup and --compress cannot be combined (deduplicating adds are not compressed)\n");
+        rc = 2;
     }
-    fclose(fi);
-
-    // Parse superblock
-    if ((size_t)flen < BS) { 
-        free(img); 
-        fprintf(stderr, "Error: image too small\n"); 
-        return 1; 
+    // Writing the output over the mapped input would truncate it under us;
+    // treat an output that is the input file as an in-place update.
+    if (rc == 0 && out_path && !in_place) {
+        struct stat si, so;
+        if (stat(in_path, &si) == 0 && stat(out_path, &so) == 0 && si.st_dev == so.st_dev && si.st_ino == so.st_ino)
+            in_place = 1;
     }
-    superblock_t *sb = (superblock_t*)(img + 0);
-    if (sb->magic != 0x4D565346u || sb->version != 1u || sb->block_size != BS) {
-        free(img); 
-        fprintf(stderr, "Error: not a MiniVSFS image\n"); 
-        return 1; 
+    if (rc == 0 && in_place && out_path) {
+        struct stat si, so;
+        if (stat(in_path, &si) != 0 || stat(out_path, &so) != 0 || si.st_dev != so.st_dev || si.st_ino != so.st_ino) {
+            fprintf(stderr, "Error: --in-place updates --input; --output must be omitted or name the same file\n");
+            rc = 2;
+        }
     }
-    uint64_t total_blocks = sb->total_blocks;
-    if ((uint64_t)flen != total_blocks * (uint64_t)BS) {
-        free(img); 
-        fprintf(stderr, "Error: image length and superblock disagree\n"); 
-        return 1; }
-
-    // Map important regions
-    uint8_t *ibm = img + sb->inode_bitmap_start * BS;
-    uint8_t *dbm = img + sb->data_bitmap_start  * BS;
-    inode_t *itab = (inode_t*)(img + sb->inode_table_start * BS);
+    if (!out_path) out_path = in_path;
 
-    // Open the host file to add
-    FILE *ff = fopen(file_path, "rb");
-    if (!ff) { 
-        perror("fopen file"); 
-        free(img); 
-        return 1; 
+    vsfs_t *h = NULL;
+    if (rc == 0 && vsfs_open(in_path, in_place ? VSFS_RDWR : VSFS_RDONLY, &h) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", in_path, vsfs_errmsg());
+        rc = 1;
     }
-    if (fseek(ff, 0, SEEK_END) != 0) { 
-        perror("fseek file"); 
-        fclose(ff); 
-        free(img); 
-        return 1; 
+    if (rc == 0 && dedup && vsfs_set_dedup(h, 1) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", in_path, vsfs_errmsg());
+        vsfs_close(h);
+        rc = 1;
     }
-    long long fsize_ll = ftell(ff);
-    if (fsize_ll < 0) { 
-        perror("ftell file"); 
-        fclose(ff); 
-        free(img); 
-        return 1; 
-    }
-    if (fseek(ff, 0, SEEK_SET) != 0) { 
-        perror("fseek file 2"); 
-        fclose(ff); 
-        free(img); 
-        return 1; 
-    }
-    uint64_t fsize = (uint64_t)fsize_ll;
-
-    uint64_t need_blocks = (fsize + BS - 1) / BS;
-    if (need_blocks == 0) need_blocks = 1;
-    if (need_blocks > DIRECT_MAX) {
-        fprintf(stderr, "Error: file too big for MiniVSFS (needs %" PRIu64 " blocks, max %d)\n", need_blocks, DIRECT_MAX);
-        fclose(ff); 
-        free(img); 
-        return 1;
-    }
-
-    // Find a free inode (first-fit)
-    uint64_t inum = 0;
-    for (uint64_t i = 0; i < sb->inode_count; i++) {
-        if (!BIT_TEST(ibm, i)) { 
-            inum = i + 1; 
-            BIT_SET(ibm, i); 
-            break; 
+    if (rc == 0) {
+        // Open once, add everything, write once. A file that fails is
+        // reported and skipped; the rest of the batch still goes in.
+        import_stats_t *dst = (import_stats_t*)calloc(ndirs ? ndirs : 1, sizeof(import_stats_t));
+        if (!dst) { 
+            fprintf(stderr, "Error: OOM\n"); 
+            vsfs_close(h); 
+            return 1; 
         }
-    }
-    if (inum == 0) { 
-        fclose(ff); 
-        free(img); 
-        fprintf(stderr, "Error: no free inode\n"); 
-        return 1; 
-    }
-
-    // Find free data blocks (first-fit)
-    uint32_t direct[DIRECT_MAX] = {0};
-    uint64_t found = 0;
-    for (uint64_t i = 0; i < sb->data_region_blocks && found < need_blocks; i++) {
-        if (!BIT_TEST(dbm, i)) {
-            BIT_SET(dbm, i);
-            direct[found++] = (uint32_t)(sb->data_region_start + i); 
+        size_t added = 0, file_failed = 0;
+        vsfs_set_report(h, report_event, &file_failed);
+        vsfs_set_threads(h, (int)nthreads);
+        vsfs_set_compress(h, compress);
+        vsfs_set_io(h, &io);
+        if (io.kind == VSFS_IO_URING && !vsfs_io_uring_available(io.depth))
+            fprintf(stderr, "Warning: io_uring is not available here, using pread/pwrite\n");
+        // Replaces and deletes go first, so a name deleted can be added again.
+        int edit_failed = 0;
+        for (size_t k = 0; k < nedits; k++) {
+            if (!is_delete[k]) {
+                if (replace_file(h, edits[k]) != 0) edit_failed = 1;
+            } else if (vsfs_remove(h, VSFS_ROOT_INO, edits[k]) != 0) {
+                fprintf(stderr, "Error: %s: %s\n", edits[k], vsfs_errmsg());
+                edit_failed = 1;
+            } else {
+                fprintf(stderr, "OK: deleted '%s'\n", edits[k]);
+            }
         }
-    }
-    if (found < need_blocks) { 
-        fclose(ff); 
-        free(img); 
-        fprintf(stderr, "Error: not enough free data blocks\n"); 
-        return 1; }
-
-    // Write file data into the newly allocated blocks
-    for (uint64_t k = 0; k < need_blocks; k++) {
-        uint8_t *blk = img + (uint64_t)direct[k] * BS;
-        size_t to_read = (size_t)((k + 1 < need_blocks) ? BS : (fsize - k * BS));
-        if (to_read == 0) to_read = BS;
-        size_t nr = fread(blk, 1, to_read, ff);
-        if (nr != to_read) { 
-            perror("fread payload"); 
-            fclose(ff); 
-            free(img); 
-            return 1; 
+        for (size_t k = 0; k < nfiles; k++) 
+            if (add_file(h, files[k]) == 0) added++;
+        for (size_t k = 0; k < ndirs; k++)
+            vsfs_import_tree(h, VSFS_ROOT_INO, dirs[k], &dst[k]);
+        vsfs_flush(h);
+        added -= file_failed;
+        int dir_failed = 0;
+        for (size_t k = 0; k < ndirs; k++) {
+            const import_stats_t *st = &dst[k];
+            fprintf(stderr, "%s: imported %" PRIu64 " files (%" PRIu64 " bytes) and %" PRIu64 " directories from %s",
+                    st->failed ? "Error" : "OK", st->files, st->bytes, st->dirs, dirs[k]);
+            if (st->failed) fprintf(stderr, ", %" PRIu64 " failed", st->failed);
+            fputc('\n', stderr);
+            if (st->failed) dir_failed = 1;
         }
-        if (to_read < BS) memset(blk + to_read, 0, BS - to_read);
-    }
-    fclose(ff);
-
-    // Create the new inode
-    inode_t node; memset(&node, 0, sizeof(node));
-    node.mode  = 0100000;  
-    node.links = 1;
-    node.uid = node.gid = 0;
-    node.size_bytes = fsize;
-    node.atime = node.mtime = node.ctime = (uint64_t)time(NULL);
-    node.proj_id = 6;
-    for (uint64_t k = 0; k < need_blocks; k++) node.direct[k] = direct[k];
-    inode_crc_finalize(&node);
-    itab[inum - 1] = node;
-
-    // Add a directory entry into root
-    inode_t *root = &itab[ROOT_INO - 1];
-    if (root->direct[0] == 0) { free(img); fprintf(stderr, "Error: corrupt FS (root has no block)\n"); return 1; }
-    uint8_t *rblk = img + (uint64_t)root->direct[0] * BS;
-    size_t max_entries = BS / sizeof(dirent64_t); 
-    size_t pos = 0;
-    for (; pos < max_entries; pos++) {
-        dirent64_t *de = (dirent64_t*)(rblk + pos * sizeof(dirent64_t));
-        if (de->inode_no == 0) break;
-    }
-    if (pos == max_entries) { free(img); fprintf(stderr, "Error: root directory full\n"); return 1; }
-
-    dirent64_t de; memset(&de, 0, sizeof(de));
-    de.inode_no = (uint32_t)inum;
-    de.type = 1;
-    // place just the base name, truncate to 58 bytes if needed
-    const char *slash = strrchr(file_path, '/');
-    const char *base = slash ? slash + 1 : file_path;
-    strncpy(de.name, base, sizeof(de.name));
-    dirent_checksum_finalize(&de);
-    memcpy(rblk + pos * sizeof(dirent64_t), &de, sizeof(de));
-
-    // Update root metadata
-    if (root->links < 0xFFFF) root->links++;
-    root->mtime = (uint64_t)time(NULL);
-    inode_crc_finalize(root);
-
-    // Save to output
-    FILE *fo = fopen(out_path, "wb");
-    if (!fo) { perror("fopen output"); 
-        free(img); 
-        return 1; 
-    }
-    size_t nw = fwrite(img, 1, (size_t)flen, fo);
-    if (nw != (size_t)flen) { perror("fwrite output"); 
-        fclose(fo); free(img); 
-        return 1; 
+        free(dst);
+        if (dedup) {
+            uint64_t blocks, shared;
+            vsfs_dedup_stats(h, &blocks, &shared);
+            fprintf(stderr, "OK: dedup shared %" PRIu64 " of %" PRIu64 " data blocks (%" PRIu64 " KiB not stored or written)\n",
+                    shared, blocks, shared * (VSFS_BS / 1024));
+        }
+        if (compress) {
+            uint64_t blocks, stored;
+            vsfs_compress_stats(h, &blocks, &stored);
+            fprintf(stderr, "OK: compressed %" PRIu64 " data blocks into %" PRIu64 " (%.1f%%)\n",
+                    blocks, stored, blocks ? 100.0 * (double)stored / (double)blocks : 100.0);
+        }
+        uint64_t written = 0;
+        if (vsfs_sync(h, in_place ? NULL : out_path, &written) != 0) {
+            fprintf(stderr, "Error: %s: %s\n", out_path, vsfs_errmsg());
+            rc = 1;
+        }
+        else if (added != nfiles || dir_failed || edit_failed) rc = 1;
+        if (nfiles > 1 || added != nfiles)
+            fprintf(stderr, "%s: added %zu/%zu files -> %s\n", added == nfiles ? "OK" : "Error", added, nfiles, out_path);
+        if (in_place)
+            fprintf(stderr, "%s: wrote %" PRIu64 " of %" PRIu64 " blocks in place\n", rc == 0 ? "OK" : "Error",
+                    written, vsfs_superblock(h)->total_blocks);
+        if (stats) {
+            vsfs_stats_t st;
+            char line[1024];
+            vsfs_stats(h, &st);
+            vsfs_stats_format(&st, "mkfs_adder", stats == 2, line, sizeof(line));
+            fprintf(stats == 2 ? stdout : stderr, "%s\n", line);
+        }
+        vsfs_close(h);
     }
-    fclose(fo);
-    free(img);
 
-    fprintf(stderr, "OK: added '%s' as inode=%" PRIu64 " (%" PRIu64 " bytes) -> %s\n", base, inum, fsize, out_path);
-    return 0;
+    for (size_t k = 0; k < nfiles; k++) free(files[k]);
+    free(files);
+    free(dirs);
+    free(edits);
+    free(is_delete);
+    return rc;
 }
@@ -0,0 +1,403 @@
+// Build: make mkfs_defrag   (links libminivsfs.a)
+//
+// Offline defragmenter for MiniVSFS images. Every block referenced by an
+// inode is moved so that each file's blocks are contiguous and in logical
+// order (pointer blocks just ahead of the data they map), files follow
+// each other in inode order, and all free space ends up as a single run
+// at the end of the data region.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE         // MAP_NORESERVE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "vsfs_crc32.h"
+
+#define BS VSFS_BS
+#define INODE_SIZE VSFS_INODE_SIZE
+#define ROOT_INO VSFS_ROOT_INO
+#define DIRECT_MAX VSFS_DIRECT_MAX
+#define PTRS_PER_BLOCK VSFS_PTRS_PER_BLOCK
+#define NO_BLOCK UINT32_MAX
+
+#define BIT_SET(bm, bit)   ((bm)[(bit)>>3] |=  (uint8_t)(1u << ((bit)&7)))
+#define BIT_TEST(bm, bit)  ((((bm)[(bit)>>3] >> ((bit)&7)) & 1u))
+
+#define S_IFMT_  VSFS_S_IFMT
+#define S_IFDIR_ VSFS_S_IFDIR
+#define S_IFREG_ VSFS_S_IFREG
+
+// Whole data blocks an inode maps (see vsfs_inode_blocks()).
+static uint64_t inode_nblocks(const inode_t *ino) {
+    if ((ino->mode & S_IFMT_) == S_IFREG_ || (ino->mode & S_IFMT_) == S_IFDIR_) return vsfs_inode_blocks(ino);
+    return 0;
+}
+
+// Whether ino keeps a packed tail in a fragment block.
+static int has_tail(const inode_t *ino) {
+    return (ino->mode & S_IFMT_) == S_IFREG_ && (ino->reserved_2 & VSFS_INO_TAIL);
+}
+
+// Visit every block pointer an inode owns in on-disk layout order:
+// direct[], then the single indirect block followed by its entries, then
+// the double indirect block followed by each leaf and the leaf's entries.
+// fn may rewrite *ptr; pointer blocks are read through the updated value,
+// so a remap pass finds each indirect block at its new home. fn sees a
+// pointer before the walk dereferences it, so it can reject bad ones; a
+// non-zero return stops the walk and is passed back.
+typedef int (*ptr_fn)(void *ctx, uint32_t *ptr);
+static int inode_walk(uint8_t *img, inode_t *ino, ptr_fn fn, void *ctx) {
+    uint64_t n = inode_nblocks(ino);
+    int rc;
+    for (uint64_t k = 0; k < n && k < DIRECT_MAX; k++)
+        if ((rc = fn(ctx, &ino->direct[k])) != 0) return rc;
+    if (n <= DIRECT_MAX) return 0;
+    n -= DIRECT_MAX;
+
+    if ((rc = fn(ctx, &ino->reserved_0)) != 0) return rc;
+    uint32_t *ind = (uint32_t*)(img + (uint64_t)ino->reserved_0 * BS);
+    for (uint64_t k = 0; k < n && k < PTRS_PER_BLOCK; k++)
+        if ((rc = fn(ctx, &ind[k])) != 0) return rc;
+    if (n <= PTRS_PER_BLOCK) return 0;
+    n -= PTRS_PER_BLOCK;
+
+    if ((rc = fn(ctx, &ino->reserved_1)) != 0) return rc;
+    uint32_t *dind = (uint32_t*)(img + (uint64_t)ino->reserved_1 * BS);
+    for (uint64_t l = 0; l * PTRS_PER_BLOCK < n; l++) {
+        if ((rc = fn(ctx, &dind[l])) != 0) return rc;
+        uint32_t *leaf = (uint32_t*)(img + (uint64_t)dind[l] * BS);
+        for (uint64_t k = 0; k < PTRS_PER_BLOCK && l * PTRS_PER_BLOCK + k < n; k++)
+            if ((rc = fn(ctx, &leaf[k])) != 0) return rc;
+    }
+    return 0;
+}
+
+typedef struct {
+    uint64_t files;        // inodes that own at least one block
+    uint64_t fragmented;   // of those, how many are not one contiguous run
+    uint64_t extents;      // total contiguous runs across all files
+    uint64_t free_runs;    // runs of free blocks in the data region
+    uint64_t free_blocks;
+} frag_stats_t;
+
+typedef struct {
+    uint64_t prev;
+    uint64_t runs;
+} extent_count_t;
+
+static int count_extents(void *ctx, uint32_t *ptr) {
+    extent_count_t *ec = (extent_count_t*)ctx;
+    if (ec->runs == 0 || *ptr != ec->prev + 1) ec->runs++;
+    ec->prev = *ptr;
+    return 0;
+}
+
+static void frag_measure(uint8_t *img, const superblock_t *sb, const uint8_t *dbm, inode_t *itab,
+                         const uint8_t *ibm, frag_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    for (uint64_t i = 0; i < sb->inode_count; i++) {
+        if (!BIT_TEST(ibm, i)) continue;
+        extent_count_t ec = { 0, 0 };
+        inode_walk(img, &itab[i], count_extents, &ec);
+        if (ec.runs == 0) continue;
+        st->files++;
+        st->extents += ec.runs;
+        if (ec.runs > 1) st->fragmented++;
+    }
+    int in_run = 0;
+    for (uint64_t b = 0; b < sb->data_region_blocks; b++) {
+        if (BIT_TEST(dbm, b)) { in_run = 0; continue; }
+        st->free_blocks++;
+        if (!in_run) st->free_runs++;
+        in_run = 1;
+    }
+}
+
+// Planning pass: check each pointer and give the block its new slot.
+// map[old] = new, both relative to the data region.
+typedef struct {
+    const superblock_t *sb;
+    const uint8_t      *dbm;
+    uint32_t           *map;
+    uint64_t            next;
+    uint32_t           *bad;
+} plan_t;
+
+static int plan_block(void *ctx, uint32_t *ptr) {
+    plan_t *pl = (plan_t*)ctx;
+    uint64_t blk = *ptr, dstart = pl->sb->data_region_start;
+    if (blk < dstart || blk >= dstart + pl->sb->data_region_blocks || !BIT_TEST(pl->dbm, blk - dstart)) {
+        *pl->bad = *ptr;
+        return 1;
+    }
+    if (pl->map[blk - dstart] == NO_BLOCK) pl->map[blk - dstart] = (uint32_t)pl->next++;
+    return 0;
+}
+
+static int remap_block(void *ctx, uint32_t *ptr) {
+    plan_t *pl = (plan_t*)ctx;
+    *ptr = (uint32_t)(pl->sb->data_region_start + pl->map[*ptr - pl->sb->data_region_start]);
+    return 0;
+}
+
+static void frag_print(const char *when, const frag_stats_t *st) {
+    fprintf(stderr, "%s: files=%" PRIu64 " fragmented=%" PRIu64 " extents=%" PRIu64 " (%.2f per file)"
+            "  free=%" PRIu64 " blocks in %" PRIu64 " runs\n",
+            when, st->files, st->fragmented, st->extents,
+            st->files ? (double)st->extents / (double)st->files : 0.0,
+            st->free_blocks, st->free_runs);
+}
+
+static const uint8_t zero_block[BS];
+
+// Write the nblocks-block image at img to fd, which is already sized to
+// it: runs of non-zero blocks go out with pwrite and zero blocks are left
+// as holes, so the output stays as sparse as the image is. 0, or -1 with
+// errno set.
+static int write_sparse(int fd, const uint8_t *img, uint64_t nblocks) {
+    uint64_t b = 0;
+    while (b < nblocks) {
+        if (memcmp(img + b * BS, zero_block, BS) == 0) { b++; continue; }
+        uint64_t end = b + 1;
+        while (end < nblocks && end - b < 256 && memcmp(img + end * BS, zero_block, BS) != 0) end++;
+        const uint8_t *p = img + b * BS;
+        size_t len = (size_t)((end - b) * BS);
+        off_t off = (off_t)(b * BS);
+        while (len > 0) {
+            ssize_t nw = pwrite(fd, p, len, off);
+            if (nw < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            p += nw; off += nw; len -= (size_t)nw;
+        }
+        b = end;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    vsfs_crc32_init();
+
+    const char *in_path = NULL, *out_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--input") == 0 && i+1 < argc)        in_path  = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0 && i+1 < argc)  out_path = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s --input in.img --output out.img\n", argv[0]);
+            return 2;
+        }
+    }
+    if (!in_path || !out_path) { fprintf(stderr, "Error: --input and --output are required\n"); return 2; }
+
+    // Map the input privately: relocation happens in the mapping and only
+    // the pages that change are copied, whatever the image size. No memory
+    // is reserved against that size, so images larger than RAM map too.
+    int fd = open(in_path, O_RDONLY);
+    if (fd < 0) {
+        perror("open input");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return 1;
+    }
+    if ((uint64_t)st.st_size < BS) {
+        close(fd);
+        fprintf(stderr, "Error: image too small\n");
+        return 1;
+    }
+    const size_t flen = (size_t)st.st_size;
+    uint8_t *img = (uint8_t*)mmap(NULL, flen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    // Only the layout is checked before the replay, as the superblock
+    // may be journaled; its CRC is checked once it is home.
+    superblock_t *sb = (superblock_t*)img;
+    const char *bad = vsfs_superblock_check(sb, flen, 0);
+    if (bad) {
+        munmap(img, flen);
+        fprintf(stderr, "Error: %s\n", bad);
+        return 1;
+    }
+    // Start from the last committed update; the output's journal is empty.
+    uint64_t jnl_start = 0, jnl_blocks = 0;
+    if (vsfs_journal_region(sb, &jnl_start, &jnl_blocks) > 0 &&
+        (vsfs_journal_replay(img, flen, -1) < 0 || vsfs_journal_reset(img, flen, -1) != 0)) {
+        munmap(img, flen);
+        fprintf(stderr, "Error: journal: %s\n", vsfs_errmsg());
+        return 1;
+    }
+    uint64_t crc_start = 0, crc_blocks = 0, ref_start = 0, ref_blocks = 0;
+    bad = vsfs_superblock_check(sb, flen, 1);
+    if (!bad && vsfs_crc_table(sb, &crc_start, &crc_blocks) < 0)
+        bad = "block CRC table does not fit the layout";
+    if (!bad && vsfs_refcount_table(sb, &ref_start, &ref_blocks) < 0)
+        bad = "reference-count region does not fit the layout";
+    if (!bad && vsfs_journal_region(sb, &jnl_start, &jnl_blocks) < 0)
+        bad = "journal does not fit the layout";
+    if (bad) {
+        munmap(img, flen);
+        fprintf(stderr, "Error: %s\n", bad);
+        return 1;
+    }
+    uint8_t *ibm = img + sb->inode_bitmap_start * BS;
+    uint8_t *dbm = img + sb->data_bitmap_start  * BS;
+    inode_t *itab = (inode_t*)(img + sb->inode_table_start * BS);
+    const uint64_t dstart = sb->data_region_start, dblocks = sb->data_region_blocks;
+
+    frag_stats_t before;
+    frag_measure(img, sb, dbm, itab, ibm, &before);
+    frag_print("before", &before);
+
+    // Plan: give every referenced block its new slot, in inode order and
+    // layout order within an inode.
+    uint32_t *map = (uint32_t*)malloc(dblocks * sizeof(uint32_t));
+    uint8_t *done = (uint8_t*)calloc(1, (dblocks + 7) / 8);
+    uint8_t *tmp = (uint8_t*)malloc(2 * BS);
+    if (!map || !done || !tmp) {
+        fprintf(stderr, "Error: OOM\n");
+        free(map); free(done); free(tmp); munmap(img, flen);
+        return 1;
+    }
+    for (uint64_t b = 0; b < dblocks; b++) map[b] = NO_BLOCK;
+
+    plan_t plan = { sb, dbm, map, 0, NULL };
+    for (uint64_t i = 0; i < sb->inode_count; i++) {
+        if (!BIT_TEST(ibm, i)) continue;
+        uint32_t bad = 0, frag = VSFS_FRAG_BLOCK(itab[i].xattr_ptr);
+        plan.bad = &bad;
+        // A fragment block moves to just after the first file packed into it.
+        if (inode_walk(img, &itab[i], plan_block, &plan) != 0 || (has_tail(&itab[i]) && plan_block(&plan, &frag) != 0)) {
+            fprintf(stderr, "Error: inode %" PRIu64 " block %" PRIu32 " is outside the data region or marked free; "
+                    "refusing to defragment an inconsistent image\n", i + 1, bad);
+            free(map); free(done); free(tmp); munmap(img, flen);
+            return 1;
+        }
+    }
+    uint64_t next = plan.next;
+    // Blocks marked used but owned by no inode are kept (after the files)
+    // rather than silently dropped.
+    uint64_t orphans = 0;
+    for (uint64_t b = 0; b < dblocks; b++) {
+        if (BIT_TEST(dbm, b) && map[b] == NO_BLOCK) { map[b] = (uint32_t)next++; orphans++; }
+    }
+
+    // Free blocks fill the remaining slots so map becomes a permutation of
+    // the data region; their contents do not matter.
+    const uint64_t used = next;
+    for (uint64_t b = 0; b < dblocks; b++) if (map[b] == NO_BLOCK) map[b] = (uint32_t)next++;
+
+    // Apply the permutation in place, one cycle at a time, carrying one
+    // block in hand; memory stays at two blocks however large the image.
+    uint64_t relocated = 0;
+    for (uint64_t b = 0; b < dblocks; b++) {
+        if (BIT_TEST(done, b) || map[b] == b) { BIT_SET(done, b); continue; }
+        uint8_t *hand = tmp, *spare = tmp + BS;
+        memcpy(hand, img + (dstart + b) * BS, BS);
+        uint64_t cur = b;
+        do {
+            uint64_t dst = map[cur];
+            uint8_t *slot = img + (dstart + dst) * BS;
+            memcpy(spare, slot, BS);
+            memcpy(slot, hand, BS);
+            uint8_t *t = hand; hand = spare; spare = t;
+            BIT_SET(done, cur);
+            if (BIT_TEST(dbm, cur)) relocated++;
+            cur = dst;
+        } while (cur != b);
+    }
+
+    // Rewrite the pointers, rebuild the data bitmap.
+    for (uint64_t i = 0; i < sb->inode_count; i++) {
+        if (!BIT_TEST(ibm, i)) continue;
+        if (inode_nblocks(&itab[i]) == 0 && !has_tail(&itab[i])) continue;
+        inode_walk(img, &itab[i], remap_block, &plan);
+        if (has_tail(&itab[i])) {
+            uint64_t f = itab[i].xattr_ptr;
+            uint32_t frag = VSFS_FRAG_BLOCK(f);
+            remap_block(&plan, &frag);
+            itab[i].xattr_ptr = VSFS_FRAG(frag, VSFS_FRAG_OFF(f), VSFS_FRAG_LEN(f));
+        }
+        vsfs_inode_crc_finalize(&itab[i]);
+    }
+    vsfs_sb_ext_t *ext = (vsfs_sb_ext_t*)(img + VSFS_SB_EXT_OFFSET);
+    if ((sb->flags & VSFS_FLAG_PACKED) && ext->frag_block) {
+        uint64_t old = ext->frag_block;
+        ext->frag_block = old >= dstart && old - dstart < dblocks ? dstart + map[old - dstart] : 0;
+        vsfs_superblock_crc_finalize(sb);
+    }
+    memset(dbm, 0, sb->data_bitmap_blocks * BS);
+    for (uint64_t b = 0; b < used; b++) BIT_SET(dbm, b);
+
+    // Reference counts follow their blocks. Shared blocks were planned
+    // once, at their first user, so the counts themselves do not change.
+    if (ref_blocks) {
+        uint32_t *refcnt = (uint32_t*)(img + ref_start * BS);
+        uint32_t *moved = (uint32_t*)calloc(dblocks ? dblocks : 1, sizeof(uint32_t));
+        if (!moved) {
+            fprintf(stderr, "Error: OOM\n");
+            free(map); free(done); free(tmp); munmap(img, flen);
+            return 1;
+        }
+        for (uint64_t b = 0; b < dblocks; b++) moved[map[b]] = refcnt[b];
+        memcpy(refcnt, moved, dblocks * sizeof(uint32_t));
+        free(moved);
+    }
+
+    frag_stats_t after;
+    frag_measure(img, sb, dbm, itab, ibm, &after);
+    frag_print("after", &after);
+
+    // Nearly every block may have moved: rebuild the whole block CRC table.
+    if (crc_blocks) {
+        uint32_t *crctab = (uint32_t*)(img + crc_start * BS);
+        for (uint64_t b = 0; b < sb->total_blocks; b++)
+            if (b - crc_start >= crc_blocks && b - jnl_start >= jnl_blocks) crctab[b] = vsfs_block_crc(img + b * BS);
+    }
+
+    // Save to output through a temporary file, so --output may name the
+    // (still mapped) input. The file is sized first and only non-zero
+    // blocks are written, so holes stay holes.
+    size_t tlen = strlen(out_path) + 5;
+    char *tmp_path = (char*)malloc(tlen);
+    if (!tmp_path) {
+        fprintf(stderr, "Error: OOM\n");
+        free(map); free(done); free(tmp); munmap(img, flen);
+        return 1;
+    }
+    snprintf(tmp_path, tlen, "%s.tmp", out_path);
+    int fo = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fo < 0) { perror("open output");
+        free(tmp_path); free(map); free(done); free(tmp); munmap(img, flen);
+        return 1;
+    }
+    if (ftruncate(fo, (off_t)flen) != 0 || write_sparse(fo, img, sb->total_blocks) != 0) { perror("write output");
+        close(fo); remove(tmp_path); free(tmp_path); free(map); free(done); free(tmp); munmap(img, flen);
+        return 1;
+    }
+    if (close(fo) != 0 || rename(tmp_path, out_path) != 0) { perror("write output");
+        remove(tmp_path); free(tmp_path); free(map); free(done); free(tmp); munmap(img, flen);
+        return 1;
+    }
+    free(tmp_path); free(map); free(done); free(tmp); munmap(img, flen);
+
+    fprintf(stderr, "OK: relocated %" PRIu64 " of %" PRIu64 " used blocks (%" PRIu64 " unowned kept) -> %s\n",
+            relocated, used, orphans, out_path);
+    return 0;
+}
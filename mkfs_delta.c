@@ -0,0 +1,402 @@
+// Build: make mkfs_delta   (links libminivsfs.a)
+//
+// Block-level deltas between two MiniVSFS images of the same size. The
+// delta carries only the blocks that differ, so shipping an update to many
+// hosts costs the changed blocks rather than the whole image. Changed
+// blocks are found by comparing the images' block CRC tables (see
+// VSFS_FLAG_BLOCK_CRC), which reads 4 bytes per block instead of the
+// block; an image without a table has every block hashed instead, and a
+// journaled one its journal blocks (which have no entries).
+//
+// Patch format (little-endian): a delta_hdr_t, then nruns runs, each a
+// delta_run_t followed by count blocks of data. The header names the
+// digest of the image the patch applies to and of the image it produces,
+// so applying to the wrong base is refused and the result is verified.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "vsfs_crc32.h"
+
+#define BS VSFS_BS
+#define DELTA_MAGIC "VSFSDLT1"
+
+#pragma pack(push, 1)
+typedef struct {
+    char     magic[8];          // DELTA_MAGIC
+    uint32_t block_size;
+    uint32_t flags;             // 0
+    uint64_t total_blocks;
+    uint32_t base_digest;       // image_digest() before and after applying
+    uint32_t target_digest;
+    uint64_t nblocks;           // blocks carried, over all runs
+    uint64_t nruns;
+} delta_hdr_t;
+
+typedef struct {
+    uint64_t start;             // first block
+    uint64_t count;
+    uint32_t crc;               // CRC32 of the run's data
+    uint32_t pad;
+} delta_run_t;
+#pragma pack(pop)
+
+typedef struct {
+    const char     *path;
+    int             fd;
+    uint8_t        *map;        // whole image, read-only, shared
+    size_t          len;
+    uint64_t        nblocks;
+    const uint32_t *crcs;       // vsfs_block_crc() per block: the image's table, or own
+    uint32_t       *own;        // computed entries when the image has no table or a journal
+    uint64_t        crc_start, crc_blocks;
+} image_t;
+
+static void image_close(image_t *im) {
+    if (im->map) munmap(im->map, im->len);
+    if (im->fd >= 0) close(im->fd);
+    free(im->own);
+    im->map = NULL;
+    im->fd = -1;
+    im->own = NULL;
+}
+
+// Open and map an image and get its per-block CRCs. Returns 0, or 1 with
+// the error printed.
+static int image_open(image_t *im, const char *path, int writable) {
+    memset(im, 0, sizeof(*im));
+    im->path = path;
+    im->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (im->fd < 0) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(im->fd, &st) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        image_close(im);
+        return 1;
+    }
+    if ((uint64_t)st.st_size < BS) {
+        fprintf(stderr, "Error: %s: image too small\n", path);
+        image_close(im);
+        return 1;
+    }
+    im->len = (size_t)st.st_size;
+    im->map = (uint8_t*)mmap(NULL, im->len, PROT_READ, MAP_SHARED, im->fd, 0);
+    if (im->map == MAP_FAILED) {
+        im->map = NULL;
+        fprintf(stderr, "Error: %s: mmap: %s\n", path, strerror(errno));
+        image_close(im);
+        return 1;
+    }
+    const superblock_t *sb = (const superblock_t*)im->map;
+    if (sb->magic != VSFS_MAGIC || sb->version != VSFS_VERSION || sb->block_size != BS ||
+        sb->total_blocks * (uint64_t)BS != (uint64_t)im->len) {
+        fprintf(stderr, "Error: %s: not a MiniVSFS image, or its length disagrees with the superblock\n", path);
+        image_close(im);
+        return 1;
+    }
+    im->nblocks = sb->total_blocks;
+    int has_table = vsfs_crc_table(sb, &im->crc_start, &im->crc_blocks);
+    if (has_table < 0) {
+        fprintf(stderr, "Error: %s: block CRC table does not fit the layout\n", path);
+        image_close(im);
+        return 1;
+    }
+    uint64_t jnl_start = 0, jnl_blocks = 0;
+    if (vsfs_journal_region(sb, &jnl_start, &jnl_blocks) < 0) {
+        fprintf(stderr, "Error: %s: journal does not fit the layout\n", path);
+        image_close(im);
+        return 1;
+    }
+    if (has_table && !jnl_blocks) {
+        im->crcs = (const uint32_t*)(im->map + im->crc_start * BS);
+        return 0;
+    }
+    im->own = (uint32_t*)malloc((size_t)im->nblocks * sizeof(uint32_t));
+    if (!im->own) {
+        fprintf(stderr, "Error: OOM\n");
+        image_close(im);
+        return 1;
+    }
+    if (has_table) {
+        memcpy(im->own, im->map + im->crc_start * BS, (size_t)im->nblocks * sizeof(uint32_t));
+        for (uint64_t b = jnl_start; b < jnl_start + jnl_blocks; b++) im->own[b] = vsfs_block_crc(im->map + b * BS);
+    } else {
+        posix_madvise(im->map, im->len, POSIX_MADV_SEQUENTIAL);
+        for (uint64_t b = 0; b < im->nblocks; b++) im->own[b] = vsfs_block_crc(im->map + b * BS);
+    }
+    im->crcs = im->own;
+    return 0;
+}
+
+static int is_table_block(const image_t *im, uint64_t b) {
+    return b - im->crc_start < im->crc_blocks;
+}
+
+// Identifies the whole image contents: every block's CRC goes into it
+// (table blocks through the entries they hold).
+static uint32_t image_digest(const image_t *im) {
+    return vsfs_crc32(im->crcs, (size_t)im->nblocks * sizeof(uint32_t));
+}
+
+static int make_delta(const char *from_path, const char *to_path, const char *out_path) {
+    image_t a, b;
+    if (image_open(&a, from_path, 0) != 0) return 1;
+    if (image_open(&b, to_path, 0) != 0) {
+        image_close(&a);
+        return 1;
+    }
+    int rc = 1;
+    FILE *fo = NULL;
+    delta_run_t *runs = NULL;
+    size_t nruns = 0, cap = 0;
+    uint64_t nblocks = 0;
+    if (a.nblocks != b.nblocks) {
+        fprintf(stderr, "Error: %s has %" PRIu64 " blocks and %s %" PRIu64 "; a delta needs images of the same size\n",
+                from_path, a.nblocks, to_path, b.nblocks);
+        goto out;
+    }
+    if (!a.crc_blocks) fprintf(stderr, "Warning: %s has no block CRC table; hashed every block\n", from_path);
+    if (!b.crc_blocks) fprintf(stderr, "Warning: %s has no block CRC table; hashed every block\n", to_path);
+
+    // Table entries say nothing about the table blocks themselves, so those
+    // are compared byte for byte.
+    for (uint64_t k = 0; k < a.nblocks; k++) {
+        int changed;
+        if (is_table_block(&a, k) || is_table_block(&b, k))
+            changed = memcmp(a.map + k * BS, b.map + k * BS, BS) != 0;
+        else
+            changed = a.crcs[k] != b.crcs[k];
+        if (!changed) continue;
+        nblocks++;
+        if (nruns > 0 && runs[nruns - 1].start + runs[nruns - 1].count == k) {
+            runs[nruns - 1].count++;
+            continue;
+        }
+        if (nruns == cap) {
+            size_t ncap = cap ? cap * 2 : 256;
+            delta_run_t *nr = (delta_run_t*)realloc(runs, ncap * sizeof(delta_run_t));
+            if (!nr) {
+                fprintf(stderr, "Error: OOM\n");
+                goto out;
+            }
+            runs = nr;
+            cap = ncap;
+        }
+        runs[nruns++] = (delta_run_t){ k, 1, 0, 0 };
+    }
+
+    delta_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic));
+    hdr.block_size    = BS;
+    hdr.total_blocks  = a.nblocks;
+    hdr.base_digest   = image_digest(&a);
+    hdr.target_digest = image_digest(&b);
+    hdr.nblocks       = nblocks;
+    hdr.nruns         = nruns;
+
+    int to_stdout = strcmp(out_path, "-") == 0;
+    fo = to_stdout ? stdout : fopen(out_path, "wb");
+    if (!fo) {
+        perror("fopen output");
+        goto out;
+    }
+    uint64_t bytes = sizeof(hdr);
+    if (fwrite(&hdr, sizeof(hdr), 1, fo) != 1) goto write_err;
+    for (size_t r = 0; r < nruns; r++) {
+        const uint8_t *data = b.map + runs[r].start * BS;
+        size_t len = (size_t)(runs[r].count * BS);
+        runs[r].crc = vsfs_crc32(data, len);
+        if (fwrite(&runs[r], sizeof(runs[r]), 1, fo) != 1 || fwrite(data, 1, len, fo) != len) goto write_err;
+        bytes += sizeof(runs[r]) + len;
+    }
+    if (fflush(fo) != 0) goto write_err;
+    if (!to_stdout) {
+        int e = fclose(fo);
+        fo = NULL;
+        if (e != 0) goto write_err;
+    }
+    fprintf(stderr, "OK: %" PRIu64 " of %" PRIu64 " blocks changed in %zu runs; delta is %" PRIu64 " bytes -> %s\n",
+            nblocks, a.nblocks, nruns, bytes, out_path);
+    rc = 0;
+    goto out;
+
+write_err:
+    perror("write delta");
+out:
+    if (fo && fo != stdout) fclose(fo);
+    free(runs);
+    image_close(&a);
+    image_close(&b);
+    return rc;
+}
+
+// Read all of fd into a malloc'd buffer.
+static uint8_t *read_whole(int fd, size_t *len_out) {
+    size_t len = 0, cap = 1u << 20;
+    uint8_t *buf = (uint8_t*)malloc(cap);
+    if (!buf) return NULL;
+    for (;;) {
+        if (len == cap) {
+            uint8_t *nb = (uint8_t*)realloc(buf, cap * 2);
+            if (!nb) {
+                free(buf);
+                return NULL;
+            }
+            buf = nb;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            free(buf);
+            return NULL;
+        }
+        if (n == 0) break;
+        len += (size_t)n;
+    }
+    *len_out = len;
+    return buf;
+}
+
+static int apply_delta(const char *delta_path, const char *img_path) {
+    // The whole delta is read and checked before the image is touched, so a
+    // truncated or damaged one never leaves a half-patched image.
+    int dfd = strcmp(delta_path, "-") == 0 ? STDIN_FILENO : open(delta_path, O_RDONLY);
+    if (dfd < 0) {
+        perror("open delta");
+        return 1;
+    }
+    size_t dlen = 0;
+    uint8_t *d = read_whole(dfd, &dlen);
+    if (dfd != STDIN_FILENO) close(dfd);
+    if (!d) {
+        perror("read delta");
+        return 1;
+    }
+    int rc = 1;
+    image_t im;
+    im.fd = -1;
+    im.map = NULL;
+    im.own = NULL;
+    delta_hdr_t hdr;
+    if (dlen < sizeof(hdr) || (memcpy(&hdr, d, sizeof(hdr)), memcmp(hdr.magic, DELTA_MAGIC, sizeof(hdr.magic)) != 0) ||
+        hdr.block_size != BS) {
+        fprintf(stderr, "Error: %s is not a MiniVSFS delta\n", delta_path);
+        goto out;
+    }
+    size_t pos = sizeof(hdr);
+    uint64_t seen = 0, next_block = 0;
+    for (uint64_t r = 0; r < hdr.nruns; r++) {
+        delta_run_t run;
+        if (dlen - pos < sizeof(run)) goto damaged;
+        memcpy(&run, d + pos, sizeof(run));
+        pos += sizeof(run);
+        if (run.count == 0 || run.start < next_block || run.start > hdr.total_blocks ||
+            run.count > hdr.total_blocks - run.start || (dlen - pos) / BS < run.count ||
+            vsfs_crc32(d + pos, (size_t)(run.count * BS)) != run.crc)
+            goto damaged;
+        pos += (size_t)(run.count * BS);
+        seen += run.count;
+        next_block = run.start + run.count;
+    }
+    if (pos != dlen || seen != hdr.nblocks) goto damaged;
+
+    if (image_open(&im, img_path, 1) != 0) goto out;
+    if (im.nblocks != hdr.total_blocks) {
+        fprintf(stderr, "Error: %s has %" PRIu64 " blocks but the delta is for %" PRIu64 "\n",
+                img_path, im.nblocks, hdr.total_blocks);
+        goto out;
+    }
+    uint32_t digest = image_digest(&im);
+    if (digest == hdr.target_digest) {
+        fprintf(stderr, "OK: %s already matches the delta's target\n", img_path);
+        rc = 0;
+        goto out;
+    }
+    if (digest != hdr.base_digest) {
+        fprintf(stderr, "Error: %s is not the image this delta was made from\n", img_path);
+        goto out;
+    }
+
+    pos = sizeof(hdr);
+    for (uint64_t r = 0; r < hdr.nruns; r++) {
+        delta_run_t run;
+        memcpy(&run, d + pos, sizeof(run));
+        pos += sizeof(run);
+        const uint8_t *src = d + pos;
+        size_t left = (size_t)(run.count * BS);
+        off_t off = (off_t)(run.start * BS);
+        while (left > 0) {
+            ssize_t nw = pwrite(im.fd, src, left, off);
+            if (nw < 0 && errno == EINTR) continue;
+            if (nw < 0) {
+                fprintf(stderr, "Error: %s: pwrite: %s\n", img_path, strerror(errno));
+                goto out;
+            }
+            src += nw; off += nw; left -= (size_t)nw;
+        }
+        pos += (size_t)(run.count * BS);
+    }
+
+    // Reopen: the superblock and table may have moved with the update.
+    image_close(&im);
+    if (image_open(&im, img_path, 0) != 0) goto out;
+    if (image_digest(&im) != hdr.target_digest) {
+        fprintf(stderr, "Error: %s does not match the delta's target after applying it\n", img_path);
+        goto out;
+    }
+    fprintf(stderr, "OK: applied %" PRIu64 " blocks in %" PRIu64 " runs -> %s\n", hdr.nblocks, hdr.nruns, img_path);
+    rc = 0;
+    goto out;
+
+damaged:
+    fprintf(stderr, "Error: %s is truncated or damaged\n", delta_path);
+out:
+    image_close(&im);
+    free(d);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    vsfs_crc32_init();
+
+    const char *from_path = NULL, *to_path = NULL, *out_path = NULL, *apply_path = NULL, *img_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--from") == 0 && i+1 < argc)         from_path  = argv[++i];
+        else if (strcmp(argv[i], "--to") == 0 && i+1 < argc)      to_path    = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0 && i+1 < argc)  out_path   = argv[++i];
+        else if (strcmp(argv[i], "--apply") == 0 && i+1 < argc)   apply_path = argv[++i];
+        else if (strcmp(argv[i], "--image") == 0 && i+1 < argc)   img_path   = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s --from old.img --to new.img --output delta|-\n"
+                            "       %s --apply delta|- --image old.img\n", argv[0], argv[0]);
+            return 2;
+        }
+    }
+    if (apply_path) {
+        if (!img_path || from_path || to_path || out_path) {
+            fprintf(stderr, "Error: --apply takes only --image\n");
+            return 2;
+        }
+        return apply_delta(apply_path, img_path);
+    }
+    if (!from_path || !to_path || !out_path || img_path) {
+        fprintf(stderr, "Error: --from, --to and --output are required (or --apply with --image)\n");
+        return 2;
+    }
+    return make_delta(from_path, to_path, out_path);
+}
@@ -0,0 +1,1072 @@
+// Build: make mkfs_fsck   (links libminivsfs.a)
+//
+// Offline checker for MiniVSFS images. Verifies the superblock, inode and
+// dirent checksums, walks the tree from the root, and cross-checks both
+// bitmaps against what the reachable inodes really use: blocks mapped
+// twice, blocks in use but marked free, leaked blocks and leaked inodes.
+// When the image keeps a block CRC table, every block is checked against
+// it, and when it keeps reference counts, file data blocks may be shared
+// and every count is checked. Inline files and packed tails are checked
+// against their fragment blocks, and compressed files' cluster tables
+// against their streams. With --repair, link counts, both bitmaps,
+// double-mapped blocks (each later owner gets its own copy), reference
+// counts, fragment block headers and stale CRC table entries are fixed in
+// place; damaged checksums and directory entries are only reported.
+// A journaled image is checked as it will be once its journal is
+// replayed; --repair replays it on disk first and then empties it.
+//
+// The inode table and directory scan and the block-map pass are split
+// across worker threads that take the inode table a chunk at a time, so a
+// large image is limited by reading it rather than by CRC work. Problems
+// are collected per thread and printed sorted, so the report is the same
+// whatever the thread count.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE         // MAP_NORESERVE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "vsfs_crc32.h"
+
+#define BS VSFS_BS
+#define ROOT_INO VSFS_ROOT_INO
+#define DIRECT_MAX VSFS_DIRECT_MAX
+#define PTRS_PER_BLOCK VSFS_PTRS_PER_BLOCK
+#define CHUNK 1024              // inodes (or blocks) handed to a worker at a time
+
+#define BIT_SET(bm, bit)   ((bm)[(bit)>>3] |=  (uint8_t)(1u << ((bit)&7)))
+#define BIT_CLEAR(bm, bit) ((bm)[(bit)>>3] &= (uint8_t)~(1u << ((bit)&7)))
+#define BIT_TEST(bm, bit)  ((((bm)[(bit)>>3] >> ((bit)&7)) & 1u))
+
+// Per-inode state, indexed by inode number.
+#define ST_USED  0x01           // bitmap bit set, or a valid inode without one
+#define ST_OK    0x02           // CRC, mode and size check out
+#define ST_DIR   0x04
+#define ST_REACH 0x08           // reachable from the root
+
+typedef enum {
+    P_SB_CRC,                   // superblock checksum mismatch
+    P_CRC_TABLE,                // block CRC table does not fit the layout
+    P_REF_TABLE,                // reference-count region does not fit the layout
+    P_JOURNAL,                  // journal does not fit the layout
+    P_INODE_CRC,
+    P_INODE_MODE,               // a: mode
+    P_INODE_SIZE,               // a: size
+    P_INODE_PACK,               // a: reserved_2, b: xattr_ptr (inline, tail or compressed fields)
+    P_ZIP_TABLE,                // a: cluster, b: its table entry
+    P_BAD_PTR,                  // a: logical block, b: pointer value
+    P_DIRENT_CSUM,              // a: slot
+    P_DIRENT_INO,               // a: slot, b: inode number out of range
+    P_DIRENT_FREE,              // a: inode the entry names, which is free
+    P_DIRENT_TYPE,              // a: inode the entry names
+    P_DOT,                      // a: what "." names (0 = missing)
+    P_DOTDOT,                   // a: what ".." names (0 = missing), b: the real parent
+    P_DIR_PARENTS,              // a: second parent
+    P_UNREACHABLE,              // allocated but not reachable: leaked inode
+    P_IBM_MISSING,              // reachable but marked free in the inode bitmap
+    P_LINKS,                    // a: stored links, b: counted
+    P_DUP_BLOCK,                // a: block also mapped by a lower-numbered inode (or twice here),
+                                //    or both shared as file data and owned here
+} prob_kind_t;
+
+typedef struct {
+    uint64_t ino;
+    uint32_t kind;
+    uint64_t a, b;
+} problem_t;
+
+typedef struct {
+    uint32_t dir, ino;          // entry in dir naming ino
+    uint8_t  type;
+} edge_t;
+
+typedef struct fsck fsck_t;
+
+typedef struct {
+    fsck_t    *fs;
+    pthread_t  tid;
+    problem_t *probs;
+    size_t     nprobs, probs_cap;
+    edge_t    *edges;
+    size_t     nedges, edges_cap;
+    uint64_t   partial;         // inodes whose block walk stopped at a bad pointer
+    uint64_t   crc_bad;         // blocks that do not match the block CRC table
+    int        oom;
+} worker_t;
+
+struct fsck {
+    uint8_t           *img;
+    uint64_t           nblocks;
+    superblock_t      *sb;
+    uint8_t           *ibm, *dbm;
+    inode_t           *itab;
+    uint8_t           *state;     // ST_* per inode
+    uint32_t          *dotdot;    // what each directory's ".." names
+    _Atomic uint32_t  *owner;     // per data block: lowest reachable inode mapping it
+                                  // (other than as shareable file data)
+    _Atomic uint32_t  *refs;      // per data block: file data references, when counted
+    _Atomic uint32_t  *frags;     // per data block: packed tails in it
+    _Atomic uint32_t  *frag_end;  // per data block: end of its last packed tail
+    uint32_t          *refcnt;    // reference-count region, or NULL
+    _Atomic uint64_t   next;      // next chunk to hand out
+    uint64_t           first, count;  // what the running pass covers
+    uint8_t           *dirty;     // blocks changed by --repair
+    uint32_t          *crctab;    // block CRC table, or NULL
+    uint64_t           crc_start, crc_blocks;
+    uint64_t           jnl_start, jnl_blocks;   // journal; its blocks have no CRC entries
+    uint8_t           *stale;     // blocks whose CRC table entry is wrong
+};
+
+static void add_problem(worker_t *w, uint64_t ino, prob_kind_t kind, uint64_t a, uint64_t b) {
+    if (w->nprobs == w->probs_cap) {
+        size_t ncap = w->probs_cap ? w->probs_cap * 2 : 64;
+        problem_t *np = (problem_t*)realloc(w->probs, ncap * sizeof(problem_t));
+        if (!np) {
+            w->oom = 1;
+            return;
+        }
+        w->probs = np;
+        w->probs_cap = ncap;
+    }
+    w->probs[w->nprobs++] = (problem_t){ ino, (uint32_t)kind, a, b };
+}
+
+static void add_edge(worker_t *w, uint32_t dir, uint32_t ino, uint8_t type) {
+    if (w->nedges == w->edges_cap) {
+        size_t ncap = w->edges_cap ? w->edges_cap * 2 : 256;
+        edge_t *ne = (edge_t*)realloc(w->edges, ncap * sizeof(edge_t));
+        if (!ne) {
+            w->oom = 1;
+            return;
+        }
+        w->edges = ne;
+        w->edges_cap = ncap;
+    }
+    w->edges[w->nedges++] = (edge_t){ dir, ino, type };
+}
+
+// Zeroed table of one 32-bit counter per data block. Only entries of
+// blocks in use are ever written, so it is mapped without reserving
+// memory: on a mostly empty image of many TiB its untouched pages cost
+// nothing.
+static _Atomic uint32_t *block_table(uint64_t n) {
+    void *p = mmap(NULL, (size_t)(n ? n : 1) * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : (_Atomic uint32_t*)p;
+}
+
+static void block_table_free(_Atomic uint32_t *t, uint64_t n) {
+    if (t) munmap((void*)t, (size_t)(n ? n : 1) * sizeof(uint32_t));
+}
+
+static void fs_mark(fsck_t *fs, const void *p) {
+    BIT_SET(fs->dirty, (uint64_t)((const uint8_t*)p - fs->img) / BS);
+}
+
+// Block number b if it lies in the data region, else 0.
+static uint32_t data_block(const fsck_t *fs, uint32_t b) {
+    if (b < fs->sb->data_region_start || b - fs->sb->data_region_start >= fs->sb->data_region_blocks) return 0;
+    return b;
+}
+
+// Data blocks an inode maps (an unpacked regular file always has at least one).
+static uint64_t inode_nblocks(const inode_t *ino) {
+    return vsfs_inode_blocks(ino);
+}
+
+// Physical block holding logical block k of ino, or 0 if it is unmapped or
+// any pointer on the way is outside the data region.
+static uint32_t inode_bmap(const fsck_t *fs, const inode_t *ino, uint64_t k) {
+    if (k < DIRECT_MAX) return data_block(fs, ino->direct[k]);
+    k -= DIRECT_MAX;
+    if (k < PTRS_PER_BLOCK) {
+        if (!data_block(fs, ino->reserved_0)) return 0;
+        return data_block(fs, ((const uint32_t*)(fs->img + (uint64_t)ino->reserved_0 * BS))[k]);
+    }
+    k -= PTRS_PER_BLOCK;
+    if (k / PTRS_PER_BLOCK >= PTRS_PER_BLOCK || !data_block(fs, ino->reserved_1)) return 0;
+    uint32_t leaf = ((const uint32_t*)(fs->img + (uint64_t)ino->reserved_1 * BS))[k / PTRS_PER_BLOCK];
+    if (!data_block(fs, leaf)) return 0;
+    return data_block(fs, ((const uint32_t*)(fs->img + (uint64_t)leaf * BS))[k % PTRS_PER_BLOCK]);
+}
+
+// Visit every block pointer an inode owns in on-disk layout order, as
+// mkfs_defrag does. fn sees each pointer (with its logical block, or
+// UINT64_MAX for pointer blocks) before the walk dereferences it, and may
+// rewrite it; a non-zero return stops the walk and is passed back.
+typedef int (*ptr_fn)(void *ctx, uint32_t *ptr, uint64_t k);
+static int inode_walk(fsck_t *fs, inode_t *ino, ptr_fn fn, void *ctx) {
+    uint8_t *img = fs->img;
+    uint64_t n = inode_nblocks(ino);
+    int rc;
+    for (uint64_t k = 0; k < n && k < DIRECT_MAX; k++)
+        if ((rc = fn(ctx, &ino->direct[k], k)) != 0) return rc;
+    if (n <= DIRECT_MAX) return 0;
+    n -= DIRECT_MAX;
+
+    if ((rc = fn(ctx, &ino->reserved_0, UINT64_MAX)) != 0) return rc;
+    uint32_t *ind = (uint32_t*)(img + (uint64_t)ino->reserved_0 * BS);
+    for (uint64_t k = 0; k < n && k < PTRS_PER_BLOCK; k++)
+        if ((rc = fn(ctx, &ind[k], DIRECT_MAX + k)) != 0) return rc;
+    if (n <= PTRS_PER_BLOCK) return 0;
+    n -= PTRS_PER_BLOCK;
+
+    if ((rc = fn(ctx, &ino->reserved_1, UINT64_MAX)) != 0) return rc;
+    uint32_t *dind = (uint32_t*)(img + (uint64_t)ino->reserved_1 * BS);
+    for (uint64_t l = 0; l * PTRS_PER_BLOCK < n; l++) {
+        if ((rc = fn(ctx, &dind[l], UINT64_MAX)) != 0) return rc;
+        uint32_t *leaf = (uint32_t*)(img + (uint64_t)dind[l] * BS);
+        for (uint64_t k = 0; k < PTRS_PER_BLOCK && l * PTRS_PER_BLOCK + k < n; k++)
+            if ((rc = fn(ctx, &leaf[k], DIRECT_MAX + PTRS_PER_BLOCK + l * PTRS_PER_BLOCK + k)) != 0) return rc;
+    }
+    return 0;
+}
+
+// ----------------- Pass 1: inodes and directory entries -----------------
+
+static void scan_dir(worker_t *w, uint64_t ino, const inode_t *dir) {
+    fsck_t *fs = w->fs;
+    uint64_t nb = dir->size_bytes / BS;
+    int seen_dot = 0;
+    for (uint64_t k = 0; k < nb; k++) {
+        uint32_t b = inode_bmap(fs, dir, k);
+        if (b == 0) {
+            // reported by the block-map pass
+            continue;
+        }
+        const dirent64_t *de = (const dirent64_t*)(fs->img + (uint64_t)b * BS);
+        for (uint64_t s = 0; s < VSFS_DIRENTS_PER_BLOCK; s++, de++) {
+            if (de->inode_no == 0) continue;
+            uint64_t slot = k * VSFS_DIRENTS_PER_BLOCK + s;
+            const uint8_t *p = (const uint8_t*)de;
+            uint8_t x = 0;
+            for (int i = 0; i < 63; i++) x ^= p[i];
+            if (x != de->checksum) {
+                add_problem(w, ino, P_DIRENT_CSUM, slot, 0);
+                continue;
+            }
+            if (strncmp(de->name, ".", VSFS_NAME_MAX) == 0) {
+                if (de->inode_no != ino) add_problem(w, ino, P_DOT, de->inode_no, 0);
+                seen_dot = 1;
+                continue;
+            }
+            if (strncmp(de->name, "..", VSFS_NAME_MAX) == 0) {
+                fs->dotdot[ino] = de->inode_no;
+                continue;
+            }
+            if (de->inode_no > fs->sb->inode_count) {
+                add_problem(w, ino, P_DIRENT_INO, slot, de->inode_no);
+                continue;
+            }
+            add_edge(w, (uint32_t)ino, de->inode_no, de->type);
+        }
+    }
+    if (!seen_dot) add_problem(w, ino, P_DOT, 0, 0);
+}
+
+// The cluster table of a compressed file: each entry ends its cluster no
+// earlier than the one before and at most a cluster's data later, and the
+// last one ends the stream. Past a bad entry nothing can be decompressed.
+static void check_zip_table(worker_t *w, uint64_t ino, const inode_t *node) {
+    fsck_t *fs = w->fs;
+    uint64_t n = (node->size_bytes + VSFS_ZCLUSTER - 1) / VSFS_ZCLUSTER, prev = n * 4;
+    for (uint64_t c = 0; c < n; c++) {
+        uint32_t b = inode_bmap(fs, node, c * 4 / BS), end;
+        if (b == 0) return;   // reported by the block-map pass
+        memcpy(&end, fs->img + (uint64_t)b * BS + c * 4 % BS, 4);
+        uint64_t raw = c + 1 < n ? VSFS_ZCLUSTER : node->size_bytes - c * VSFS_ZCLUSTER;
+        if (end < prev || end - prev > raw || (c + 1 == n && end != node->xattr_ptr)) {
+            add_problem(w, ino, P_ZIP_TABLE, c, end);
+            return;
+        }
+        prev = end;
+    }
+}
+
+static void check_inode(worker_t *w, uint64_t ino) {
+    fsck_t *fs = w->fs;
+    const inode_t *node = &fs->itab[ino - 1];
+    int allocated = BIT_TEST(fs->ibm, ino - 1);
+    int crc_ok = vsfs_inode_crc_ok(node);
+    // A free slot is all zeros (or at least not a valid inode).
+    if (!allocated && !(crc_ok && node->mode != 0)) return;
+    fs->state[ino] = ST_USED;
+    if (!crc_ok) {
+        add_problem(w, ino, P_INODE_CRC, 0, 0);
+        return;
+    }
+    uint16_t fmt = node->mode & VSFS_S_IFMT;
+    if (fmt == VSFS_S_IFDIR) {
+        if (node->size_bytes == 0 || node->size_bytes % BS != 0 ||
+            node->size_bytes / BS > VSFS_FILE_BLOCKS_MAX) {
+            add_problem(w, ino, P_INODE_SIZE, node->size_bytes, 0);
+            return;
+        }
+        fs->state[ino] = ST_USED | ST_OK | ST_DIR;
+        scan_dir(w, ino, node);
+    } else if (fmt == VSFS_S_IFREG) {
+        if (inode_nblocks(node) > VSFS_FILE_BLOCKS_MAX) {
+            add_problem(w, ino, P_INODE_SIZE, node->size_bytes, 0);
+            return;
+        }
+        uint32_t pk = node->reserved_2;
+        uint64_t f = node->xattr_ptr;
+        int bad = pk & ~(VSFS_INO_INLINE | VSFS_INO_TAIL | VSFS_INO_COMPRESSED) || (pk & (pk - 1)) != 0;
+        if (pk & VSFS_INO_INLINE) bad |= node->size_bytes > VSFS_INLINE_MAX;
+        if (pk & VSFS_INO_COMPRESSED) {
+            uint64_t n = (node->size_bytes + VSFS_ZCLUSTER - 1) / VSFS_ZCLUSTER;
+            bad |= !(fs->sb->flags & VSFS_FLAG_COMPRESSED) || n == 0 || f < n * 4 || f - n * 4 > node->size_bytes;
+        }
+        if (pk & VSFS_INO_TAIL)
+            bad |= VSFS_FRAG_LEN(f) == 0 || VSFS_FRAG_LEN(f) != node->size_bytes % BS ||
+                   VSFS_FRAG_OFF(f) < sizeof(vsfs_frag_hdr_t) || VSFS_FRAG_OFF(f) + VSFS_FRAG_LEN(f) > BS ||
+                   !data_block(fs, VSFS_FRAG_BLOCK(f));
+        if (bad) {
+            add_problem(w, ino, P_INODE_PACK, pk, f);
+            return;
+        }
+        fs->state[ino] = ST_USED | ST_OK;
+        if (pk & VSFS_INO_COMPRESSED) check_zip_table(w, ino, node);
+    } else {
+        add_problem(w, ino, P_INODE_MODE, node->mode, 0);
+    }
+}
+
+// ----------------- Pass 3: block ownership -----------------
+
+typedef struct {
+    worker_t *w;
+    uint64_t  ino;
+} claim_t;
+
+// Whether the pointer may name a block other files share: file data, in an
+// image that keeps reference counts.
+static int shareable(const fsck_t *fs, uint64_t ino, uint64_t k) {
+    return fs->refs && k != UINT64_MAX && !(fs->state[ino] & ST_DIR);
+}
+
+// Record ino as a user of the block *ptr. The lowest inode number wins the
+// block, so which inodes get reported does not depend on thread timing.
+// Shareable references are only counted.
+static int claim_block(void *ctx, uint32_t *ptr, uint64_t k) {
+    claim_t *c = (claim_t*)ctx;
+    fsck_t *fs = c->w->fs;
+    if (!data_block(fs, *ptr)) {
+        add_problem(c->w, c->ino, P_BAD_PTR, k, *ptr);
+        c->w->partial++;
+        return 1;
+    }
+    if (shareable(fs, c->ino, k)) {
+        atomic_fetch_add(&fs->refs[*ptr - fs->sb->data_region_start], 1);
+        return 0;
+    }
+    _Atomic uint32_t *o = &fs->owner[*ptr - fs->sb->data_region_start];
+    uint32_t cur = atomic_load(o);
+    for (;;) {
+        if (cur == 0 || cur > c->ino) {
+            if (!atomic_compare_exchange_weak(o, &cur, (uint32_t)c->ino)) continue;
+            if (cur != 0) add_problem(c->w, cur, P_DUP_BLOCK, *ptr, 0);
+            return 0;
+        }
+        add_problem(c->w, c->ino, P_DUP_BLOCK, *ptr, 0);
+        return 0;
+    }
+}
+
+// Shareable references only, for counting again after repairs.
+static int recount_block(void *ctx, uint32_t *ptr, uint64_t k) {
+    claim_t *c = (claim_t*)ctx;
+    fsck_t *fs = c->w->fs;
+    if (!data_block(fs, *ptr)) return 1;
+    if (shareable(fs, c->ino, k)) atomic_fetch_add(&fs->refs[*ptr - fs->sb->data_region_start], 1);
+    return 0;
+}
+
+static void map_inode(worker_t *w, uint64_t ino) {
+    fsck_t *fs = w->fs;
+    if ((fs->state[ino] & (ST_OK | ST_REACH)) != (ST_OK | ST_REACH)) return;
+    const inode_t *node = &fs->itab[ino - 1];
+    if (!(fs->state[ino] & ST_DIR) && (node->reserved_2 & VSFS_INO_TAIL)) {
+        // Fragments are counted, and the end of the last one kept, per block.
+        uint64_t f = node->xattr_ptr, b = VSFS_FRAG_BLOCK(f) - fs->sb->data_region_start;
+        uint32_t end = VSFS_FRAG_OFF(f) + VSFS_FRAG_LEN(f), cur = atomic_load(&fs->frag_end[b]);
+        atomic_fetch_add(&fs->frags[b], 1);
+        while (cur < end && !atomic_compare_exchange_weak(&fs->frag_end[b], &cur, end)) {}
+    }
+    claim_t c = { w, ino };
+    inode_walk(fs, &fs->itab[ino - 1], claim_block, &c);
+}
+
+// Whether data block b (relative) has a fragment header that agrees with
+// the tails counted in it.
+static int frag_hdr_ok(const fsck_t *fs, uint64_t b) {
+    const vsfs_frag_hdr_t *h = (const vsfs_frag_hdr_t*)(fs->img + (fs->sb->data_region_start + b) * BS);
+    return h->magic == VSFS_FRAG_MAGIC && h->live == atomic_load(&fs->frags[b]) &&
+           h->end >= atomic_load(&fs->frag_end[b]) && h->end <= BS;
+}
+
+// ----------------- Pass 5: block CRC table -----------------
+
+// Chunks are whole bytes of the stale bitmap, so workers never share one.
+static void check_block(worker_t *w, uint64_t b) {
+    fsck_t *fs = w->fs;
+    if (b - fs->crc_start < fs->crc_blocks || b - fs->jnl_start < fs->jnl_blocks) return;
+    // A free block of a journaled image may hold data written ahead of an
+    // update that never committed.
+    uint64_t d = b - fs->sb->data_region_start;
+    if (fs->jnl_blocks && d < fs->sb->data_region_blocks && !BIT_TEST(fs->dbm, d)) return;
+    if (vsfs_block_crc(fs->img + b * BS) == fs->crctab[b]) return;
+    BIT_SET(fs->stale, b);
+    w->crc_bad++;
+}
+
+// ----------------- Worker pool -----------------
+
+typedef void (*item_fn)(worker_t *w, uint64_t item);
+typedef struct {
+    worker_t *w;
+    item_fn   fn;
+} pass_arg_t;
+
+static void *pass_worker(void *arg) {
+    pass_arg_t *pa = (pass_arg_t*)arg;
+    fsck_t *fs = pa->w->fs;
+    for (;;) {
+        uint64_t off = atomic_fetch_add(&fs->next, 1) * CHUNK;
+        if (off >= fs->count) return NULL;
+        uint64_t n = fs->count - off < CHUNK ? fs->count - off : CHUNK;
+        for (uint64_t i = 0; i < n; i++) pa->fn(pa->w, fs->first + off + i);
+    }
+}
+
+// Run fn over items first..first+count-1 (inode or block numbers) on nw
+// threads. Returns 0, or 1 (error printed) if a thread could not be started.
+static int run_pass(fsck_t *fs, worker_t *ws, int nw, item_fn fn, uint64_t first, uint64_t count) {
+    pass_arg_t args[256];
+    atomic_store(&fs->next, 0);
+    fs->first = first;
+    fs->count = count;
+    int started = 0, rc = 0;
+    for (int t = 0; t < nw; t++) {
+        args[t] = (pass_arg_t){ &ws[t], fn };
+        int e = pthread_create(&ws[t].tid, NULL, pass_worker, &args[t]);
+        if (e != 0) {
+            fprintf(stderr, "Error: pthread_create: %s\n", strerror(e));
+            rc = 1;
+            break;
+        }
+        started++;
+    }
+    for (int t = 0; t < started; t++) pthread_join(ws[t].tid, NULL);
+    return rc;
+}
+
+// ----------------- Repair -----------------
+
+typedef struct {
+    fsck_t   *fs;
+    uint8_t  *taken;      // data blocks already given to an inode in this pass
+    uint64_t  cursor;     // where to look for a free block next
+    uint64_t  ino;        // inode being walked
+    uint64_t  cloned, failed;
+} clone_t;
+
+// Keep the first (lowest-numbered) user of each block; give every later
+// user a copy in a free block. Pointer blocks are copied before the walk
+// reads through them, so their children get copies too.
+static int clone_block(void *ctx, uint32_t *ptr, uint64_t k) {
+    clone_t *cl = (clone_t*)ctx;
+    fsck_t *fs = cl->fs;
+    uint64_t start = fs->sb->data_region_start, n = fs->sb->data_region_blocks;
+    if (!data_block(fs, *ptr)) return 1;   // reported already; leave it be
+    uint64_t b = *ptr - start;
+    // Sharing among file data is fine; only a block someone owns outright
+    // must not be shared.
+    if (shareable(fs, cl->ino, k) && atomic_load(&fs->owner[b]) == 0) return 0;
+    if (!BIT_TEST(cl->taken, b)) {
+        BIT_SET(cl->taken, b);
+        return 0;
+    }
+    while (cl->cursor < n && (atomic_load(&fs->owner[cl->cursor]) != 0 || (fs->refs && fs->refs[cl->cursor] != 0) ||
+                              fs->frags[cl->cursor] != 0 || BIT_TEST(cl->taken, cl->cursor)))
+        cl->cursor++;
+    if (cl->cursor == n) {
+        cl->failed++;
+        return 1;
+    }
+    uint64_t nb = cl->cursor++;
+    memcpy(fs->img + (start + nb) * BS, fs->img + (uint64_t)*ptr * BS, BS);
+    fs_mark(fs, fs->img + (start + nb) * BS);
+    BIT_SET(cl->taken, nb);
+    atomic_store(&fs->owner[nb], 1);
+    *ptr = (uint32_t)(start + nb);
+    fs_mark(fs, ptr);
+    cl->cloned++;
+    return 0;
+}
+
+static int write_dirty(int fd, const fsck_t *fs, uint64_t *written) {
+    *written = 0;
+    for (uint64_t b = 0; b < fs->nblocks; ) {
+        if (!BIT_TEST(fs->dirty, b)) { b++; continue; }
+        uint64_t e = b + 1;
+        while (e < fs->nblocks && BIT_TEST(fs->dirty, e)) e++;
+        const uint8_t *src = fs->img + b * BS;
+        size_t left = (size_t)((e - b) * BS);
+        off_t off = (off_t)(b * BS);
+        while (left > 0) {
+            ssize_t nw = pwrite(fd, src, left, off);
+            if (nw < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            src += nw; off += nw; left -= (size_t)nw;
+        }
+        *written += e - b;
+        b = e;
+    }
+    return 0;
+}
+
+// ----------------- Report -----------------
+
+static int prob_cmp(const void *a, const void *b) {
+    const problem_t *x = (const problem_t*)a, *y = (const problem_t*)b;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    if (x->kind != y->kind) return x->kind < y->kind ? -1 : 1;
+    if (x->a != y->a) return x->a < y->a ? -1 : 1;
+    if (x->b != y->b) return x->b < y->b ? -1 : 1;
+    return 0;
+}
+
+static int repairable(uint32_t kind) {
+    return kind == P_UNREACHABLE || kind == P_IBM_MISSING || kind == P_LINKS || kind == P_DUP_BLOCK;
+}
+
+static void print_problem(const problem_t *p) {
+    if (p->kind == P_SB_CRC) {
+        fprintf(stderr, "Error: superblock checksum mismatch\n");
+        return;
+    }
+    if (p->kind == P_CRC_TABLE) {
+        fprintf(stderr, "Error: block CRC table does not fit the layout; blocks not checked against it\n");
+        return;
+    }
+    if (p->kind == P_REF_TABLE) {
+        fprintf(stderr, "Error: reference-count region does not fit the layout; shared blocks reported as double-mapped\n");
+        return;
+    }
+    if (p->kind == P_JOURNAL) {
+        fprintf(stderr, "Error: journal does not fit the layout; not replayed\n");
+        return;
+    }
+    fprintf(stderr, "Error: inode %" PRIu64 ": ", p->ino);
+    switch ((prob_kind_t)p->kind) {
+    case P_SB_CRC:      break;
+    case P_CRC_TABLE:   break;
+    case P_REF_TABLE:   break;
+    case P_JOURNAL:     break;
+    case P_INODE_CRC:   fprintf(stderr, "inode checksum mismatch"); break;
+    case P_INODE_MODE:  fprintf(stderr, "mode %06" PRIo64 " is neither a file nor a directory", p->a); break;
+    case P_INODE_SIZE:  fprintf(stderr, "size %" PRIu64 " is impossible for its type", p->a); break;
+    case P_INODE_PACK:  fprintf(stderr, "storage flags 0x%" PRIx64 " (xattr_ptr 0x%016" PRIx64 ") do not fit its size or the image", p->a, p->b); break;
+    case P_ZIP_TABLE:   fprintf(stderr, "compressed cluster %" PRIu64 " has a bad end offset %" PRIu64, p->a, p->b); break;
+    case P_BAD_PTR:
+        if (p->a == UINT64_MAX) fprintf(stderr, "pointer block %" PRIu64 " is outside the data region", p->b);
+        else fprintf(stderr, "block %" PRIu64 " maps to %" PRIu64 ", outside the data region", p->a, p->b);
+        break;
+    case P_DIRENT_CSUM: fprintf(stderr, "directory entry %" PRIu64 " checksum mismatch", p->a); break;
+    case P_DIRENT_INO:  fprintf(stderr, "directory entry %" PRIu64 " names inode %" PRIu64 ", out of range", p->a, p->b); break;
+    case P_DIRENT_FREE: fprintf(stderr, "directory entry names inode %" PRIu64 ", which is free", p->a); break;
+    case P_DIRENT_TYPE: fprintf(stderr, "directory entry type does not match inode %" PRIu64, p->a); break;
+    case P_DOT:
+        if (p->a == 0) fprintf(stderr, "directory has no '.' entry");
+        else fprintf(stderr, "'.' names inode %" PRIu64, p->a);
+        break;
+    case P_DOTDOT:
+        if (p->a == 0) fprintf(stderr, "directory has no '..' entry (parent is %" PRIu64 ")", p->b);
+        else fprintf(stderr, "'..' names inode %" PRIu64 " but the parent is %" PRIu64, p->a, p->b);
+        break;
+    case P_DIR_PARENTS: fprintf(stderr, "directory is also entered in directory %" PRIu64, p->a); break;
+    case P_UNREACHABLE: fprintf(stderr, "allocated but not reachable from the root (leaked)"); break;
+    case P_IBM_MISSING: fprintf(stderr, "in use but marked free in the inode bitmap"); break;
+    case P_LINKS:       fprintf(stderr, "links is %" PRIu64 ", should be %" PRIu64, p->a, p->b); break;
+    case P_DUP_BLOCK:   fprintf(stderr, "block %" PRIu64 " is also mapped by another inode", p->a); break;
+    }
+    fputc('\n', stderr);
+}
+
+int main(int argc, char **argv) {
+    vsfs_crc32_init();
+
+    const char *img_path = NULL;
+    int repair = 0;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > 8) nthreads = 8;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i+1 < argc)        img_path = argv[++i];
+        else if (strcmp(argv[i], "--repair") == 0)                repair = 1;
+        else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            char *end;
+            nthreads = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || nthreads < 1 || nthreads > 256) {
+                fprintf(stderr, "Error: --threads must be between 1 and 256\n");
+                return 2;
+            }
+        }
+        else {
+            fprintf(stderr, "Usage: %s --image fs.img [--repair] [--threads N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (!img_path) { fprintf(stderr, "Error: missing --image\n"); return 2; }
+
+    // Map privately: repairs are made in the mapping and only the blocks
+    // they touch are written back (and take memory). A plain check never
+    // writes, so its mapping is read-only.
+    int fd = open(img_path, repair ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror("open image");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return 1;
+    }
+    if ((uint64_t)st.st_size < BS) {
+        close(fd);
+        fprintf(stderr, "Error: image too small\n");
+        return 1;
+    }
+    const size_t flen = (size_t)st.st_size;
+    uint8_t *img = (uint8_t*)mmap(NULL, flen, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (img == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return 1;
+    }
+
+    // The layout has to be sane before anything else can be looked at.
+    superblock_t *sb = (superblock_t*)img;
+    // The CRC is left to the checks below: a bad one is reported, not fatal.
+    const char *bad = vsfs_superblock_check(sb, flen, 0);
+    if (bad) {
+        fprintf(stderr, "Error: %s; cannot check further\n", bad);
+        munmap(img, flen);
+        close(fd);
+        return 1;
+    }
+    // Bring a journaled image up to its last committed update. Repairs are
+    // written without the journal, so it must not replay over them later.
+    uint64_t jnl_start = 0, jnl_blocks = 0;
+    int has_jnl = vsfs_journal_region(sb, &jnl_start, &jnl_blocks);
+    if (has_jnl > 0) {
+        // Without --repair the replay goes into the mapping, writable for
+        // just that; only the blocks replayed are copied.
+        if (!repair && mprotect(img, flen, PROT_READ | PROT_WRITE) != 0) {
+            perror("mprotect");
+            munmap(img, flen);
+            close(fd);
+            return 1;
+        }
+        int64_t replayed = vsfs_journal_replay(img, flen, repair ? fd : -1);
+        if (!repair) mprotect(img, flen, PROT_READ);
+        if (replayed < 0 || (repair && vsfs_journal_reset(img, flen, fd) != 0)) {
+            fprintf(stderr, "Error: journal: %s\n", vsfs_errmsg());
+            munmap(img, flen);
+            close(fd);
+            return 1;
+        }
+        if (replayed > 0 && repair)
+            fprintf(stderr, "OK: replayed %" PRId64 " blocks from the journal\n", replayed);
+        else if (replayed > 0)
+            fprintf(stderr, "Warning: %" PRId64 " journaled blocks are not home yet; checking as if replayed\n", replayed);
+    }
+    // The replay may have brought a different superblock home.
+    if ((bad = vsfs_superblock_check(sb, flen, 0)) != NULL) {
+        fprintf(stderr, "Error: %s; cannot check further\n", bad);
+        munmap(img, flen);
+        close(fd);
+        return 1;
+    }
+    vsfs_journal_region(sb, &jnl_start, &jnl_blocks);
+
+    fsck_t fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.img = img;
+    fs.nblocks = sb->total_blocks;
+    fs.sb = sb;
+    fs.ibm = img + sb->inode_bitmap_start * BS;
+    fs.dbm = img + sb->data_bitmap_start  * BS;
+    fs.itab = (inode_t*)(img + sb->inode_table_start * BS);
+    fs.jnl_start = jnl_start;
+    fs.jnl_blocks = jnl_blocks;
+    const uint64_t icount = sb->inode_count, dstart = sb->data_region_start, dblocks = sb->data_region_blocks;
+    fs.state  = (uint8_t*)calloc(icount + 1, 1);
+    fs.dotdot = (uint32_t*)calloc(icount + 1, sizeof(uint32_t));
+    fs.owner  = block_table(dblocks);
+    fs.frags  = block_table(dblocks);
+    fs.frag_end = block_table(dblocks);
+    fs.dirty  = (uint8_t*)calloc(1, (size_t)((fs.nblocks + 7) / 8));
+    worker_t *ws = (worker_t*)calloc((size_t)nthreads, sizeof(worker_t));
+    uint32_t *links = (uint32_t*)calloc(icount + 1, sizeof(uint32_t));
+    if (!fs.state || !fs.dotdot || !fs.owner || !fs.frags || !fs.frag_end || !fs.dirty || !ws || !links) {
+        fprintf(stderr, "Error: OOM\n");
+        return 1;
+    }
+    for (long t = 0; t < nthreads; t++) ws[t].fs = &fs;
+
+    // Tell the kernel what is about to be read so the workers do not wait
+    // on one page fault at a time.
+    posix_madvise(img, (size_t)(dstart * BS), POSIX_MADV_WILLNEED);
+
+    int rc = 0;
+    uint8_t blk0[BS];
+    memcpy(blk0, img, BS);
+    if (vsfs_superblock_crc_finalize((superblock_t*)blk0) != sb->checksum) add_problem(&ws[0], 0, P_SB_CRC, 0, 0);
+    uint64_t ref_start, ref_blocks;
+    int has_refs = vsfs_refcount_table(sb, &ref_start, &ref_blocks);
+    if (has_refs < 0) add_problem(&ws[0], 0, P_REF_TABLE, 0, 0);
+    if (has_jnl < 0) add_problem(&ws[0], 0, P_JOURNAL, 0, 0);
+    if (has_refs > 0) {
+        fs.refcnt = (uint32_t*)(img + ref_start * BS);
+        fs.refs = block_table(dblocks);
+        if (!fs.refs) {
+            fprintf(stderr, "Error: OOM\n");
+            return 1;
+        }
+    }
+    int has_table = vsfs_crc_table(sb, &fs.crc_start, &fs.crc_blocks);
+    if (has_table < 0) add_problem(&ws[0], 0, P_CRC_TABLE, 0, 0);
+    if (has_table > 0) {
+        fs.crctab = (uint32_t*)(img + fs.crc_start * BS);
+        fs.stale = (uint8_t*)calloc(1, (size_t)((fs.nblocks + 7) / 8));
+        if (!fs.stale) {
+            fprintf(stderr, "Error: OOM\n");
+            return 1;
+        }
+    }
+
+    // Pass 1 (parallel): every inode's CRC, mode and size; every directory's
+    // entries, which are collected as edges.
+    if (run_pass(&fs, ws, (int)nthreads, check_inode, 1, icount) != 0) return 1;
+
+    // Pass 2 (serial): walk the tree from the root over the edges,
+    // counting the links each inode should have.
+    size_t nedges = 0;
+    for (long t = 0; t < nthreads; t++) nedges += ws[t].nedges;
+    uint64_t *first = (uint64_t*)calloc(icount + 2, sizeof(uint64_t));
+    edge_t *edges = (edge_t*)malloc((nedges ? nedges : 1) * sizeof(edge_t));
+    uint32_t *queue = (uint32_t*)malloc((size_t)(icount + 1) * sizeof(uint32_t));
+    if (!first || !edges || !queue) {
+        fprintf(stderr, "Error: OOM\n");
+        return 1;
+    }
+    for (long t = 0; t < nthreads; t++)
+        for (size_t i = 0; i < ws[t].nedges; i++) first[ws[t].edges[i].dir + 1]++;
+    for (uint64_t i = 1; i <= icount + 1; i++) first[i] += first[i - 1];
+    for (long t = 0; t < nthreads; t++) {
+        for (size_t i = 0; i < ws[t].nedges; i++) {
+            // place each edge in its directory's range, in slot order
+            edge_t *e = &ws[t].edges[i];
+            edges[first[e->dir]++] = *e;
+        }
+        free(ws[t].edges);
+        ws[t].edges = NULL;
+    }
+    for (uint64_t i = icount + 1; i > 0; i--) first[i] = first[i - 1];
+    first[0] = 0;
+
+    worker_t *w0 = &ws[0];
+    uint64_t files = 0, dirs = 0, damaged = 0;
+    if ((fs.state[ROOT_INO] & (ST_OK | ST_DIR)) != (ST_OK | ST_DIR)) {
+        fprintf(stderr, "Error: inode %u: the root is not a valid directory; cannot check the tree\n", ROOT_INO);
+        rc = 1;
+    } else {
+        size_t qh = 0, qt = 0;
+        fs.state[ROOT_INO] |= ST_REACH;
+        links[ROOT_INO] = 2;
+        if (fs.dotdot[ROOT_INO] != ROOT_INO) add_problem(w0, ROOT_INO, P_DOTDOT, fs.dotdot[ROOT_INO], ROOT_INO);
+        queue[qt++] = ROOT_INO;
+        dirs++;
+        while (qh < qt) {
+            uint32_t d = queue[qh++];
+            for (uint64_t i = first[d]; i < first[d + 1]; i++) {
+                uint32_t t = edges[i].ino;
+                if (!(fs.state[t] & ST_OK)) {
+                    // A damaged inode (reported by pass 1) stays allocated;
+                    // what it maps, and below it, is unknown.
+                    if (fs.state[t] & ST_USED) {
+                        if (!(fs.state[t] & ST_REACH)) damaged++;
+                        fs.state[t] |= ST_REACH;
+                    } else {
+                        add_problem(w0, d, P_DIRENT_FREE, t, 0);
+                    }
+                    continue;
+                }
+                int is_dir = (fs.state[t] & ST_DIR) != 0;
+                if ((edges[i].type == VSFS_DT_DIR) != is_dir) add_problem(w0, d, P_DIRENT_TYPE, t, 0);
+                if (!is_dir) {
+                    links[t]++;
+                    // Root keeps its historical one-link-per-file count.
+                    if (d == ROOT_INO) links[ROOT_INO]++;
+                    if (!(fs.state[t] & ST_REACH)) {
+                        fs.state[t] |= ST_REACH;
+                        files++;
+                    }
+                    continue;
+                }
+                if (fs.state[t] & ST_REACH) {
+                    add_problem(w0, t, P_DIR_PARENTS, d, 0);
+                    continue;
+                }
+                fs.state[t] |= ST_REACH;
+                links[t] += 2;
+                links[d]++;
+                if (fs.dotdot[t] != d) add_problem(w0, t, P_DOTDOT, fs.dotdot[t], d);
+                queue[qt++] = t;
+                dirs++;
+            }
+        }
+    }
+    free(queue);
+    free(edges);
+    free(first);
+
+    for (uint64_t ino = 1; ino <= icount; ino++) {
+        uint8_t s = fs.state[ino];
+        int allocated = BIT_TEST(fs.ibm, ino - 1);
+        if (s & ST_REACH) {
+            if (!allocated) add_problem(w0, ino, P_IBM_MISSING, 0, 0);
+            if (!(s & ST_OK)) continue;
+            uint32_t want = links[ino] < 0xFFFF ? links[ino] : 0xFFFF;   // links saturate
+            if (fs.itab[ino - 1].links != want) add_problem(w0, ino, P_LINKS, fs.itab[ino - 1].links, want);
+        } else if (allocated) {
+            add_problem(w0, ino, P_UNREACHABLE, 0, 0);
+        }
+    }
+
+    // Pass 3 (parallel): map every reachable inode's blocks, pointer blocks
+    // included, catching bad pointers and blocks mapped twice.
+    if (rc == 0 && run_pass(&fs, ws, (int)nthreads, map_inode, 1, icount) != 0) return 1;
+
+    // Pass 4: the data bitmap (and reference counts and fragment block
+    // headers) against what is actually mapped. Shared file data must not
+    // also be owned outright, and a fragment block holds nothing else.
+    uint64_t used_blocks = 0, leaked = 0, missing = 0, ref_bad = 0, frag_bad = 0, frag_clash = 0;
+    for (uint64_t b = 0; b < dblocks; b++) {
+        uint32_t owner = atomic_load(&fs.owner[b]), refs = fs.refs ? atomic_load(&fs.refs[b]) : 0;
+        uint32_t frags = atomic_load(&fs.frags[b]);
+        int used = owner != 0 || refs != 0 || frags != 0;
+        int bit = BIT_TEST(fs.dbm, b);
+        used_blocks += (uint64_t)used;
+        if (used && !bit) missing++;
+        if (!used && bit) leaked++;
+        if (owner && refs) add_problem(w0, owner, P_DUP_BLOCK, dstart + b, 0);
+        if (fs.refcnt && fs.refcnt[b] != (refs > 1 ? refs - 1 : 0)) ref_bad++;
+        if (frags && (owner || refs)) frag_clash++;
+        else if (frags && !frag_hdr_ok(&fs, b)) frag_bad++;
+    }
+    // The next tail goes into the block the superblock names: it has to be
+    // a fragment block still in use.
+    vsfs_sb_ext_t *ext = (vsfs_sb_ext_t*)(img + VSFS_SB_EXT_OFFSET);
+    int hint_bad = ext->frag_block != 0 && (!data_block(&fs, (uint32_t)ext->frag_block) ||
+                                            ext->frag_block != (uint32_t)ext->frag_block ||
+                                            atomic_load(&fs.frags[ext->frag_block - dstart]) == 0);
+
+    // Pass 5 (parallel): every block against the block CRC table.
+    uint64_t crc_bad = 0;
+    if (fs.crctab && run_pass(&fs, ws, (int)nthreads, check_block, 0, fs.nblocks) != 0) return 1;
+
+    size_t nprobs = 0;
+    for (long t = 0; t < nthreads; t++) {
+        damaged += ws[t].partial;
+        crc_bad += ws[t].crc_bad;
+        if (ws[t].oom) {
+            fprintf(stderr, "Error: OOM\n");
+            return 1;
+        }
+        nprobs += ws[t].nprobs;
+    }
+    problem_t *probs = (problem_t*)malloc((nprobs ? nprobs : 1) * sizeof(problem_t));
+    if (!probs) {
+        fprintf(stderr, "Error: OOM\n");
+        return 1;
+    }
+    nprobs = 0;
+    for (long t = 0; t < nthreads; t++) {
+        if (ws[t].nprobs) memcpy(probs + nprobs, ws[t].probs, ws[t].nprobs * sizeof(problem_t));
+        nprobs += ws[t].nprobs;
+        free(ws[t].probs);
+    }
+    qsort(probs, nprobs, sizeof(problem_t), prob_cmp);
+    uint64_t fixable = missing + crc_bad + ref_bad + frag_bad + (uint64_t)hint_bad + (damaged ? 0 : leaked), dups = 0, nunreach = 0;
+    for (size_t i = 0; i < nprobs; i++) {
+        print_problem(&probs[i]);
+        if (probs[i].kind == P_UNREACHABLE) nunreach++;
+        else if (repairable(probs[i].kind)) fixable++;
+        if (probs[i].kind == P_DUP_BLOCK) dups++;
+    }
+    if (!damaged) fixable += nunreach;
+    if (missing) fprintf(stderr, "Error: %" PRIu64 " data blocks are in use but marked free\n", missing);
+    if (leaked)  fprintf(stderr, "Error: %" PRIu64 " data blocks are marked used but not mapped by any file (leaked)\n", leaked);
+    if (ref_bad) fprintf(stderr, "Error: %" PRIu64 " data blocks have a wrong reference count\n", ref_bad);
+    if (frag_clash) fprintf(stderr, "Error: %" PRIu64 " fragment blocks are also mapped as whole blocks\n", frag_clash);
+    if (frag_bad) fprintf(stderr, "Error: %" PRIu64 " fragment blocks have a wrong header\n", frag_bad);
+    if (hint_bad) fprintf(stderr, "Error: superblock names block %" PRIu64 " as the fragment block to fill, which holds no fragments\n",
+                          (uint64_t)ext->frag_block);
+    if (crc_bad) fprintf(stderr, "Error: %" PRIu64 " blocks do not match the block CRC table\n", crc_bad);
+    const uint64_t total = nprobs + leaked + missing + ref_bad + frag_clash + frag_bad + (uint64_t)hint_bad + crc_bad;
+
+    // With damaged inodes in the tree, blocks and inodes that look unused
+    // may still belong to them: repair then marks things used, never free.
+    if (damaged && (leaked || nunreach))
+        fprintf(stderr, "Error: %" PRIu64 " damaged inodes in the tree; not freeing %" PRIu64 " leaked blocks or %" PRIu64
+                " leaked inodes they may still own\n", damaged, leaked, nunreach);
+
+    uint64_t fixed = 0;
+    if (repair && total > 0 && rc == 0) {
+        // Copies for double-mapped blocks first: they take free blocks and
+        // have to be in the bitmap rebuilt below.
+        if (dups) {
+            clone_t cl = { &fs, (uint8_t*)calloc(1, (size_t)((dblocks + 7) / 8)), 0, 0, 0, 0 };
+            if (!cl.taken) {
+                fprintf(stderr, "Error: OOM\n");
+                return 1;
+            }
+            for (uint64_t ino = 1; ino <= icount; ino++) {
+                if ((fs.state[ino] & (ST_OK | ST_REACH)) != (ST_OK | ST_REACH)) continue;
+                uint64_t before = cl.cloned;
+                inode_t *node = &fs.itab[ino - 1];
+                cl.ino = ino;
+                inode_walk(&fs, node, clone_block, &cl);
+                if (cl.cloned != before) {
+                    vsfs_inode_crc_finalize(node);
+                    fs_mark(&fs, node);
+                }
+            }
+            free(cl.taken);
+            if (cl.failed) fprintf(stderr, "Error: no free block left to copy a double-mapped block into\n");
+            else fixed += dups;
+            // Copies may have taken shared references away; count again.
+            if (fs.refs) {
+                // Dropping the pages zeroes them without touching the rest.
+                madvise((void*)fs.refs, (size_t)(dblocks ? dblocks : 1) * sizeof(uint32_t), MADV_DONTNEED);
+                for (uint64_t ino = 1; ino <= icount; ino++) {
+                    if ((fs.state[ino] & (ST_OK | ST_REACH)) != (ST_OK | ST_REACH)) continue;
+                    claim_t c = { w0, ino };
+                    inode_walk(&fs, &fs.itab[ino - 1], recount_block, &c);
+                }
+            }
+        }
+        for (size_t i = 0; i < nprobs; i++) {
+            if (probs[i].kind != P_LINKS) continue;
+            inode_t *node = &fs.itab[probs[i].ino - 1];
+            node->links = (uint16_t)probs[i].b;
+            vsfs_inode_crc_finalize(node);
+            fs_mark(&fs, node);
+            fixed++;
+        }
+        // Rebuild both bitmaps from what is reachable and mapped.
+        for (uint64_t ino = 1; ino <= icount; ino++) {
+            int want = (fs.state[ino] & ST_REACH) != 0;
+            if (want == (int)BIT_TEST(fs.ibm, ino - 1) || (!want && damaged)) continue;
+            if (want) BIT_SET(fs.ibm, ino - 1);
+            else      BIT_CLEAR(fs.ibm, ino - 1);
+            fs_mark(&fs, &fs.ibm[(ino - 1) >> 3]);
+            fixed++;
+        }
+        // Counts only go up while damaged inodes may hold references too.
+        for (uint64_t b = 0; fs.refcnt && b < dblocks; b++) {
+            uint32_t refs = atomic_load(&fs.refs[b]), want = refs > 1 ? refs - 1 : 0;
+            if (fs.refcnt[b] == want || (want < fs.refcnt[b] && damaged)) continue;
+            fs.refcnt[b] = want;
+            fs_mark(&fs, &fs.refcnt[b]);
+        }
+        if (!damaged) fixed += ref_bad;
+        // Fragment headers from the tails that point into them. With
+        // damaged inodes a count may only go up.
+        for (uint64_t b = 0; b < dblocks; b++) {
+            uint32_t frags = atomic_load(&fs.frags[b]);
+            if (!frags || atomic_load(&fs.owner[b]) || (fs.refs && atomic_load(&fs.refs[b])) || frag_hdr_ok(&fs, b)) continue;
+            vsfs_frag_hdr_t *h = (vsfs_frag_hdr_t*)(img + (dstart + b) * BS);
+            int valid = h->magic == VSFS_FRAG_MAGIC && h->end >= sizeof(*h) && h->end <= BS;
+            if (!valid || h->live < frags || !damaged) h->live = (uint16_t)(frags > UINT16_MAX ? UINT16_MAX : frags);
+            if (!valid || h->end < atomic_load(&fs.frag_end[b])) h->end = (uint16_t)atomic_load(&fs.frag_end[b]);
+            h->magic = VSFS_FRAG_MAGIC;
+            fs_mark(&fs, h);
+            fixed += (uint64_t)frag_hdr_ok(&fs, b);
+        }
+        if (hint_bad) {
+            ext->frag_block = 0;
+            vsfs_superblock_crc_finalize(sb);
+            fs_mark(&fs, ext);
+            fixed++;
+        }
+        for (uint64_t b = 0; b < dblocks; b++) {
+            int want = atomic_load(&fs.owner[b]) != 0 || (fs.refs && atomic_load(&fs.refs[b]) != 0) ||
+                       atomic_load(&fs.frags[b]) != 0;
+            if (want == (int)BIT_TEST(fs.dbm, b) || (!want && damaged)) continue;
+            if (want) BIT_SET(fs.dbm, b);
+            else      BIT_CLEAR(fs.dbm, b);
+            fs_mark(&fs, &fs.dbm[b >> 3]);
+        }
+        fixed += missing + (damaged ? 0 : leaked);
+        // Last, so the table also covers every block repaired above.
+        if (fs.crctab) {
+            for (uint64_t b = 0; b < fs.nblocks; b++) {
+                if (!BIT_TEST(fs.dirty, b) && !BIT_TEST(fs.stale, b)) continue;
+                if (b - fs.crc_start < fs.crc_blocks || b - fs.jnl_start < fs.jnl_blocks) continue;
+                uint32_t e = vsfs_block_crc(img + b * BS);
+                if (fs.crctab[b] == e) continue;
+                fs.crctab[b] = e;
+                fs_mark(&fs, &fs.crctab[b]);
+            }
+            fixed += crc_bad;
+        }
+        uint64_t written = 0;
+        if (write_dirty(fd, &fs, &written) != 0) {
+            perror("pwrite");
+            rc = 1;
+        } else {
+            fprintf(stderr, "%s: repaired %" PRIu64 " of %" PRIu64 " problems (%" PRIu64 " blocks written) -> %s\n",
+                    fixed == total ? "OK" : "Error", fixed, total, written, img_path);
+        }
+    }
+    if (total > fixed) rc = 1;
+    if (total == 0)
+        fprintf(stderr, "OK: %s is clean: %" PRIu64 " files, %" PRIu64 " directories, %" PRIu64 " of %" PRIu64 " data blocks in use\n",
+                img_path, files, dirs, used_blocks, dblocks);
+    else if (!repair)
+        fprintf(stderr, "Error: %s: %" PRIu64 " problems found (%" PRIu64 " repairable with --repair)\n",
+                img_path, total, fixable);
+
+    free(probs);
+    free(links);
+    free(ws);
+    free(fs.state);
+    free(fs.dotdot);
+    block_table_free(fs.owner, dblocks);
+    block_table_free(fs.refs, dblocks);
+    block_table_free(fs.frags, dblocks);
+    block_table_free(fs.frag_end, dblocks);
+    free(fs.dirty);
+    free(fs.stale);
+    munmap(img, flen);
+    close(fd);
+    return rc;
+}
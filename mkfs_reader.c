@@ -0,0 +1,223 @@
+// Build: make mkfs_reader   (links libminivsfs.a)
+//
+// Reads MiniVSFS images back: lists directories, streams one file to
+// stdout and extracts the whole tree to a host directory. File contents
+// go out with sendfile() from the image file (see vsfs_read_fd()), one
+// call per run of contiguous blocks.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+
+#define NAME_MAX_ VSFS_NAME_MAX
+#define MAX_DEPTH 256
+
+// Resolve a '/'-separated path from the root. Returns the inode number, or
+// 0 with the error printed.
+static uint64_t path_lookup(vsfs_t *h, const char *path) {
+    uint64_t ino;
+    int rc = vsfs_resolve(h, path, &ino);
+    if (rc < 0) fprintf(stderr, "Error: %s: %s\n", path, vsfs_errmsg());
+    if (rc > 0) fprintf(stderr, "Error: %s: no such file or directory\n", path);
+    return rc == 0 ? ino : 0;
+}
+
+static int ls_fn(void *ctx, const dirent64_t *de) {
+    inode_t node;
+    if (vsfs_stat((vsfs_t*)ctx, de->inode_no, &node) != 0) {
+        fprintf(stderr, "Error: %s\n", vsfs_errmsg());
+        return 1;
+    }
+    int is_dir = (node.mode & VSFS_S_IFMT) == VSFS_S_IFDIR;
+    printf("%10" PRIu32 "  %c  %12" PRIu64 "  %.*s%s\n", de->inode_no,
+           is_dir ? 'd' : '-', node.size_bytes, NAME_MAX_, de->name, is_dir ? "/" : "");
+    return 0;
+}
+
+typedef struct {
+    vsfs_t  *h;
+    char    *path;           // host path buffer, current directory
+    size_t   len, cap;
+    int      depth;
+    uint64_t files, dirs, bytes, failed;
+} extract_t;
+
+// Append "/name" to the host path, or return -1 when the name could
+// escape the target directory.
+static int path_push(extract_t *x, const dirent64_t *de) {
+    size_t nlen = strnlen(de->name, NAME_MAX_);
+    if (nlen == 0 || memchr(de->name, '/', nlen)) return -1;
+    if (x->len + 1 + nlen + 1 > x->cap) {
+        size_t ncap = (x->len + 1 + nlen + 1) * 2;
+        char *np = (char*)realloc(x->path, ncap);
+        if (!np) return -1;
+        x->path = np;
+        x->cap = ncap;
+    }
+    x->path[x->len] = '/';
+    memcpy(x->path + x->len + 1, de->name, nlen);
+    x->path[x->len + 1 + nlen] = '\0';
+    x->len += 1 + nlen;
+    return 0;
+}
+
+static void path_pop(extract_t *x, size_t len) {
+    x->len = len;
+    x->path[len] = '\0';
+}
+
+static int extract_fn(void *ctx, const dirent64_t *de) {
+    extract_t *x = (extract_t*)ctx;
+    size_t saved = x->len;
+    if (path_push(x, de) != 0) {
+        fprintf(stderr, "Error: entry '%.*s' has an unusable name, skipped\n", NAME_MAX_, de->name);
+        x->failed++;
+        return 0;
+    }
+    inode_t node;
+    if (vsfs_stat(x->h, de->inode_no, &node) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", x->path, vsfs_errmsg());
+        x->failed++;
+    } else if ((node.mode & VSFS_S_IFMT) == VSFS_S_IFDIR) {
+        if (x->depth >= MAX_DEPTH) {
+            fprintf(stderr, "Error: %s: directories nested too deep (loop?)\n", x->path);
+            x->failed++;
+        } else if (mkdir(x->path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: %s: %s\n", x->path, strerror(errno));
+            x->failed++;
+        } else {
+            x->dirs++;
+            x->depth++;
+            if (vsfs_readdir(x->h, de->inode_no, extract_fn, x) < 0) {
+                fprintf(stderr, "Error: %s: %s\n", x->path, vsfs_errmsg());
+                x->failed++;
+            }
+            x->depth--;
+        }
+    } else if ((node.mode & VSFS_S_IFMT) == VSFS_S_IFREG) {
+        int fd = open(x->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Error: %s: %s\n", x->path, strerror(errno));
+            x->failed++;
+        } else {
+            int rc = 0;
+            if (vsfs_read_fd(x->h, de->inode_no, fd) != 0) {
+                fprintf(stderr, "Error: %s: %s\n", x->path, vsfs_errmsg());
+                rc = 1;
+            }
+            if (close(fd) != 0 && rc == 0) {
+                fprintf(stderr, "Error: %s: %s\n", x->path, strerror(errno));
+                rc = 1;
+            }
+            if (rc) x->failed++;
+            else {
+                x->files++;
+                x->bytes += node.size_bytes;
+            }
+        }
+    } else {
+        fprintf(stderr, "Warning: %s: inode %" PRIu32 " is neither a file nor a directory, skipped\n", x->path, de->inode_no);
+    }
+    path_pop(x, saved);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *img_path = NULL, *cat_path = NULL, *ls_path = NULL, *out_dir = NULL;
+    int do_ls = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i+1 < argc)        img_path = argv[++i];
+        else if (strcmp(argv[i], "--ls") == 0) {
+            do_ls = 1;
+            if (i+1 < argc && argv[i+1][0] != '-') ls_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cat") == 0 && i+1 < argc)     cat_path = argv[++i];
+        else if (strcmp(argv[i], "--extract") == 0 && i+1 < argc) out_dir  = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s --image fs.img (--ls [dir] | --cat <path> | --extract <host_dir>)\n", argv[0]);
+            return 2;
+        }
+    }
+    if (!img_path || do_ls + !!cat_path + !!out_dir != 1) {
+        fprintf(stderr, "Error: --image and exactly one of --ls, --cat or --extract are required\n");
+        return 2;
+    }
+
+    vsfs_t *h;
+    if (vsfs_open(img_path, VSFS_VIEW, &h) != 0) {
+        fprintf(stderr, "Error: %s: %s\n", img_path, vsfs_errmsg());
+        return 1;
+    }
+    int rc = 0;
+
+    if (do_ls) {
+        uint64_t ino = path_lookup(h, ls_path ? ls_path : "/");
+        if (ino == 0) {
+            rc = 1;
+        } else {
+            int wrc = vsfs_readdir(h, ino, ls_fn, h);
+            if (wrc < 0) fprintf(stderr, "Error: %s\n", vsfs_errmsg());
+            if (wrc != 0) rc = 1;
+        }
+        if (fflush(stdout) != 0) {
+            perror("stdout");
+            rc = 1;
+        }
+    } else if (cat_path) {
+        uint64_t ino = path_lookup(h, cat_path);
+        inode_t node;
+        if (ino == 0) {
+            rc = 1;
+        } else if (vsfs_stat(h, ino, &node) != 0) {
+            fprintf(stderr, "Error: %s: %s\n", cat_path, vsfs_errmsg());
+            rc = 1;
+        } else if ((node.mode & VSFS_S_IFMT) != VSFS_S_IFREG) {
+            fprintf(stderr, "Error: %s: not a regular file\n", cat_path);
+            rc = 1;
+        } else if (vsfs_read_fd(h, ino, STDOUT_FILENO) != 0) {
+            fprintf(stderr, "Error: %s: %s\n", cat_path, vsfs_errmsg());
+            rc = 1;
+        }
+    } else {
+        extract_t x;
+        memset(&x, 0, sizeof(x));
+        x.h = h;
+        x.len = strlen(out_dir);
+        x.cap = x.len + 256;
+        x.path = (char*)malloc(x.cap);
+        if (!x.path) {
+            fprintf(stderr, "Error: OOM\n");
+            vsfs_close(h);
+            return 1;
+        }
+        memcpy(x.path, out_dir, x.len + 1);
+        while (x.len > 1 && x.path[x.len - 1] == '/') x.path[--x.len] = '\0';
+        if (mkdir(x.path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: %s: %s\n", x.path, strerror(errno));
+            rc = 1;
+        } else {
+            if (vsfs_readdir(h, VSFS_ROOT_INO, extract_fn, &x) < 0) {
+                fprintf(stderr, "Error: %s\n", vsfs_errmsg());
+                x.failed++;
+            }
+            rc = x.failed ? 1 : 0;
+            fprintf(stderr, "%s: extracted %" PRIu64 " files (%" PRIu64 " bytes) and %" PRIu64 " directories -> %s",
+                    rc ? "Error" : "OK", x.files, x.bytes, x.dirs, out_dir);
+            if (x.failed) fprintf(stderr, ", %" PRIu64 " failed", x.failed);
+            fputc('\n', stderr);
+        }
+        free(x.path);
+    }
+
+    vsfs_close(h);
+    return rc;
+}
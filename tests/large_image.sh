@@ -0,0 +1,42 @@
+#!/bin/sh
+# Large-image check behind `make check`. Builds a sparse 64 GiB image, so
+# larger than memory on most hosts, with multi-block inode and data
+# bitmaps. A 128 MiB file fills the first data bitmap block. A second
+# file added in place then has to come from the second bitmap block.
+# mkfs_fsck must find the image clean, both files must read back, and
+# the image must stay sparse. Needs about 150 MiB of free disk in TMPDIR.
+# Usage: sh tests/large_image.sh   (run from the top directory)
+set -e
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+IMG="$WORK/big.img"
+
+fail() { echo "Error: large_image: $*" >&2; exit 1; }
+# sb OFFSET: the 64-bit superblock field at that byte offset.
+sb() { od -An -t u8 -j "$1" -N 8 "$IMG" | tr -d ' '; }
+# bitmap_block N: checksum of block N of the data bitmap.
+bitmap_block() { dd if="$IMG" bs=4096 skip=$((DBM_START + $1)) count=1 2>/dev/null | cksum; }
+
+./mkfs_builder --image "$IMG" --size-kib $((64 * 1024 * 1024)) --inodes 40000 2>/dev/null
+IBM_BLOCKS=$(sb 36); DBM_START=$(sb 44); DBM_BLOCKS=$(sb 52)
+[ "$IBM_BLOCKS" -gt 1 ] && [ "$DBM_BLOCKS" -gt 1 ] || fail "bitmaps are $IBM_BLOCKS and $DBM_BLOCKS blocks, want more than one each"
+[ "$(du -k "$IMG" | cut -f1)" -lt 1024 ] || fail "a fresh image is not sparse"
+
+# 32768 blocks of data plus their pointer blocks fill the 32768 bits of
+# the first data bitmap block (the root directory holds one).
+yes "MiniVSFS large image check, first file" | head -c $((32768 * 4096)) > "$WORK/fill"
+./mkfs_adder --input "$IMG" --in-place --file "$WORK/fill" >/dev/null 2>&1 || fail "adding the fill file failed"
+FULL=$(dd if="$IMG" bs=4096 skip="$DBM_START" count=1 2>/dev/null | od -An -v -t x1 | tr -s ' ' '\n' | grep -c '^ff$')
+[ "$FULL" -eq 4096 ] || fail "the first data bitmap block is not full ($FULL of 4096 bytes)"
+
+BEFORE=$(bitmap_block 1)
+yes "MiniVSFS large image check, second file" | head -c 100000 > "$WORK/next"
+./mkfs_adder --input "$IMG" --in-place --file "$WORK/next" >/dev/null 2>&1 || fail "adding in place failed"
+[ "$(bitmap_block 1)" != "$BEFORE" ] || fail "the second file was not allocated from the second bitmap block"
+
+./mkfs_fsck --image "$IMG" 2>"$WORK/fsck" || { cat "$WORK/fsck" >&2; fail "mkfs_fsck found problems"; }
+grep -q "is clean" "$WORK/fsck" || fail "mkfs_fsck did not report the image clean"
+./mkfs_reader --image "$IMG" --cat fill | cmp -s - "$WORK/fill" || fail "fill reads back wrong"
+./mkfs_reader --image "$IMG" --cat next | cmp -s - "$WORK/next" || fail "next reads back wrong"
+[ "$(du -k "$IMG" | cut -f1)" -lt $((160 * 1024)) ] || fail "the image is no longer sparse"
+echo "OK: large_image: 64 GiB image with $IBM_BLOCKS+$DBM_BLOCKS bitmap blocks checks clean"
@@ -0,0 +1,133 @@
+// Word-at-a-time bitmap allocator. See vsfs_bitmap.h.
+#include "vsfs_bitmap.h"
+
+// Bits [64*wi, 64*wi + 64) as a word, bit k of the word = bitmap bit
+// 64*wi + k. Bits past nbits read as used so scans never return them.
+static uint64_t load_word(const vsfs_bitmap_t *bm, uint64_t wi) {
+    uint64_t first = wi * 64;
+    uint64_t w = 0;
+    if (first + 64 <= bm->nbits) {
+        const uint8_t *p = bm->bits + wi * 8;
+        for (int k = 0; k < 8; k++) w |= (uint64_t)p[k] << (8 * k);
+        return w;
+    }
+    uint64_t nbytes = (bm->nbits - first + 7) / 8;
+    for (uint64_t k = 0; k < nbytes; k++) w |= (uint64_t)bm->bits[wi * 8 + k] << (8 * k);
+    return w | (~0ull << (bm->nbits - first));
+}
+
+static uint64_t word_count(const vsfs_bitmap_t *bm) {
+    return (bm->nbits + 63) / 64;
+}
+
+void vsfs_bitmap_init(vsfs_bitmap_t *bm, uint8_t *bits, uint64_t nbits) {
+    bm->bits = bits;
+    bm->nbits = nbits;
+    bm->next_free = 0;
+    bm->free_count = 0;
+    bm->scanned = word_count(bm) * 64;
+    for (uint64_t wi = 0; wi < word_count(bm); wi++)
+        bm->free_count += (uint64_t)__builtin_popcountll(~load_word(bm, wi));
+    bm->next_free = vsfs_bitmap_find_free(bm, 0);
+    if (bm->next_free == VSFS_BITMAP_NONE) bm->next_free = nbits;
+}
+
+int vsfs_bitmap_test(const vsfs_bitmap_t *bm, uint64_t bit) {
+    return (bm->bits[bit >> 3] >> (bit & 7)) & 1u;
+}
+
+uint64_t vsfs_bitmap_find_free(vsfs_bitmap_t *bm, uint64_t from) {
+    if (from >= bm->nbits) return VSFS_BITMAP_NONE;
+    uint64_t nw = word_count(bm);
+    uint64_t wi = from >> 6;
+    // Treat bits below from as used in the first word.
+    uint64_t w = load_word(bm, wi) | ((1ull << (from & 63)) - 1);
+    for (;;) {
+        bm->scanned += 64;
+        if (~w) return wi * 64 + (uint64_t)__builtin_ctzll(~w);
+        if (++wi == nw) return VSFS_BITMAP_NONE;
+        w = load_word(bm, wi);
+    }
+}
+
+uint64_t vsfs_bitmap_find_run(vsfs_bitmap_t *bm, uint64_t n) {
+    if (n == 0 || n > bm->free_count) return VSFS_BITMAP_NONE;
+    uint64_t nw = word_count(bm);
+    uint64_t run_start = 0, run_len = 0;
+    for (uint64_t wi = bm->next_free >> 6; wi < nw; wi++) {
+        bm->scanned += 64;
+        uint64_t w = load_word(bm, wi);
+        if (w == 0) {
+            // whole word free: extend (or start) the run by 64
+            if (run_len == 0) run_start = wi * 64;
+            run_len += 64;
+            if (run_len >= n) return run_start;
+            continue;
+        }
+        if (w == ~0ull) { run_len = 0; continue; }
+        // mixed word: walk alternating free/used stretches with ctz
+        unsigned pos = 0;
+        while (pos < 64) {
+            uint64_t rest = w >> pos;
+            if (rest & 1) {
+                // used stretch ends the run; ~rest is non-zero because the
+                // shift brought in zeros (or, at pos 0, w is not all ones)
+                run_len = 0;
+                pos += (unsigned)__builtin_ctzll(~rest);
+            } else {
+                // free stretch: length up to the next used bit or word end
+                unsigned len = rest ? (unsigned)__builtin_ctzll(rest) : 64 - pos;
+                if (run_len == 0) run_start = wi * 64 + pos;
+                run_len += len;
+                if (run_len >= n) return run_start;
+                pos += len;
+            }
+        }
+    }
+    return VSFS_BITMAP_NONE;
+}
+
+void vsfs_bitmap_set(vsfs_bitmap_t *bm, uint64_t bit) {
+    if (vsfs_bitmap_test(bm, bit)) return;
+    bm->bits[bit >> 3] |= (uint8_t)(1u << (bit & 7));
+    bm->free_count--;
+    if (bit == bm->next_free) bm->next_free = bit + 1;
+}
+
+void vsfs_bitmap_free(vsfs_bitmap_t *bm, uint64_t bit) {
+    if (!vsfs_bitmap_test(bm, bit)) return;
+    bm->bits[bit >> 3] &= (uint8_t)~(1u << (bit & 7));
+    bm->free_count++;
+    if (bit < bm->next_free) bm->next_free = bit;
+}
+
+uint64_t vsfs_bitmap_alloc(vsfs_bitmap_t *bm) {
+    if (bm->free_count == 0) return VSFS_BITMAP_NONE;
+    uint64_t bit = vsfs_bitmap_find_free(bm, bm->next_free);
+    if (bit == VSFS_BITMAP_NONE) return VSFS_BITMAP_NONE;
+    vsfs_bitmap_set(bm, bit);
+    bm->next_free = bit + 1;
+    return bit;
+}
+
+int vsfs_bitmap_alloc_n(vsfs_bitmap_t *bm, uint64_t n, uint64_t *out) {
+    if (n > bm->free_count) return -1;
+    uint64_t start = vsfs_bitmap_find_run(bm, n);
+    if (start != VSFS_BITMAP_NONE) {
+        for (uint64_t k = 0; k < n; k++) {
+            vsfs_bitmap_set(bm, start + k);
+            out[k] = start + k;
+        }
+        return 0;
+    }
+    // No run long enough: take the lowest free bits. free_count guarantees
+    // there are n of them.
+    uint64_t from = bm->next_free;
+    for (uint64_t k = 0; k < n; k++) {
+        uint64_t bit = vsfs_bitmap_find_free(bm, from);
+        vsfs_bitmap_set(bm, bit);
+        out[k] = bit;
+        from = bit + 1;
+    }
+    return 0;
+}
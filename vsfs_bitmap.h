@@ -0,0 +1,45 @@
+// Bitmap allocator for MiniVSFS inode and data bitmaps.
+//
+// Works directly on the on-disk bitmap bytes (bit i lives in byte i>>3,
+// bit i&7) and scans them 64 bits at a time. A next-free hint and a free
+// count are kept alongside, so allocations never rescan the already-full
+// prefix and "is there room for N?" is answered without scanning at all.
+#ifndef VSFS_BITMAP_H
+#define VSFS_BITMAP_H
+
+#include <stdint.h>
+
+#define VSFS_BITMAP_NONE UINT64_MAX
+
+typedef struct {
+    uint8_t  *bits;        // bitmap bytes, at least (nbits + 7) / 8 of them
+    uint64_t  nbits;
+    uint64_t  next_free;   // no free bit below this index
+    uint64_t  free_count;
+    uint64_t  scanned;     // bits examined by init and searches so far (statistics)
+} vsfs_bitmap_t;
+
+// Attach to an existing bitmap and compute the hints from its contents.
+void vsfs_bitmap_init(vsfs_bitmap_t *bm, uint8_t *bits, uint64_t nbits);
+
+int vsfs_bitmap_test(const vsfs_bitmap_t *bm, uint64_t bit);
+
+// First free bit at or after from, or VSFS_BITMAP_NONE. Does not allocate.
+uint64_t vsfs_bitmap_find_free(vsfs_bitmap_t *bm, uint64_t from);
+
+// Start of the first run of n free bits, or VSFS_BITMAP_NONE. Single pass.
+uint64_t vsfs_bitmap_find_run(vsfs_bitmap_t *bm, uint64_t n);
+
+// Allocate the lowest free bit; returns it or VSFS_BITMAP_NONE.
+uint64_t vsfs_bitmap_alloc(vsfs_bitmap_t *bm);
+
+// Allocate n bits into out[], all or nothing. A contiguous run is used when
+// one exists, otherwise the lowest free bits. Returns 0, or -1 when fewer
+// than n bits are free (nothing is allocated then).
+int vsfs_bitmap_alloc_n(vsfs_bitmap_t *bm, uint64_t n, uint64_t *out);
+
+// Mark a bit used / free and keep the hints in step.
+void vsfs_bitmap_set(vsfs_bitmap_t *bm, uint64_t bit);
+void vsfs_bitmap_free(vsfs_bitmap_t *bm, uint64_t bit);
+
+#endif
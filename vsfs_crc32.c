@@ -0,0 +1,298 @@
+// Fast CRC32 engines for MiniVSFS. See vsfs_crc32.h.
+#include "vsfs_crc32.h"
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define VSFS_HAVE_PCLMUL 1
+#include <immintrin.h>
+#else
+#define VSFS_HAVE_PCLMUL 0
+#endif
+
+// CRC_TAB[0] is the classic byte table; CRC_TAB[k][i] is the CRC of byte i
+// followed by k zero bytes, which is what slicing-by-N looks up.
+static uint32_t CRC_TAB[16][256];
+static int crc_ready = 0;
+
+typedef uint32_t (*crc_fn)(uint32_t c, const uint8_t *p, size_t n);
+static crc_fn crc_engine;
+static vsfs_crc_impl_t crc_engine_id;
+
+static inline uint32_t load_le32(const uint8_t *p) {
+    uint32_t v; memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+// All engines work on the raw shift register: the caller applies the
+// initial and final inversion.
+static uint32_t crc_bytewise(uint32_t c, const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) c = CRC_TAB[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+static uint32_t crc_slice8(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 8) {
+        uint32_t a = load_le32(p) ^ c, b = load_le32(p + 4);
+        c = CRC_TAB[7][a & 0xFF] ^ CRC_TAB[6][(a >> 8) & 0xFF] ^ CRC_TAB[5][(a >> 16) & 0xFF] ^ CRC_TAB[4][a >> 24] ^
+            CRC_TAB[3][b & 0xFF] ^ CRC_TAB[2][(b >> 8) & 0xFF] ^ CRC_TAB[1][(b >> 16) & 0xFF] ^ CRC_TAB[0][b >> 24];
+        p += 8; n -= 8;
+    }
+    return crc_bytewise(c, p, n);
+}
+
+static uint32_t crc_slice16(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 16) {
+        uint32_t a = load_le32(p) ^ c, b = load_le32(p + 4), d = load_le32(p + 8), e = load_le32(p + 12);
+        c = CRC_TAB[15][a & 0xFF] ^ CRC_TAB[14][(a >> 8) & 0xFF] ^ CRC_TAB[13][(a >> 16) & 0xFF] ^ CRC_TAB[12][a >> 24] ^
+            CRC_TAB[11][b & 0xFF] ^ CRC_TAB[10][(b >> 8) & 0xFF] ^ CRC_TAB[9][(b >> 16) & 0xFF]  ^ CRC_TAB[8][b >> 24]  ^
+            CRC_TAB[7][d & 0xFF]  ^ CRC_TAB[6][(d >> 8) & 0xFF]  ^ CRC_TAB[5][(d >> 16) & 0xFF]  ^ CRC_TAB[4][d >> 24]  ^
+            CRC_TAB[3][e & 0xFF]  ^ CRC_TAB[2][(e >> 8) & 0xFF]  ^ CRC_TAB[1][(e >> 16) & 0xFF]  ^ CRC_TAB[0][e >> 24];
+        p += 16; n -= 16;
+    }
+    return crc_bytewise(c, p, n);
+}
+
+#if VSFS_HAVE_PCLMUL
+// Carry-less multiply folding ("Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ", Gopal et al.), bit-reflected constants for 0xEDB88320:
+// four 128-bit lanes are folded 64 bytes at a time, then reduced to one lane,
+// to 64 bits and finally Barrett-reduced to 32 bits.
+static const uint64_t K1K2[2] __attribute__((aligned(16))) = { 0x0154442bd4ull, 0x01c6e41596ull };
+static const uint64_t K3K4[2] __attribute__((aligned(16))) = { 0x01751997d0ull, 0x00ccaa009eull };
+static const uint64_t K5K0[2] __attribute__((aligned(16))) = { 0x0163cd6124ull, 0x0000000000ull };
+static const uint64_t POLY[2] __attribute__((aligned(16))) = { 0x01db710641ull, 0x01f7011641ull };
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_fold_pclmul(uint32_t c, const uint8_t *p, size_t n) {
+    // The folding core needs at least 64 bytes and whole 16-byte lanes.
+    if (n < 64) return crc_slice16(c, p, n);
+    size_t tail = n & 15;
+    n -= tail;
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    x0 = _mm_load_si128((const __m128i*)K1K2);
+    p += 64; n -= 64;
+
+    // Fold four lanes in parallel while whole 64-byte blocks remain.
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        p += 64; n -= 64;
+    }
+
+    // Fold the four lanes into one.
+    x0 = _mm_load_si128((const __m128i*)K3K4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Remaining 16-byte lanes.
+    while (n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16; n -= 16;
+    }
+
+    // 128 -> 64 bits.
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)K5K0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits.
+    x0 = _mm_load_si128((const __m128i*)POLY);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    c = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return crc_slice16(c, p, tail);
+}
+
+static int cpu_has_pclmul(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+static int cpu_has_sse42(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+// ----------------- CRC32C -----------------
+
+// Castagnoli polynomial (reflected 0x82F63B78): slicing-by-8 tables, or the
+// SSE4.2 crc32 instruction, which computes exactly this CRC.
+static uint32_t CRC32C_TAB[8][256];
+static int crc32c_hw = 0;
+
+static uint32_t crc32c_slice8(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 8) {
+        uint32_t a = load_le32(p) ^ c, b = load_le32(p + 4);
+        c = CRC32C_TAB[7][a & 0xFF] ^ CRC32C_TAB[6][(a >> 8) & 0xFF] ^ CRC32C_TAB[5][(a >> 16) & 0xFF] ^
+            CRC32C_TAB[4][a >> 24] ^ CRC32C_TAB[3][b & 0xFF] ^ CRC32C_TAB[2][(b >> 8) & 0xFF] ^
+            CRC32C_TAB[1][(b >> 16) & 0xFF] ^ CRC32C_TAB[0][b >> 24];
+        p += 8; n -= 8;
+    }
+    for (size_t i = 0; i < n; i++) c = CRC32C_TAB[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+#if VSFS_HAVE_PCLMUL
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t c, const uint8_t *p, size_t n) {
+#if defined(__x86_64__)
+    uint64_t c64 = c;
+    while (n >= 8) {
+        uint64_t v; memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+        p += 8; n -= 8;
+    }
+    c = (uint32_t)c64;
+#endif
+    while (n >= 4) {
+        uint32_t v; memcpy(&v, p, 4);
+        c = _mm_crc32_u32(c, v);
+        p += 4; n -= 4;
+    }
+    while (n-- > 0) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+uint32_t vsfs_crc32c(const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t*)data;
+#if VSFS_HAVE_PCLMUL
+    if (crc32c_hw) return crc32c_sse42(0xFFFFFFFFu, p, n) ^ 0xFFFFFFFFu;
+#endif
+    return crc32c_slice8(0xFFFFFFFFu, p, n) ^ 0xFFFFFFFFu;
+}
+
+void vsfs_crc32_init(void) {
+    if (crc_ready) return;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (0x82F63B78u ^ (c >> 1)) : (c >> 1);
+        CRC32C_TAB[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 8; k++)
+            CRC32C_TAB[k][i] = (CRC32C_TAB[k-1][i] >> 8) ^ CRC32C_TAB[0][CRC32C_TAB[k-1][i] & 0xFF];
+#if VSFS_HAVE_PCLMUL
+    crc32c_hw = cpu_has_sse42();
+#endif
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        CRC_TAB[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 16; k++)
+            CRC_TAB[k][i] = (CRC_TAB[k-1][i] >> 8) ^ CRC_TAB[0][CRC_TAB[k-1][i] & 0xFF];
+    crc_ready = 1;
+    vsfs_crc32_select(VSFS_CRC_AUTO);
+}
+
+int vsfs_crc32_select(vsfs_crc_impl_t impl) {
+    if (!crc_ready) vsfs_crc32_init();
+    if (impl == VSFS_CRC_AUTO) {
+#if VSFS_HAVE_PCLMUL
+        if (cpu_has_pclmul()) return vsfs_crc32_select(VSFS_CRC_PCLMUL);
+#endif
+        return vsfs_crc32_select(VSFS_CRC_SLICE16);
+    }
+    switch (impl) {
+    case VSFS_CRC_BYTEWISE: crc_engine = crc_bytewise; break;
+    case VSFS_CRC_SLICE8:   crc_engine = crc_slice8;   break;
+    case VSFS_CRC_SLICE16:  crc_engine = crc_slice16;  break;
+    case VSFS_CRC_PCLMUL:
+#if VSFS_HAVE_PCLMUL
+        if (!cpu_has_pclmul()) return -1;
+        crc_engine = crc_fold_pclmul;
+        break;
+#else
+        return -1;
+#endif
+    default: return -1;
+    }
+    crc_engine_id = impl;
+    return 0;
+}
+
+int vsfs_crc32c_select(vsfs_crc_impl_t impl) {
+    if (!crc_ready) vsfs_crc32_init();
+    switch (impl) {
+#if VSFS_HAVE_PCLMUL
+    case VSFS_CRC_AUTO:   crc32c_hw = cpu_has_sse42(); return 0;
+    case VSFS_CRC_SSE42:
+        if (!cpu_has_sse42()) return -1;
+        crc32c_hw = 1;
+        return 0;
+#else
+    case VSFS_CRC_AUTO:
+#endif
+    case VSFS_CRC_SLICE8: crc32c_hw = 0; return 0;
+    default:              return -1;
+    }
+}
+
+const char *vsfs_crc32c_impl_name(void) {
+    return crc32c_hw ? "sse42" : "slice8";
+}
+
+const char *vsfs_crc32_impl_name(void) {
+    switch (crc_engine_id) {
+    case VSFS_CRC_BYTEWISE: return "bytewise";
+    case VSFS_CRC_SLICE8:   return "slice8";
+    case VSFS_CRC_SLICE16:  return "slice16";
+    case VSFS_CRC_PCLMUL:   return "pclmul";
+    default:                return "none";
+    }
+}
+
+uint32_t vsfs_crc32_update(uint32_t crc, const void *data, size_t n) {
+    return crc_engine(crc ^ 0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t vsfs_crc32(const void *data, size_t n) {
+    return vsfs_crc32_update(0, data, n);
+}
@@ -0,0 +1,54 @@
+// Fast CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320) for MiniVSFS.
+//
+// Produces exactly the same values as the byte-wise crc32() reference kept in
+// the tools, using whichever engine the CPU supports:
+//   - PCLMULQDQ carry-less multiply folding (x86 with PCLMUL + SSE4.1)
+//   - slicing-by-16 / slicing-by-8 tables (any little-endian CPU)
+//   - the byte-wise table loop as the portable fallback
+#ifndef VSFS_CRC32_H
+#define VSFS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    VSFS_CRC_AUTO = 0,   // best engine available on this CPU
+    VSFS_CRC_BYTEWISE,
+    VSFS_CRC_SLICE8,
+    VSFS_CRC_SLICE16,
+    VSFS_CRC_PCLMUL,
+    VSFS_CRC_SSE42,      // CRC32C only: the SSE4.2 crc32 instruction
+} vsfs_crc_impl_t;
+
+// Build the tables and pick an engine from the CPU features.
+// Call once before any other function here (it is cheap and idempotent).
+void vsfs_crc32_init(void);
+
+// Force an engine; returns 0 on success, -1 if this CPU/build lacks it.
+int vsfs_crc32_select(vsfs_crc_impl_t impl);
+
+// Engine currently in use, e.g. "pclmul".
+const char *vsfs_crc32_impl_name(void);
+
+// CRC of n bytes, same result as the reference crc32(data, n).
+uint32_t vsfs_crc32(const void *data, size_t n);
+
+// Continue a CRC: vsfs_crc32_update(vsfs_crc32(a, n), b, m) equals the
+// CRC of a followed by b. Start from 0.
+uint32_t vsfs_crc32_update(uint32_t crc, const void *data, size_t n);
+
+// CRC32C (Castagnoli), with the SSE4.2 crc32 instruction where available.
+// Used where a block may embed CRC32s of its own contents: the CRC32 of a
+// message followed by its CRC32 is a constant, so CRC32 cannot tell such
+// blocks apart.
+uint32_t vsfs_crc32c(const void *data, size_t n);
+
+// Force the CRC32C engine: VSFS_CRC_SLICE8 (tables), VSFS_CRC_SSE42 or
+// VSFS_CRC_AUTO. Returns 0, or -1 if this CPU/build lacks it. Both give
+// the same values; tests use this to compare them.
+int vsfs_crc32c_select(vsfs_crc_impl_t impl);
+
+// CRC32C engine currently in use, "sse42" or "slice8".
+const char *vsfs_crc32c_impl_name(void);
+
+#endif
@@ -0,0 +1,321 @@
+// Batched positional I/O for MiniVSFS. See vsfs_io.h.
+#define _GNU_SOURCE
+#include "vsfs_io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define VSFS_HAVE_URING 1
+#else
+#define VSFS_HAVE_URING 0
+#endif
+
+#define IO_SQE_MAX   (1u << 30)   // bytes per submission; longer requests go in pieces
+
+typedef struct {
+    int       fd;
+    int       write;
+    uint8_t  *buf;
+    size_t    len;        // bytes still to move
+    uint64_t  off;
+} io_req_t;
+
+struct vsfs_io {
+    vsfs_io_kind_t kind;
+    unsigned  depth;
+    int       err;        // first failure since the last wait
+    uint64_t  calls, nread, nwritten;
+    io_req_t *req;        // depth slots
+    unsigned *free;       // free slot numbers, nfree of them
+    unsigned  nfree;
+    unsigned  queued;     // in the submission ring, not yet passed to the kernel
+    uint8_t  *fixed;      // registered region, or NULL
+    size_t    fixed_len;
+#if VSFS_HAVE_URING
+    int       ring;
+    void     *sq_map, *cq_map;
+    size_t    sq_len, cq_len;
+    struct io_uring_sqe *sqes;
+    size_t    sqes_len;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+// Move all of r with pread/pwrite.
+static void psync_run(vsfs_io_t *io, io_req_t *r) {
+    while (r->len > 0) {
+        ssize_t n = r->write ? pwrite(r->fd, r->buf, r->len, (off_t)r->off)
+                             : pread(r->fd, r->buf, r->len, (off_t)r->off);
+        io->calls++;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (!io->err) io->err = n < 0 ? errno : EIO;
+            return;
+        }
+        if (r->write) io->nwritten += (uint64_t)n;
+        else          io->nread += (uint64_t)n;
+        r->buf += n;
+        r->off += (uint64_t)n;
+        r->len -= (size_t)n;
+    }
+}
+
+#if VSFS_HAVE_URING
+static int uring_setup(vsfs_io_t *io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 2 * io->depth;
+    int fd = (int)syscall(__NR_io_uring_setup, io->depth, &p);
+    if (fd < 0) return -1;
+    io->ring = fd;
+    io->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_len > io->sq_len) io->sq_len = io->cq_len;
+        io->cq_len = 0;
+    }
+    io->sq_map = mmap(NULL, io->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    io->cq_map = io->sq_map;
+    if (io->sq_map != MAP_FAILED && io->cq_len)
+        io->cq_map = mmap(NULL, io->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = (struct io_uring_sqe*)mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          fd, IORING_OFF_SQES);
+    if (io->sq_map == MAP_FAILED || io->cq_map == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sqes != MAP_FAILED) munmap(io->sqes, io->sqes_len);
+        if (io->cq_len && io->cq_map != MAP_FAILED) munmap(io->cq_map, io->cq_len);
+        if (io->sq_map != MAP_FAILED) munmap(io->sq_map, io->sq_len);
+        close(fd);
+        return -1;
+    }
+    uint8_t *sq = (uint8_t*)io->sq_map, *cq = (uint8_t*)io->cq_map;
+    io->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    io->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + p.sq_off.array);
+    io->cq_head  = (unsigned*)(cq + p.cq_off.head);
+    io->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    io->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    io->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(vsfs_io_t *io) {
+    munmap(io->sqes, io->sqes_len);
+    if (io->cq_len) munmap(io->cq_map, io->cq_len);
+    munmap(io->sq_map, io->sq_len);
+    close(io->ring);
+}
+
+// Put slot i in the submission ring. There is always room: the ring has
+// at least depth entries and at most depth slots are busy.
+static void uring_push(vsfs_io_t *io, unsigned i) {
+    const io_req_t *r = &io->req[i];
+    unsigned tail = *io->sq_tail, idx = tail & *io->sq_mask;
+    struct io_uring_sqe *s = &io->sqes[idx];
+    int fixed = io->fixed && r->buf >= io->fixed && r->buf + r->len <= io->fixed + io->fixed_len;
+    memset(s, 0, sizeof(*s));
+    s->opcode = (uint8_t)(r->write ? (fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE)
+                                   : (fixed ? IORING_OP_READ_FIXED : IORING_OP_READ));
+    s->fd = r->fd;
+    s->addr = (uint64_t)(uintptr_t)r->buf;
+    s->len = (uint32_t)(r->len < IO_SQE_MAX ? r->len : IO_SQE_MAX);
+    s->off = r->off;
+    s->user_data = i;
+    io->sq_array[idx] = idx;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->queued++;
+}
+
+// Submit what is queued and wait for at least min completions.
+static int uring_enter(vsfs_io_t *io, unsigned min) {
+    for (;;) {
+        int n = (int)syscall(__NR_io_uring_enter, io->ring, io->queued, min, min ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        io->calls++;
+        if (n >= 0) {
+            io->queued -= (unsigned)n;
+            return 0;
+        }
+        if (errno != EINTR) return errno;
+    }
+}
+
+// Collect completions: finished slots are freed, short or interrupted
+// transfers go back in the ring for the rest.
+static void uring_reap(vsfs_io_t *io) {
+    unsigned head = *io->cq_head, tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *c = &io->cqes[head & *io->cq_mask];
+        unsigned i = (unsigned)c->user_data;
+        io_req_t *r = &io->req[i];
+        int res = c->res;
+        if (res == -EINTR || res == -EAGAIN) {
+            uring_push(io, i);
+            continue;
+        }
+        if (res == -EINVAL || res == -EOPNOTSUPP) {
+            psync_run(io, r);   // an opcode this kernel lacks; pread/pwrite gives the real verdict
+        } else if (res <= 0) {
+            if (!io->err) io->err = res < 0 ? -res : EIO;
+        } else {
+            if (r->write) io->nwritten += (uint64_t)res;
+            else          io->nread += (uint64_t)res;
+            r->buf += res;
+            r->off += (uint64_t)res;
+            r->len -= (size_t)res;
+            if (r->len) {
+                uring_push(io, i);
+                continue;
+            }
+        }
+        io->free[io->nfree++] = i;
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Wait until at least min slots have completed (or everything, for
+// min = depth), passing the ring to the kernel first.
+static void uring_drain(vsfs_io_t *io, unsigned min) {
+    while (io->nfree < min) {
+        int e = uring_enter(io, min - io->nfree);
+        if (e) {
+            // The ring itself failed: nothing more can be learnt about the
+            // requests in it.
+            if (!io->err) io->err = e;
+            io->nfree = 0;
+            for (unsigned i = 0; i < io->depth; i++) io->free[io->nfree++] = i;
+            io->queued = 0;
+            return;
+        }
+        uring_reap(io);
+    }
+}
+#endif
+
+int vsfs_io_parse_kind(const char *s, vsfs_io_kind_t *kind) {
+    if (strcmp(s, "auto") == 0)       *kind = VSFS_IO_AUTO;
+    else if (strcmp(s, "psync") == 0) *kind = VSFS_IO_PSYNC;
+    else if (strcmp(s, "uring") == 0) *kind = VSFS_IO_URING;
+    else return -1;
+    return 0;
+}
+
+int vsfs_io_parse_depth(const char *s, unsigned *depth) {
+    char *end;
+    if (*s < '0' || *s > '9') return -1;
+    unsigned long d = strtoul(s, &end, 10);
+    if (*end != '\0' || d < 1 || d > VSFS_IO_DEPTH_MAX) return -1;
+    *depth = (unsigned)d;
+    return 0;
+}
+
+vsfs_io_t *vsfs_io_new(vsfs_io_kind_t kind, unsigned depth) {
+    if (depth == 0) depth = VSFS_IO_DEPTH;
+    if (depth > VSFS_IO_DEPTH_MAX) depth = VSFS_IO_DEPTH_MAX;
+    vsfs_io_t *io = (vsfs_io_t*)calloc(1, sizeof(*io));
+    if (!io) return NULL;
+    io->depth = depth;
+    io->req = (io_req_t*)calloc(depth, sizeof(io_req_t));
+    io->free = (unsigned*)malloc(depth * sizeof(unsigned));
+    if (!io->req || !io->free) {
+        vsfs_io_free(io);
+        return NULL;
+    }
+    for (unsigned i = 0; i < depth; i++) io->free[io->nfree++] = depth - 1 - i;
+    io->kind = VSFS_IO_PSYNC;
+#if VSFS_HAVE_URING
+    if (kind != VSFS_IO_PSYNC && uring_setup(io) == 0) io->kind = VSFS_IO_URING;
+#else
+    (void)kind;
+#endif
+    return io;
+}
+
+void vsfs_io_free(vsfs_io_t *io) {
+    if (!io) return;
+#if VSFS_HAVE_URING
+    if (io->kind == VSFS_IO_URING) uring_teardown(io);
+#endif
+    free(io->req);
+    free(io->free);
+    free(io);
+}
+
+int vsfs_io_uring_available(unsigned depth) {
+    vsfs_io_t *probe = vsfs_io_new(VSFS_IO_URING, depth);
+    int ok = probe && probe->kind == VSFS_IO_URING;
+    vsfs_io_free(probe);
+    return ok;
+}
+
+vsfs_io_kind_t vsfs_io_kind(const vsfs_io_t *io) {
+    return io->kind;
+}
+
+const char *vsfs_io_name(const vsfs_io_t *io) {
+    return io->kind == VSFS_IO_URING ? "io_uring" : "psync";
+}
+
+int vsfs_io_register(vsfs_io_t *io, void *buf, size_t len) {
+#if VSFS_HAVE_URING
+    if (io->kind != VSFS_IO_URING) return EOPNOTSUPP;
+    if (io->fixed && syscall(__NR_io_uring_register, io->ring, IORING_UNREGISTER_BUFFERS, NULL, 0) != 0) return errno;
+    io->fixed = NULL;
+    struct iovec v = { buf, len };
+    if (syscall(__NR_io_uring_register, io->ring, IORING_REGISTER_BUFFERS, &v, 1) != 0) return errno;
+    io->fixed = (uint8_t*)buf;
+    io->fixed_len = len;
+    return 0;
+#else
+    (void)io; (void)buf; (void)len;
+    return EOPNOTSUPP;
+#endif
+}
+
+static int io_queue(vsfs_io_t *io, int fd, int write, void *buf, size_t len, uint64_t off) {
+    io_req_t r = { fd, write, (uint8_t*)buf, len, off };
+    if (len == 0) return io->err;
+    if (io->kind == VSFS_IO_PSYNC) {
+        psync_run(io, &r);
+        return io->err;
+    }
+#if VSFS_HAVE_URING
+    if (io->nfree == 0) uring_drain(io, 1);
+    unsigned i = io->free[--io->nfree];
+    io->req[i] = r;
+    uring_push(io, i);
+#endif
+    return io->err;
+}
+
+int vsfs_io_read(vsfs_io_t *io, int fd, void *buf, size_t len, uint64_t off) {
+    return io_queue(io, fd, 0, buf, len, off);
+}
+
+int vsfs_io_write(vsfs_io_t *io, int fd, const void *buf, size_t len, uint64_t off) {
+    return io_queue(io, fd, 1, (void*)buf, len, off);
+}
+
+int vsfs_io_wait(vsfs_io_t *io) {
+#if VSFS_HAVE_URING
+    if (io->kind == VSFS_IO_URING) uring_drain(io, io->depth);
+#endif
+    int e = io->err;
+    io->err = 0;
+    return e;
+}
+
+void vsfs_io_counters(const vsfs_io_t *io, uint64_t *calls, uint64_t *bytes_read, uint64_t *bytes_written) {
+    if (calls) *calls = io->calls;
+    if (bytes_read) *bytes_read = io->nread;
+    if (bytes_written) *bytes_written = io->nwritten;
+}
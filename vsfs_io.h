@@ -0,0 +1,75 @@
+// Batched positional I/O for MiniVSFS image and payload blocks.
+//
+// Requests are queued and run with up to depth of them in flight, through
+// one of two backends:
+//   - io_uring, driven with raw system calls (no liburing), so a batch
+//     costs a few io_uring_enter() calls however many requests it holds
+//   - pread/pwrite, one request at a time: the portable fallback, used
+//     whenever io_uring cannot be set up (old kernel, seccomp, ...)
+// Short transfers are resumed, so every request moves all of its bytes or
+// fails.
+#ifndef VSFS_IO_H
+#define VSFS_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    VSFS_IO_AUTO = 0,    // io_uring when the kernel allows it, else psync
+    VSFS_IO_PSYNC,
+    VSFS_IO_URING,       // as AUTO, but the caller asked for it by name
+} vsfs_io_kind_t;
+
+#define VSFS_IO_DEPTH     32    // default requests in flight
+#define VSFS_IO_DEPTH_MAX 4096  // most requests in flight
+
+// How a handle or a format does its I/O. All zeros: VSFS_IO_AUTO,
+// VSFS_IO_DEPTH, buffered.
+typedef struct {
+    vsfs_io_kind_t kind;
+    unsigned       depth;   // requests in flight, 1..VSFS_IO_DEPTH_MAX; 0 for VSFS_IO_DEPTH
+    int            direct;  // write image blocks with O_DIRECT where the filesystem allows
+} vsfs_io_opts_t;
+
+// The tools' --io and --io-depth values: "auto", "psync" or "uring", and
+// a whole number in 1..VSFS_IO_DEPTH_MAX. 0 with *kind or *depth set, or
+// -1 (left untouched).
+int vsfs_io_parse_kind(const char *s, vsfs_io_kind_t *kind);
+int vsfs_io_parse_depth(const char *s, unsigned *depth);
+
+typedef struct vsfs_io vsfs_io_t;
+
+// A queue with the given backend and depth (0 for VSFS_IO_DEPTH), or NULL
+// when out of memory. Never fails for want of io_uring.
+vsfs_io_t *vsfs_io_new(vsfs_io_kind_t kind, unsigned depth);
+void       vsfs_io_free(vsfs_io_t *io);
+
+// Whether a queue of this depth would get io_uring here, rather than
+// falling back to pread/pwrite (old kernel, seccomp, ...).
+int vsfs_io_uring_available(unsigned depth);
+
+// Backend actually in use: VSFS_IO_URING or VSFS_IO_PSYNC.
+vsfs_io_kind_t vsfs_io_kind(const vsfs_io_t *io);
+const char    *vsfs_io_name(const vsfs_io_t *io);
+
+// Register len bytes at buf (anonymous memory, e.g. from malloc) as a
+// fixed buffer, so requests inside it skip the per-request page pinning.
+// At most one region; 0, or an errno when the backend or the kernel
+// cannot (then requests simply go unregistered).
+int vsfs_io_register(vsfs_io_t *io, void *buf, size_t len);
+
+// Queue a read or write of len bytes at off in fd. The buffer must stay
+// untouched until vsfs_io_wait(). May block while depth requests are in
+// flight. Returns 0, or the errno of a request that already failed.
+int vsfs_io_read(vsfs_io_t *io, int fd, void *buf, size_t len, uint64_t off);
+int vsfs_io_write(vsfs_io_t *io, int fd, const void *buf, size_t len, uint64_t off);
+
+// Run everything queued to completion. Returns 0, or the errno of the
+// first request that failed (EIO for a read past end of file); the error
+// is then cleared.
+int vsfs_io_wait(vsfs_io_t *io);
+
+// System calls made and bytes moved so far (statistics).
+void vsfs_io_counters(const vsfs_io_t *io, uint64_t *calls, uint64_t *bytes_read, uint64_t *bytes_written);
+
+#endif
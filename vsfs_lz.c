@@ -0,0 +1,171 @@
+// LZ4-class block codec for MiniVSFS. See vsfs_lz.h.
+#include "vsfs_lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MINMATCH      4
+#define LASTLITERALS  5     // the last bytes of a block are always literals
+#define MFLIMIT       12    // no match may start closer than this to the end
+#define HASH_BITS     13
+#define SKIP_SHIFT    6     // step up the search stride after 2^6 misses
+
+#define WILD          16    // copy granule when both buffers have room to spare
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v; memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v; memcpy(&v, p, 8);
+    return v;
+}
+
+// Bytes p and r have in common, up to limit; eight at a time.
+static size_t common_len(const uint8_t *p, const uint8_t *r, const uint8_t *limit) {
+    const uint8_t *start = p;
+    while (p + 8 <= limit) {
+        uint64_t x = load64(p) ^ load64(r);
+        if (x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return (size_t)(p - start) + (size_t)__builtin_clzll(x) / 8;
+#else
+            return (size_t)(p - start) + (size_t)__builtin_ctzll(x) / 8;
+#endif
+        }
+        p += 8;
+        r += 8;
+    }
+    while (p < limit && *p == *r) {
+        p++;
+        r++;
+    }
+    return (size_t)(p - start);
+}
+
+// Copy n bytes in WILD-byte steps: may write up to WILD - 1 bytes past
+// dst + n, and src must not lie within WILD bytes ahead of dst.
+static inline void wild_copy(uint8_t *dst, const uint8_t *src, size_t n) {
+    uint8_t *end = dst + n;
+    do {
+        memcpy(dst, src, WILD);
+        dst += WILD;
+        src += WILD;
+    } while (dst < end);
+}
+
+// Multiplicative hash of four bytes (byte order only changes which slot).
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// A length field: the 4-bit token part, then 255-byte extensions.
+static uint8_t *put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Token, literals and (when mlen > 0) the match of one sequence, or NULL
+// when it does not fit before oend.
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit, size_t off, size_t mlen) {
+    size_t worst = 1 + nlit / 255 + 1 + nlit + (mlen ? 2 + (mlen - MINMATCH) / 255 + 1 : 0);
+    if ((size_t)(oend - op) < worst) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+    if (nlit >= 15) op = put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+    *op++ = (uint8_t)off;
+    *op++ = (uint8_t)(off >> 8);
+    mlen -= MINMATCH;
+    *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15) op = put_len(op, mlen - 15);
+    return op;
+}
+
+size_t vsfs_lz_compress(const void *src, size_t n, void *dst, size_t cap) {
+    const uint8_t *in = (const uint8_t*)src, *end = in + n, *anchor = in;
+    uint8_t *op = (uint8_t*)dst, *oend = op + cap;
+    if (n > VSFS_LZ_MAX) return 0;
+    // Last position seen per hash. Positions fit 16 bits; a stale or
+    // unset slot is harmless since every candidate is compared.
+    uint16_t tab[1u << HASH_BITS];
+    memset(tab, 0, sizeof(tab));
+    if (n > MFLIMIT) {
+        const uint8_t *ip = in + 1, *mlimit = end - MFLIMIT, *matchlimit = end - LASTLITERALS;
+        while (ip <= mlimit) {
+            uint32_t seq = load32(ip), h = lz_hash(seq);
+            const uint8_t *ref = in + tab[h];
+            tab[h] = (uint16_t)(ip - in);
+            if (ref >= ip || load32(ref) != seq) {
+                ip += 1 + ((size_t)(ip - anchor) >> SKIP_SHIFT);
+                continue;
+            }
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t mlen = MINMATCH + common_len(ip + MINMATCH, ref + MINMATCH, matchlimit);
+            op = put_seq(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), mlen);
+            if (!op) return 0;
+            ip += mlen;
+            anchor = ip;
+            if (ip <= mlimit) tab[lz_hash(load32(ip - 2))] = (uint16_t)(ip - 2 - in);
+        }
+    }
+    op = put_seq(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - (uint8_t*)dst) : 0;
+}
+
+// A length extension at *ip, added to len; -1 when src runs out.
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int vsfs_lz_decompress(const void *src, size_t n, void *dst, size_t out) {
+    const uint8_t *ip = (const uint8_t*)src, *iend = ip + n;
+    uint8_t *op = (uint8_t*)dst, *ostart = op, *oend = op + out;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_len(&ip, iend, &nlit) != 0) return -1;
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return -1;
+        if ((size_t)(iend - ip) >= nlit + WILD && (size_t)(oend - op) >= nlit + WILD) wild_copy(op, ip, nlit);
+        else memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) break;              // the last sequence has no match
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_len(&ip, iend, &mlen) != 0) return -1;
+        mlen += MINMATCH;
+        if (off == 0 || off > (size_t)(op - ostart) || (size_t)(oend - op) < mlen) return -1;
+        const uint8_t *m = op - off;
+        if (off >= WILD && (size_t)(oend - op) >= mlen + WILD) {
+            wild_copy(op, m, mlen);
+            op += mlen;
+            continue;
+        }
+        // An overlapping match repeats the last off bytes; copy in chunks
+        // that double, each one whole periods from the match start.
+        while (mlen > 0) {
+            size_t c = (size_t)(op - m);
+            if (c > mlen) c = mlen;
+            memcpy(op, m, c);
+            op += c;
+            mlen -= c;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
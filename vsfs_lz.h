@@ -0,0 +1,26 @@
+// LZ4-class block codec for MiniVSFS compressed files.
+//
+// Blocks use the LZ4 block format (sequences of a token byte, literals, a
+// 16-bit little-endian match offset and match length extensions), so any
+// LZ4 block decoder reads them; there is no frame format and no external
+// dependency. The compressor is the greedy single-probe kind: fast, and
+// good enough on text and configuration files.
+#ifndef VSFS_LZ_H
+#define VSFS_LZ_H
+
+#include <stddef.h>
+
+// Largest input one block may hold (match offsets are 16-bit).
+#define VSFS_LZ_MAX (64u * 1024u)
+
+// Compress n <= VSFS_LZ_MAX bytes of src into dst. Returns the compressed
+// length, or 0 when it would not fit in cap bytes (pass cap < n to keep
+// only blocks that shrink).
+size_t vsfs_lz_compress(const void *src, size_t n, void *dst, size_t cap);
+
+// Decompress the n-byte block src into exactly out bytes at dst. Returns
+// 0, or -1 when src is malformed or does not decode to out bytes; dst is
+// never written past out bytes either way.
+int vsfs_lz_decompress(const void *src, size_t n, void *dst, size_t out);
+
+#endif